@@ -0,0 +1,32 @@
+#!/bin/bash
+set -euo pipefail
+
+# Build the flow table and IDT code of nfp_net_common.c (between its
+# "BEGIN ..." and "END ..." comments) in userspace, with flow_bench,
+# idt_bench and idt_sweep (which also builds the IDT decoding of the
+# firmware notify.c), and run them:
+#   ./build.sh            build and run
+#   ./build.sh -n 200000  pass options to flow_bench
+#   ./build.sh --no-run   only build
+
+cd "$(dirname "$0")"
+
+CC="${CC:-gcc}"
+CFLAGS="${CFLAGS:--O2 -g}"
+
+sed -n '\|^/\* BEGIN |,\|^/\* END |p' ../nfp_net_common.c > driver.inc
+sed -n '\|^/\* BEGIN |,\|^/\* END |p' ../../modified-nfd-firmware/notify.c \
+  > firmware.inc
+
+for prog in flow_bench idt_bench idt_sweep; do
+  $CC -std=gnu11 $CFLAGS -Wall -Wno-unused-function -pthread \
+      -o "$prog" "$prog.c" -lm
+done
+
+if [ "${1:-}" = "--no-run" ]; then
+  exit 0
+fi
+
+./flow_bench "$@"
+./idt_bench
+./idt_sweep
@@ -0,0 +1,296 @@
+/*
+ * @file          modified-nfd-driver/bench/flow_bench.c
+ * @brief         Cost of assigning flow IDs on the TX path, per skb, with
+ *                1 to 64 CPUs sending at once
+ *
+ * Runs nfp_net_tx_set_flow_id() of nfp_net_common.c (see build.sh), the
+ * flow table lookup it does when its per CPU (here per thread) socket
+ * cache misses, and as baseline the table before it was hashed: 31 slots
+ * scanned in order, written without atomics. Every thread sends skbs of its own flows (round robin,
+ * 44 segments each, so all flows qualify for pacing) for the same number
+ * of skbs.
+ *
+ * Reported per table and thread count: CPU time per skb (of the thread,
+ * so it stays meaningful with more threads than CPUs), flow ID changes
+ * per flow after its first skb (a slot taken over by another flow, or
+ * claimed twice), skbs not paced, and flows whose last skb went with the
+ * same ID as the last skb of another flow.
+ *
+ * usage: flow_bench [-n skbs] [-t max threads] [-f flows per thread]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kernel_shim.h"
+
+volatile unsigned long jiffies = 1;
+
+#include "driver.inc"
+
+/* Baseline: the table before it was hashed */
+#define SCAN_FLOW_SLOTS		31U
+
+#define time_after_eq(a, b)	((long)((a) - (b)) >= 0)
+
+struct scan_flow_state_entry {
+	u32 hash;
+	unsigned long expires;
+	bool rate_sent;
+};
+static struct scan_flow_state_entry scan_flow_state[SCAN_FLOW_SLOTS];
+
+static void scan_set_flow_id(struct nfp_net_tx_pace *pace,
+			     struct sk_buff *skb)
+{
+	u32 flowId = 0;
+	u32 flow_hash;
+	unsigned long now;
+	u32 i;
+
+	pace->flow_id = 0;
+	flow_hash = skb_get_hash(skb);
+	if (unlikely(!flow_hash))
+		return;
+
+	for (i = 0; i < SCAN_FLOW_SLOTS; i++) {
+		if (READ_ONCE(scan_flow_state[i].hash) == flow_hash) {
+			flowId = i + 1;
+			break;
+		}
+	}
+	if (!flowId) {
+		if (skb_shinfo(skb)->gso_segs < nfp_pace_burst_segs)
+			return;
+		now = jiffies;
+		for (i = 0; i < SCAN_FLOW_SLOTS; i++) {
+			if (READ_ONCE(scan_flow_state[i].hash) == 0 ||
+			    time_after_eq(now, scan_flow_state[i].expires)) {
+				flowId = i + 1;
+				break;
+			}
+		}
+		if (!flowId)
+			return;
+		WRITE_ONCE(scan_flow_state[flowId - 1].hash, flow_hash);
+		WRITE_ONCE(scan_flow_state[flowId - 1].rate_sent, false);
+	}
+	WRITE_ONCE(scan_flow_state[flowId - 1].expires,
+		   jiffies + nfp_flow_timeout_j());
+	pace->flow_id = flowId;
+}
+
+static void hash_reset(void)
+{
+	memset(flow_state, 0, sizeof(flow_state));
+}
+
+static void scan_reset(void)
+{
+	memset(scan_flow_state, 0, sizeof(scan_flow_state));
+}
+
+static const struct table {
+	const char *name;
+	void (*set_flow_id)(struct nfp_net_tx_pace *pace,
+			    struct sk_buff *skb);
+	void (*reset)(void);
+} tables[] = {
+	{ "cache", nfp_net_tx_set_flow_id, hash_reset },
+	{ "hash", nfp_net_tx_flow_lookup, hash_reset },
+	{ "scan", scan_set_flow_id, scan_reset },
+};
+
+#define MAX_THREADS	64
+#define MAX_FLOWS	16
+
+struct flow {
+	u32 hash;
+	u32 flow_id;		/* of the last skb */
+	u32 paced_id;		/* of the last paced skb */
+	unsigned long changes;
+	unsigned long unpaced;
+};
+
+struct thread {
+	pthread_t tid;
+	const struct table *table;
+	struct flow flows[MAX_FLOWS];
+	u64 cpu_ns;
+} __attribute__((aligned(64)));
+
+static struct thread threads[MAX_THREADS];
+static pthread_barrier_t start_barrier;
+static unsigned long num_skbs = 1000000;
+static unsigned int num_flows = 4;
+static volatile int stop_ticker;
+
+static u64 thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *ticker(void *arg)
+{
+	struct timespec ms = { 0, 1000000 };
+
+	while (!stop_ticker) {
+		nanosleep(&ms, NULL);
+		jiffies++;
+	}
+	return NULL;
+}
+
+static void *sender(void *arg)
+{
+	struct thread *t = arg;
+	struct nfp_net_tx_pace pace;
+	struct sk_buff skb;
+	struct flow *f;
+	unsigned long i;
+	u64 start;
+
+	skb.shinfo.gso_segs = 44;
+	pthread_barrier_wait(&start_barrier);
+
+	start = thread_cpu_ns();
+	for (i = 0; i < num_skbs; i++) {
+		f = &t->flows[i % num_flows];
+		/* Each flow is a socket of its own */
+		skb.sk = (struct sock *)f;
+		skb.hash = f->hash;
+		t->table->set_flow_id(&pace, &skb);
+
+		if (!pace.flow_id)
+			f->unpaced++;
+		else if (f->paced_id && pace.flow_id != f->paced_id)
+			f->changes++;
+		if (pace.flow_id)
+			f->paced_id = pace.flow_id;
+		f->flow_id = pace.flow_id;
+	}
+	t->cpu_ns = thread_cpu_ns() - start;
+	return NULL;
+}
+
+static u32 rnd_state = 0x9e3779b9;
+
+static u32 rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static void run(const struct table *table, unsigned int num_threads)
+{
+	unsigned long changes = 0, unpaced = 0, shared = 0;
+	unsigned int i, j, k, l;
+	u64 cpu_ns = 0;
+
+	table->reset();
+	rnd_state = 0x9e3779b9;
+	for (i = 0; i < num_threads; i++) {
+		memset(&threads[i], 0, sizeof(threads[i]));
+		threads[i].table = table;
+		for (j = 0; j < num_flows; j++) {
+			do
+				threads[i].flows[j].hash = rnd();
+			while (!threads[i].flows[j].hash);
+		}
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, num_threads);
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&threads[i].tid, NULL, sender, &threads[i]);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i].tid, NULL);
+	pthread_barrier_destroy(&start_barrier);
+
+	for (i = 0; i < num_threads; i++) {
+		cpu_ns += threads[i].cpu_ns;
+		for (j = 0; j < num_flows; j++) {
+			struct flow *f = &threads[i].flows[j];
+
+			changes += f->changes;
+			unpaced += f->unpaced;
+			if (!f->flow_id)
+				continue;
+			/* Same ID as a flow counted before */
+			for (k = 0; k <= i; k++) {
+				for (l = 0; l < (k == i ? j : num_flows); l++) {
+					if (threads[k].flows[l].flow_id ==
+					    f->flow_id)
+						goto found;
+				}
+			}
+			continue;
+found:
+			shared++;
+		}
+	}
+
+	printf("%-5s %7u %8.1f %13.3f %10.2f %7lu\n", table->name,
+	       num_threads, (double)cpu_ns / (num_threads * num_skbs),
+	       (double)changes / (num_threads * num_flows),
+	       100.0 * unpaced / (num_threads * num_skbs), shared);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int max_threads = MAX_THREADS;
+	unsigned int num_threads, i;
+	pthread_t ticker_tid;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:t:f:")) != -1) {
+		switch (opt) {
+		case 'n':
+			num_skbs = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			max_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			num_flows = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n skbs] [-t max threads] "
+				"[-f flows per thread]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!num_skbs || !num_flows || num_flows > MAX_FLOWS ||
+	    !max_threads || max_threads > MAX_THREADS) {
+		fprintf(stderr, "%s: 1 to %u flows per thread, 1 to %u "
+			"threads\n", argv[0], MAX_FLOWS, MAX_THREADS);
+		return 1;
+	}
+
+	printf("%lu skbs per thread, %u flows per thread, %ld CPUs online, "
+	       "%u hash slots, %u scan slots\n", num_skbs, num_flows,
+	       sysconf(_SC_NPROCESSORS_ONLN), NFP_FLOW_SLOTS,
+	       SCAN_FLOW_SLOTS);
+	printf("%-5s %7s %8s %13s %10s %7s\n", "table", "threads", "ns/skb",
+	       "changes/flow", "unpaced %", "shared");
+
+	pthread_create(&ticker_tid, NULL, ticker, NULL);
+	for (i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+		for (num_threads = 1; num_threads <= max_threads;
+		     num_threads *= 2)
+			run(&tables[i], num_threads);
+	}
+	stop_ticker = 1;
+	pthread_join(ticker_tid, NULL);
+
+	return 0;
+}
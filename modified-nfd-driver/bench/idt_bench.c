@@ -0,0 +1,209 @@
+/*
+ * @file          modified-nfd-driver/bench/idt_bench.c
+ * @brief         Cost of the IDT of a paced skb: 64 bit division per skb,
+ *                or nfp_net_tx_idt() of nfp_net_common.c
+ *
+ * Replays the same trace through both: 64 flows with rates spread evenly
+ * on a log scale from 1 Mbit/s to 25 Gbit/s, 70% of skbs TSO (1514 B
+ * segments) and the rest 64 to 1514 B. Every so many of its skbs, a flow
+ * changes its rate to within 12.5% of where it started, as sk_pacing_rate
+ * does with TCP (each ACK may update it).
+ *
+ * Reported per rate change interval: time per skb (ns, and TSC cycles on
+ * x86) of each, best of 5 runs, and how far nfp_net_tx_idt() is from
+ * the division (in 1/256 ns).
+ *
+ * usage: idt_bench [-n skbs]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "kernel_shim.h"
+
+volatile unsigned long jiffies = 1;
+
+#include "driver.inc"
+
+#define NUM_FLOWS	64
+#define NUM_RUNS	5
+
+struct skb_desc {
+	u32 flow;
+	u32 packet_size;
+	unsigned long pacing_rate;
+};
+
+static struct flow_cache_entry flows[NUM_FLOWS];
+static struct skb_desc *trace;
+static unsigned long num_skbs = 1 << 20;
+static u64 *idts[2];
+
+static u32 rnd_state = 0x9e3779b9;
+
+static u32 rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static double rnd_unit(void)
+{
+	return (double)rnd() / 4294967296.0;
+}
+
+static void make_trace(unsigned int change_every)
+{
+	unsigned long base[NUM_FLOWS], rates[NUM_FLOWS];
+	unsigned int sent[NUM_FLOWS] = { 0 };
+	unsigned long i;
+	unsigned int f;
+
+	rnd_state = 0x9e3779b9;
+	for (f = 0; f < NUM_FLOWS; f++) {
+		double bits = 1e6 * pow(25e9 / 1e6, (double)f / (NUM_FLOWS - 1));
+
+		base[f] = rates[f] = bits / 8;
+	}
+
+	for (i = 0; i < num_skbs; i++) {
+		f = rnd() % NUM_FLOWS;
+		if (change_every && ++sent[f] % change_every == 0)
+			rates[f] = base[f] * (0.875 + rnd_unit() / 4);
+		trace[i].flow = f;
+		trace[i].pacing_rate = rates[f];
+		trace[i].packet_size = rnd() % 10 < 7 ? 1514 :
+				       64 + rnd() % (1514 - 64 + 1);
+	}
+}
+
+static void run_div(u64 *idt)
+{
+	unsigned long i;
+
+	for (i = 0; i < num_skbs; i++)
+		idt[i] = DIV_ROUND_UP(((u64)trace[i].packet_size *
+				       NSEC_PER_SEC) << NFP_PACE_IDT_FRAC,
+				      (u64)trace[i].pacing_rate);
+}
+
+static void run_recip(u64 *idt)
+{
+	unsigned long i;
+
+	for (i = 0; i < num_skbs; i++)
+		idt[i] = nfp_net_tx_idt(&flows[trace[i].flow],
+					trace[i].packet_size,
+					trace[i].pacing_rate);
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static u64 now_tsc(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void time_path(void (*run)(u64 *idt), u64 *idt, double *ns,
+		      double *cycles)
+{
+	u64 t0, c0, t, c;
+	unsigned int r;
+
+	*ns = *cycles = 1e99;
+	for (r = 0; r < NUM_RUNS; r++) {
+		/* Every run starts with cold reciprocals */
+		memset(flows, 0, sizeof(flows));
+		t0 = now_ns();
+		c0 = now_tsc();
+		run(idt);
+		c = now_tsc() - c0;
+		t = now_ns() - t0;
+		if ((double)t / num_skbs < *ns)
+			*ns = (double)t / num_skbs;
+		if ((double)c / num_skbs < *cycles)
+			*cycles = (double)c / num_skbs;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	static const unsigned int change_every[] = { 1, 4, 16, 256, 0 };
+	double div_ns, div_cyc, recip_ns, recip_cyc;
+	unsigned long i, differ;
+	unsigned int c;
+	int64_t err, max_err;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			num_skbs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n skbs]\n", argv[0]);
+			return 1;
+		}
+	}
+	trace = calloc(num_skbs, sizeof(*trace));
+	idts[0] = calloc(num_skbs, sizeof(u64));
+	idts[1] = calloc(num_skbs, sizeof(u64));
+	if (!num_skbs || !trace || !idts[0] || !idts[1]) {
+		fprintf(stderr, "%s: can't allocate %lu skbs\n", argv[0],
+			num_skbs);
+		return 1;
+	}
+
+	printf("%lu skbs, %u flows, 1 Mbit/s to 25 Gbit/s, "
+	       "cycles are TSC cycles\n", num_skbs, NUM_FLOWS);
+	printf("%-12s %8s %10s %8s %10s %8s %8s\n", "rate change",
+	       "div ns", "div cyc", "rcp ns", "rcp cyc", "max err",
+	       "differ %");
+
+	for (c = 0; c < sizeof(change_every) / sizeof(change_every[0]); c++) {
+		make_trace(change_every[c]);
+		time_path(run_div, idts[0], &div_ns, &div_cyc);
+		time_path(run_recip, idts[1], &recip_ns, &recip_cyc);
+
+		max_err = 0;
+		differ = 0;
+		for (i = 0; i < num_skbs; i++) {
+			err = (int64_t)(idts[1][i] - idts[0][i]);
+			if (err)
+				differ++;
+			if (llabs(err) > llabs(max_err))
+				max_err = err;
+		}
+
+		if (change_every[c])
+			printf("1/%-10u", change_every[c]);
+		else
+			printf("%-12s", "never");
+		printf(" %8.2f %10.2f %8.2f %10.2f %8lld %8.2f\n", div_ns,
+		       div_cyc, recip_ns, recip_cyc, (long long)max_err,
+		       100.0 * differ / num_skbs);
+	}
+
+	return 0;
+}
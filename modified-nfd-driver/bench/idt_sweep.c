@@ -0,0 +1,90 @@
+/*
+ * @file          modified-nfd-driver/bench/idt_sweep.c
+ * @brief         Error of the IDT from driver to firmware, for every rate
+ *                from 1 Mbit/s to 100 Gbit/s
+ *
+ * For each rate (in 1 Mbit/s steps) and packet size, runs the IDT through
+ * nfp_net_tx_idt() and nfp_net_tx_idt_encode() of nfp_net_common.c, and
+ * pq_idt_ticks() of notify.c. All IDTs here are below the firmware horizon,
+ * so the driver doesn't clamp them.
+ *
+ * Reported per decade of rates and packet size, the largest relative error
+ * against the exact IDT of:
+ *  - ns word: the IDT word as it was before, whole ns rounded up and
+ *    clamped to 0.5 ms (as it was for skbs that are not TSO)
+ *  - IDT word: the IDT word as encoded now
+ *  - ticks: the ticks firmware waits (20 ns each, with a 16 bit fraction
+ *    it carries from packet to packet)
+ *
+ * usage: idt_sweep
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include "kernel_shim.h"
+
+volatile unsigned long jiffies = 1;
+
+#include "driver.inc"
+
+#define __intrinsic static inline
+#include "firmware.inc"
+
+#define TICK_NS		20.0
+#define OLD_MAX_IDT_NS	500000ULL
+
+static const u32 sizes[] = { 64, 1514, 9014 };
+
+static double rel_err(double val, double exact)
+{
+	return fabs(val - exact) / exact;
+}
+
+int
+main(void)
+{
+	double exact, ns_err, word_err, tick_err;
+	struct flow_cache_entry c = { 0 };
+	u64 mbps, decade, idt, old;
+	unsigned int s;
+	u32 word;
+
+	printf("%-22s %6s %12s %12s %12s\n", "rate (Mbit/s)", "bytes",
+	       "ns word", "IDT word", "ticks");
+
+	for (decade = 1; decade < 100000; decade *= 10) {
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			ns_err = word_err = tick_err = 0;
+			for (mbps = decade; mbps <= 10 * decade; mbps++) {
+				unsigned long rate = mbps * 1000000 / 8;
+
+				exact = (double)sizes[s] * 1e9 / rate;
+
+				old = DIV_ROUND_UP((u64)sizes[s] *
+						   NSEC_PER_SEC, (u64)rate);
+				if (old > OLD_MAX_IDT_NS)
+					old = OLD_MAX_IDT_NS;
+
+				idt = nfp_net_tx_idt(&c, sizes[s], rate);
+				word = nfp_net_tx_idt_encode(idt);
+				idt = (u64)(word & PQ_IDT_MANT_MASK) <<
+				      (word >> PQ_IDT_MANT_BITS);
+
+				ns_err = fmax(ns_err, rel_err(old, exact));
+				word_err = fmax(word_err,
+						rel_err(idt / 256.0, exact));
+				tick_err = fmax(tick_err,
+						rel_err(pq_idt_ticks(word) *
+							TICK_NS / 65536,
+							exact));
+			}
+			printf("%9llu - %-10llu %6u %11.4f%% %11.6f%% "
+			       "%11.4f%%\n", (unsigned long long)decade,
+			       (unsigned long long)decade * 10, sizes[s],
+			       100 * ns_err, 100 * word_err, 100 * tick_err);
+		}
+	}
+
+	return 0;
+}
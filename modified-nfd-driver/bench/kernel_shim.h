@@ -0,0 +1,115 @@
+/*
+ * @file          modified-nfd-driver/bench/kernel_shim.h
+ * @brief         The few kernel definitions the flow table code in
+ *                nfp_net_common.c uses, for building it in userspace
+ */
+
+#ifndef _KERNEL_SHIM_H_
+#define _KERNEL_SHIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
+#define READ_ONCE(x)		(*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)	(*(volatile __typeof__(x) *)&(x) = (v))
+
+#define NSEC_PER_SEC	1000000000L
+
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define clamp(v, lo, hi)	((v) < (lo) ? (lo) : (v) > (hi) ? (hi) : (v))
+
+/* Module parameters are plain variables here */
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+#define BIT_ULL(n)		(1ULL << (n))
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline u64 div64_u64(u64 dividend, u64 divisor)
+{
+	return dividend / divisor;
+}
+
+static inline u64 mul_u64_u32_shr(u64 a, u32 mul, unsigned int shift)
+{
+	return (u64)(((unsigned __int128)a * mul) >> shift);
+}
+
+#define ____cacheline_aligned_in_smp	__attribute__((aligned(64)))
+
+/* Kernel atomic64 ops with a return value are fully ordered */
+typedef struct {
+	s64 counter;
+} atomic64_t;
+
+static inline s64 atomic64_read(const atomic64_t *v)
+{
+	return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
+}
+
+static inline s64 atomic64_cmpxchg(atomic64_t *v, s64 old, s64 new)
+{
+	__atomic_compare_exchange_n(&v->counter, &old, new, false,
+				    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+	return old;
+}
+
+/* HZ=1000, jiffies is advanced by a thread of the benchmark */
+extern volatile unsigned long jiffies;
+#define msecs_to_jiffies(m)	((unsigned long)(m))
+
+#define GOLDEN_RATIO_32 0x61C88647
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+	return (val * GOLDEN_RATIO_32) >> (32 - bits);
+}
+
+#define GOLDEN_RATIO_64 0x61C8864680B583EBull
+static inline u32 hash_ptr(const void *ptr, unsigned int bits)
+{
+	return ((u64)(unsigned long)ptr * GOLDEN_RATIO_64) >> (64 - bits);
+}
+
+/* Threads stand in for CPUs */
+#define DEFINE_PER_CPU(type, name)	__thread type name
+#define this_cpu_ptr(ptr)		(ptr)
+#define this_cpu_inc(pcp)		((pcp)++)
+
+struct sock;
+
+struct skb_shared_info {
+	unsigned short gso_segs;
+};
+
+struct sk_buff {
+	struct sock *sk;
+	u32 hash;
+	struct skb_shared_info shinfo;
+};
+
+static inline u32 skb_get_hash(struct sk_buff *skb)
+{
+	return skb->hash;
+}
+
+static inline struct skb_shared_info *skb_shinfo(struct sk_buff *skb)
+{
+	return &skb->shinfo;
+}
+
+struct nfp_net_tx_pace {
+	u32 flow_id;	/* 0 = not paced */
+	struct flow_cache_entry *cache;
+};
+
+#endif /* !_KERNEL_SHIM_H_ */
@@ -47,6 +47,9 @@
 #include <linux/vmalloc.h>
 #include <linux/ktime.h>
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+#include <net/pkt_sched.h>
+#endif
 #ifdef COMPAT__HAVE_TLS_OFFLOAD
 #include <net/tls.h>
 #endif
@@ -54,9 +57,11 @@
 #include <net/vxlan.h>
 #endif
 
+#include "nfpcore/nfp_nffw.h"
 #include "nfpcore/nfp_nsp.h"
 #include "ccm.h"
 #include "nfp_app.h"
+#include "nfp_main.h"
 #include "nfp_net_ctrl.h"
 #include "nfp_net.h"
 #include "nfp_net_sriov.h"
@@ -64,19 +69,179 @@
 #include "crypto/crypto.h"
 
 #include <linux/jiffies.h>
+#include <linux/hash.h>
+#include <linux/jump_label.h>
+#include <linux/math64.h>
+
+/* Max time (in ns) a paced TSO burst may span, covered by the firmware
+   coarse pacing wheel (~84 ms horizon, keep some margin) */
+#define NFP_PACE_HORIZON_NS	(80ULL * NSEC_PER_MSEC)
+
+/* Pacing info is sent to the firmware as TX metadata, in the first field
+   after the meta ID word. The firmware strips it before the app sees it.
+	PACING:		be32 flow ID, be32 IDT
+	PACING_EDT:	be32 flow ID, be32 IDT, be32 delay in ns
+   With RATE flag set in flow ID, the IDT word is instead the new rate of
+   the flow (ns per byte, 16 bit fraction), kept by firmware for the flow */
+#define NFP_NET_META_PACING		14
+#define NFP_NET_META_PACING_LEN		8
+#define NFP_NET_META_PACING_EDT		15
+#define NFP_NET_META_PACING_EDT_LEN	12
+#define NFP_NET_META_PACING_RATE	BIT(31)
+
+struct nfp_net_tx_pace {
+	u32 flow_id;	/* 0 = not paced */
+	u32 idt;	/* IDT word, see nfp_net_tx_idt_encode() */
+	bool edt;	/* first packet of skb departs after delay_ns */
+	u32 delay_ns;
+	bool rate;	/* send ns_per_byte instead of idt */
+	u32 ns_per_byte;
+	struct flow_cache_entry *cache;	/* of skb->sk on this CPU, or NULL */
+};
+
+/* Firmware rate mode: send the rate of a flow only when it changes, and let
+   firmware derive the gap after each packet from its length */
+static bool nfp_pace_fw_rate;
+module_param(nfp_pace_fw_rate, bool, 0644);
+MODULE_PARM_DESC(nfp_pace_fw_rate,
+		 "Keep flow pacing rates in firmware (default = false)");
+
+/* EDT mode: depart skbs at skb->tstamp (set by fq/BBR), instead of
+   deriving departure times from sk_pacing_rate alone */
+static bool nfp_pace_edt;
+module_param(nfp_pace_edt, bool, 0644);
+MODULE_PARM_DESC(nfp_pace_edt,
+		 "Pace TX by skb->tstamp departure times (EDT) (default = false)");
+
+/* Runtime configuration of firmware pacing (pq_config of notify.c), written
+   to firmware each time a vNIC is enabled or a TX queue max rate is set,
+   and to running vNICs when one of these is written, 0 = firmware default */
+static int nfp_pace_fw_param_set(const char *val,
+				 const struct kernel_param *kp);
+
+static const struct kernel_param_ops nfp_pace_fw_param_ops = {
+	.set = nfp_pace_fw_param_set,
+	.get = param_get_uint,
+};
 
-#define NFP_FLOW_SLOTS		31U
-#define BURST_THRESH		26U
-#define NFP_FLOW_TIMEOUT_J	msecs_to_jiffies(10)
+static unsigned int nfp_pace_fw_future_slots;
+module_param_cb(nfp_pace_fw_future_slots, &nfp_pace_fw_param_ops,
+		&nfp_pace_fw_future_slots, 0644);
+MODULE_PARM_DESC(nfp_pace_fw_future_slots,
+		 "Firmware keeps packets up to this many 640 ns slots ahead in its fine queue, later ones in its coarse wheel (2048-3904, default = 0: 3072)");
+
+static unsigned int nfp_pace_fw_occupancy_high;
+module_param_cb(nfp_pace_fw_occupancy_high, &nfp_pace_fw_param_ops,
+		&nfp_pace_fw_occupancy_high, 0644);
+MODULE_PARM_DESC(nfp_pace_fw_occupancy_high,
+		 "Firmware holds back TX while more packets than this are paced (default = 0: 3072)");
+
+static unsigned int nfp_pace_fw_occupancy_low;
+module_param_cb(nfp_pace_fw_occupancy_low, &nfp_pace_fw_param_ops,
+		&nfp_pace_fw_occupancy_low, 0644);
+MODULE_PARM_DESC(nfp_pace_fw_occupancy_low,
+		 "Firmware holds back TX until fewer packets than this are paced (default = 0: 2048)");
+
+/* Pacing state of each vNIC with a netdev, from nfp_net_init() to
+   nfp_net_clean(). It is kept in a list rather than in struct nfp_net, so
+   nfp_net.h stays as upstream has it. The TX path walks the list under
+   RCU, only while some queue has ETF offload (nfp_pace_etf_queues),
+   changes to it take nfp_pace_vnics_lock */
+struct nfp_pace_vnic {
+	struct list_head list;
+	struct rcu_head rcu;
+	struct nfp_net *nn;
+	/* TX queues with ETF (SO_TXTIME launch time) offload */
+	DECLARE_BITMAP(etf_queues, NFP_NET_MAX_TX_RINGS);
+};
+static LIST_HEAD(nfp_pace_vnics);
+static DEFINE_MUTEX(nfp_pace_vnics_lock);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+/* Counts TX queues with ETF offload over all vNICs, so skbs with a
+   timestamp only look up their vNIC while there are any */
+static DEFINE_STATIC_KEY_FALSE(nfp_pace_etf_queues);
+#endif
+
+/* Serializes writers of the pacing config of firmware, which all vNICs of
+   a device share, see nfp_pace_write_fw_config() */
+static DEFINE_MUTEX(nfp_pace_fw_config_lock);
 
 /* K: pacing modifications
    Store print call counter for each CPU */
 // static DEFINE_PER_CPU(u32, printk_call_counter);
+
+/* BEGIN flow table (also built in userspace, see bench/build.sh) */
+
+/* Only flows sending skbs of this many segments get a flow ID */
+static unsigned int nfp_pace_burst_segs = 26;
+module_param(nfp_pace_burst_segs, uint, 0644);
+MODULE_PARM_DESC(nfp_pace_burst_segs,
+		 "Pace flows sending skbs of at least this many segments (default = 26)");
+
+/* Keep flow ID until its last scheduled departure has passed, so a new
+   flow never inherits departure times of the previous one: firmware keeps
+   the last departure of each ID, up to NFP_PACE_HORIZON_NS ahead, so the
+   timeout is at least that and some margin. It is only set at load, as a
+   shorter timeout would make slots refreshed with the longer one look
+   expired while their flow is live */
+#define NFP_FLOW_TIMEOUT_MIN_MS	100U
+#define NFP_FLOW_TIMEOUT_MAX_MS	10000U
+
+static unsigned int nfp_pace_flow_timeout_ms = 100;
+module_param(nfp_pace_flow_timeout_ms, uint, 0444);
+MODULE_PARM_DESC(nfp_pace_flow_timeout_ms,
+		 "Free flow IDs this long after the last skb of their flow, at least the 80 ms pacing horizon and margin, so a new flow does not inherit departures of the last one (100-10000, default = 100)");
+
+/* The flow hash picks a bucket of NFP_FLOW_WAYS slots filling one cache
+   line, so a lookup touches one line instead of scanning the table. Flow ID
+   of slot i is i + 1 (0 = not paced), firmware keeps state for 4095 IDs */
+#define NFP_FLOW_WAYS		4U
+#define NFP_FLOW_BUCKET_BITS	9
+#define NFP_FLOW_SLOTS		(NFP_FLOW_WAYS << NFP_FLOW_BUCKET_BITS)
+
+/* Rate of a slot until one is sent for its flow (~0UL is sent as 0) */
+#define NFP_FLOW_RATE_UNSENT	(~0UL)
+
 struct flow_state_entry {
+	atomic64_t key;		/* expires (jiffies) << 32 | hash, 0 = free */
+	unsigned long rate;	/* last rate sent to firmware */
+};
+static struct flow_state_entry flow_state[NFP_FLOW_SLOTS]
+	____cacheline_aligned_in_smp;
+
+/* Flow ID of the last paced skb of a socket on this CPU, indexed by the
+   socket. It is only trusted in the jiffy it was looked up in, the slot
+   can't expire before that (the flow timeout is many jiffies) */
+#define NFP_FLOW_CACHE_BITS	4
+
+struct flow_cache_entry {
+	const struct sock *sk;
 	u32 hash;
-	unsigned long expires;
+	u32 jiffy;	/* (u32)jiffies when the table was last looked up */
+	u32 flow_id;
+	unsigned long idt_rate;	/* pacing rate ns_per_byte is for */
+	u64 ns_per_byte;	/* 32 bit fraction, see nfp_net_tx_idt() */
+};
+
+struct flow_cache {
+	struct flow_cache_entry entry[1 << NFP_FLOW_CACHE_BITS];
+};
+static DEFINE_PER_CPU(struct flow_cache, flow_cache);
+
+/* Pacing counters of the TX path, per CPU so counting needs no atomics
+   nor shared cache lines, summed when ethtool reads them. The flow table
+   is shared by all ports, so they are too */
+struct nfp_pace_stats {
+	u64 paced;	/* skbs with a flow ID, posted to a TX ring */
+	u64 edt;	/* skbs departing at their EDT */
+	u64 rate_sent;	/* skbs sending a new rate of their flow */
+	u64 no_slot;	/* flows not paced, bucket had no free slot */
+	u64 edt_invalid; /* skbs not paced, EDT beyond the horizon */
 };
-static struct flow_state_entry flow_state[NFP_FLOW_SLOTS];
+static DEFINE_PER_CPU(struct nfp_pace_stats, nfp_pace_stats);
+
+/* END flow table */
 
 /**
  * nfp_net_get_fw_version() - Read and parse the FW version
@@ -753,52 +918,368 @@ static void nfp_net_tx_ring_stop(struct netdev_queue *nd_q,
 }
 
 /**
- * nfp_net_tx_non_tso_idt() - Set up IDT for non-LSO Tx descriptors
- * @txd: Pointer to HW TX descriptor
+ * nfp_net_tx_pace_rate() - Send rate of flow to firmware if it changed
+ * @pace: Pacing info for TX metadata
+ * @pacing_rate: sk_pacing_rate of flow (B/s)
+ *
+ * Firmware keeps the rate per flow, and derives the gap after each packet
+ * (also the last, short, LSO segment) from its length. Other packets of the
+ * flow carry no rate or IDT, so no division per packet.
+ */
+static void nfp_net_tx_pace_rate(struct nfp_net_tx_pace *pace,
+				 unsigned long pacing_rate)
+{
+	struct flow_state_entry *fs = &flow_state[pace->flow_id - 1];
+	u64 ns_per_byte = 0;
+
+	/* Both mean not paced, and ~0UL marks a slot no rate was sent for */
+	if (pacing_rate == ~0UL)
+		pacing_rate = 0;
+	if (likely(READ_ONCE(fs->rate) == pacing_rate))
+		return;
+
+	/* ns per byte with 16 bit fraction, slowest rate is ~15 kB/s */
+	if (pacing_rate)
+		ns_per_byte = min_t(u64, U32_MAX,
+				    div64_u64((u64)NSEC_PER_SEC << 16,
+					      pacing_rate));
+
+	pace->rate = true;
+	pace->ns_per_byte = ns_per_byte;
+	WRITE_ONCE(fs->rate, pacing_rate);
+}
+
+/**
+ * nfp_net_tx_pace_undo() - Forget the rate of an skb that is dropped
+ * @pace: Pacing info of the skb
+ *
+ * The rate is marked sent when the metadata is set up. If the skb never
+ * reaches firmware, later skbs of the flow must send it again.
+ */
+static void nfp_net_tx_pace_undo(const struct nfp_net_tx_pace *pace)
+{
+	if (pace->rate)
+		WRITE_ONCE(flow_state[pace->flow_id - 1].rate,
+			   NFP_FLOW_RATE_UNSENT);
+}
+
+/* BEGIN idt */
+
+/* IDT word: mantissa (low 28 bits) << exponent (high 4 bits) in 1/256 ns,
+   see nfp_net_tx_idt_encode() */
+#define NFP_PACE_IDT_FRAC	8
+#define NFP_PACE_IDT_MANT_BITS	28
+
+/**
+ * nfp_net_tx_idt() - IDT of packets of a flow
+ * @c: Cache entry of the flow on this CPU
+ * @packet_size: Bytes per packet
+ * @pacing_rate: sk_pacing_rate of flow (B/s), not 0 or ~0UL
+ *
+ * IDT = packet_size / pacing_rate * 10^9, in 1/256 ns. Instead of a 64 bit
+ * division per skb, multiply with the ns per byte of the rate, which is only
+ * divided out when the pacing rate changes. Both are rounded up, ns per byte
+ * with a 32 bit fraction, so the IDT is the same as DIV_ROUND_UP() of the
+ * exact one, or 1/256 ns longer if that is exact (or within packet_size /
+ * 2^24 of it).
+ *
+ * Return: IDT in 1/256 ns
+ */
+static u64 nfp_net_tx_idt(struct flow_cache_entry *c, u32 packet_size,
+			  unsigned long pacing_rate)
+{
+	const unsigned int shift = 32 - NFP_PACE_IDT_FRAC;
+
+	if (unlikely(c->idt_rate != pacing_rate)) {
+		c->ns_per_byte = div64_u64(((u64)NSEC_PER_SEC << 32) +
+					   pacing_rate - 1, pacing_rate);
+		c->idt_rate = pacing_rate;
+	}
+
+	/* Round up if the fraction (low bits of the product) isn't 0 */
+	return mul_u64_u32_shr(c->ns_per_byte, packet_size, shift) +
+	       ((c->ns_per_byte * packet_size & (BIT_ULL(shift) - 1)) != 0);
+}
+
+/**
+ * nfp_net_tx_idt_encode() - Encode IDT for the TX metadata
+ * @idt: IDT in 1/256 ns, at most NFP_PACE_HORIZON_NS
+ *
+ * The firmware paces flows from 1 Mbit/s to 100 Gbit/s, IDTs from a few ns
+ * to tens of ms. Below 1 ms (2^28 / 256 ns) the IDT is sent as is, above
+ * it is shifted right by the exponent and rounded to nearest, so the
+ * relative error stays below 2^-28.
+ *
+ * Return: IDT word, mantissa (low 28 bits) << exponent (high 4 bits)
+ */
+static u32 nfp_net_tx_idt_encode(u64 idt)
+{
+	unsigned int exp = 0;
+
+	if (idt >> NFP_PACE_IDT_MANT_BITS) {
+		exp = fls64(idt) - NFP_PACE_IDT_MANT_BITS;
+		idt = (idt + BIT_ULL(exp - 1)) >> exp;
+		/* Rounding up may carry into the next bit */
+		if (idt >> NFP_PACE_IDT_MANT_BITS) {
+			idt >>= 1;
+			exp++;
+		}
+	}
+
+	return exp << NFP_PACE_IDT_MANT_BITS | (u32)idt;
+}
+
+/* END idt */
+
+/**
+ * nfp_net_tx_pace_idt() - Set up IDT of paced skbs
+ * @pace: Pacing info for TX metadata
  * @skb: Pointer to SKB
- * @md_bytes: Prepend length
  *
- * Set up IDT for non-LSO Tx descriptor, do nothing for LSO skbs.
+ * Convert sk_pacing_rate (B/s) to the inter-departure time between the
+ * packets sent for the skb, do nothing for skbs of flows not paced.
+ * Must run before the metadata is prepended.
  */
-static void nfp_net_tx_non_tso_idt(struct nfp_net_tx_desc *txd,
-				struct sk_buff *skb, u32 md_bytes) 
-{	
+static void nfp_net_tx_pace_idt(struct nfp_net_tx_pace *pace,
+				struct sk_buff *skb)
+{
+	const u64 max_idt = NFP_PACE_HORIZON_NS << NFP_PACE_IDT_FRAC;
 	struct sock *sk;
 	unsigned long pacing_rate;
-	u16 vlan;
-	u32 packet_size;
-	u64 idt_250ns, max_idt_250ns;
-	
-	if (skb_is_gso(skb))
-		return;
+	u32 packet_size, hdrlen, segs;
+	u64 idt;
 
-	vlan = le16_to_cpu(txd->vlan);
-	if (likely(!vlan)) // No vlan -> no flow ID -> should not pace
+	pace->idt = 0;
+	pace->rate = false;
+	if (likely(!pace->flow_id))
 		return;
 
 	sk = skb->sk;
 	pacing_rate = sk ? READ_ONCE(sk->sk_pacing_rate) : 0;
+	if (READ_ONCE(nfp_pace_fw_rate)) {
+		nfp_net_tx_pace_rate(pace, pacing_rate);
+		return;
+	}
+	if (!pacing_rate || pacing_rate == ~0UL)
+		return;
 
-	packet_size = skb->len - md_bytes;
+	if (skb_is_gso(skb)) {
+		if (!skb->encapsulation)
+			hdrlen = skb_transport_offset(skb) + tcp_hdrlen(skb);
+		else
+			hdrlen = skb_inner_transport_header(skb) - skb->data +
+				inner_tcp_hdrlen(skb);
+		packet_size = skb_shinfo(skb)->gso_size + hdrlen;
+		segs = max_t(u32, skb_shinfo(skb)->gso_segs, 1);
+	} else {
+		packet_size = skb->len;
+		segs = 1;
+	}
 
-	idt_250ns = 0;
+	/* Only skbs with a socket get here, so pace->cache is set */
+	idt = nfp_net_tx_idt(pace->cache, packet_size, pacing_rate);
 
-	/* Convert pacing rate to inter-departure time in 250ns increments */
-	if (pacing_rate && pacing_rate != ~0UL)
-			idt_250ns = DIV_ROUND_UP( (u64)packet_size * 4000000ULL,
-													(u64)pacing_rate );
+	/* Need a max idt to not wrap queue in firmware
+	   Total IDT for burst should not exceed the firmware horizon,
+	   only divide if it does */
+	if (idt > max_idt || idt * segs > max_idt)
+		idt = DIV_ROUND_UP(max_idt, segs);
 
-	/* Cap idt to 0.5 ms */
-	max_idt_250ns = 2000ULL;
-	if (idt_250ns > max_idt_250ns) 
-		idt_250ns = max_idt_250ns;
-		
-	if (idt_250ns > 0x7FF)
-	 	idt_250ns = 0x7FF;
-	
-	vlan |= idt_250ns;
-	txd->vlan = cpu_to_le16(vlan);
+	pace->idt = nfp_net_tx_idt_encode(idt);
+}
 
+/* Under RCU or nfp_pace_vnics_lock, or while netdev is registered */
+static struct nfp_pace_vnic *nfp_pace_vnic_find(struct net_device *netdev)
+{
+	struct nfp_pace_vnic *vnic;
+
+	list_for_each_entry_rcu(vnic, &nfp_pace_vnics, list)
+		if (vnic->nn->dp.netdev == netdev)
+			return vnic;
+	return NULL;
+}
+
+static int nfp_pace_vnic_add(struct nfp_net *nn)
+{
+	struct nfp_pace_vnic *vnic;
+
+	vnic = kzalloc(sizeof(*vnic), GFP_KERNEL);
+	if (!vnic)
+		return -ENOMEM;
+	vnic->nn = nn;
+
+	mutex_lock(&nfp_pace_vnics_lock);
+	list_add_tail_rcu(&vnic->list, &nfp_pace_vnics);
+	mutex_unlock(&nfp_pace_vnics_lock);
+	return 0;
+}
+
+static void nfp_pace_vnic_del(struct nfp_net *nn)
+{
+	struct nfp_pace_vnic *vnic;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	unsigned int qidx;
+#endif
+
+	mutex_lock(&nfp_pace_vnics_lock);
+	vnic = nfp_pace_vnic_find(nn->dp.netdev);
+	if (vnic)
+		list_del_rcu(&vnic->list);
+	mutex_unlock(&nfp_pace_vnics_lock);
+
+	if (!vnic)
+		return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	for_each_set_bit(qidx, vnic->etf_queues, NFP_NET_MAX_TX_RINGS)
+		static_branch_dec(&nfp_pace_etf_queues);
+#endif
+	kfree_rcu(vnic, rcu);
+}
+
+static bool nfp_net_etf_enabled(struct net_device *netdev, u16 qidx)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	struct nfp_pace_vnic *vnic;
+
+	if (!static_branch_unlikely(&nfp_pace_etf_queues))
+		return false;
+
+	vnic = nfp_pace_vnic_find(netdev);
+	return vnic && test_bit(qidx, vnic->etf_queues);
+#else
+	return false;
+#endif
+}
+
+/* sch_etf offloads CLOCK_TAI qdiscs only, and does not pass the clock on.
+   With skip_sock_check it lets through skbs of sockets on other clocks
+   too, so take the clock of their socket, which ETF checks otherwise.
+   Return: false if skb is in a clock the launch time cannot be taken in */
+static bool nfp_net_etf_now(const struct sk_buff *skb, u64 *now)
+{
+	clockid_t clockid = CLOCK_TAI;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	const struct sock *sk = skb->sk;
+
+	if (sk && sk_fullsock(sk) && sock_flag(sk, SOCK_TXTIME))
+		clockid = sk->sk_clockid;
+#endif
+
+	switch (clockid) {
+	case CLOCK_TAI:
+		*now = ktime_get_clocktai_ns();
+		return true;
+	case CLOCK_MONOTONIC:
+		*now = ktime_get_ns();
+		return true;
+	case CLOCK_REALTIME:
+		*now = ktime_get_real_ns();
+		return true;
+	default:
+		return false;
+	}
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+static int nfp_net_setup_tc_etf(struct net_device *netdev,
+				struct tc_etf_qopt_offload *qopt)
+{
+	struct nfp_net *nn = netdev_priv(netdev);
+	struct nfp_pace_vnic *vnic;
+
+	if (qopt->queue < 0 || qopt->queue >= nn->dp.num_tx_rings)
+		return -EINVAL;
+
+	vnic = nfp_pace_vnic_find(netdev);
+	if (!vnic)
+		return -EOPNOTSUPP;
+
+	if (qopt->enable) {
+		if (!test_and_set_bit(qopt->queue, vnic->etf_queues))
+			static_branch_inc(&nfp_pace_etf_queues);
+	} else {
+		if (test_and_clear_bit(qopt->queue, vnic->etf_queues))
+			static_branch_dec(&nfp_pace_etf_queues);
+	}
+	return 0;
+}
+
+static int nfp_net_setup_tc(struct net_device *netdev,
+			    enum tc_setup_type type, void *type_data)
+{
+	if (type == TC_SETUP_QDISC_ETF)
+		return nfp_net_setup_tc_etf(netdev, type_data);
+
+	return nfp_port_setup_tc(netdev, type, type_data);
+}
+#endif
+
+/**
+ * nfp_net_tx_pace_edt() - Set up departure time of skb in EDT/ETF mode
+ * @netdev: netdev structure
+ * @pace: Pacing info for TX metadata
+ * @skb: Pointer to SKB
+ * @qidx: TX queue of skb
+ *
+ * Translate skb->tstamp (CLOCK_MONOTONIC) to a delay from now. Firmware adds
+ * it to its own clock when the packet reaches it, so skbs keep the spacing
+ * of the kernel schedule without the two clocks drifting apart. Later
+ * segments of LSO skbs follow the first at the IDT of the flow.
+ *
+ * On queues with ETF offload skb->tstamp is a launch time, in CLOCK_TAI or
+ * the clock of its socket, and packets are sent at it regardless of the
+ * pacing state of their flow. Other clocks count as invalid.
+ *
+ * A time beyond the firmware horizon is taken as invalid (another clock, or
+ * garbage) rather than clamped to the horizon, and skb is sent unpaced.
+ *
+ * Return: true if skb should not be paced by flow, as it has an ETF launch
+ * time or an invalid one.
+ */
+static bool nfp_net_tx_pace_edt(struct net_device *netdev,
+				struct nfp_net_tx_pace *pace,
+				struct sk_buff *skb, u16 qidx)
+{
+	bool etf = false;
+	s64 delay_ns;
+	u64 now;
+
+	pace->edt = false;
+	pace->delay_ns = 0;
+	if (!skb->tstamp)
+		return false;
+
+	if (nfp_net_etf_enabled(netdev, qidx)) {
+		if (!nfp_net_etf_now(skb, &now)) {
+			this_cpu_inc(nfp_pace_stats.edt_invalid);
+			return true;
+		}
+		etf = true;
+	} else if (READ_ONCE(nfp_pace_edt)) {
+		now = ktime_get_ns();
+	} else {
+		return false;
+	}
+
+	delay_ns = ktime_to_ns(skb->tstamp) - now;
+	if (unlikely(delay_ns > (s64)NFP_PACE_HORIZON_NS)) {
+		this_cpu_inc(nfp_pace_stats.edt_invalid);
+		return true;
+	}
+	pace->edt = true;
+	pace->delay_ns = max_t(s64, delay_ns, 0);
+
+	return etf;
+}
+
+static unsigned int
+nfp_net_tx_pace_meta_len(const struct nfp_net_tx_pace *pace)
+{
+	if (pace->edt)
+		return NFP_NET_META_PACING_EDT_LEN;
+	if (pace->flow_id)
+		return NFP_NET_META_PACING_LEN;
+	return 0;
 }
 
 /**
@@ -818,7 +1299,7 @@ static void nfp_net_tx_tso(struct nfp_net_r_vector *r_vec,
 			   u32 md_bytes)
 {
 	u32 l3_offset, l4_offset, hdrlen;
-	u16 mss, vlan;
+	u16 mss;
 
 	if (!skb_is_gso(skb))
 		return;
@@ -837,82 +1318,9 @@ static void nfp_net_tx_tso(struct nfp_net_r_vector *r_vec,
 	txbuf->pkt_cnt = skb_shinfo(skb)->gso_segs;
 	txbuf->real_len += hdrlen * (txbuf->pkt_cnt - 1);
 
-
 	mss = skb_shinfo(skb)->gso_size & PCIE_DESC_TX_MSS_MASK;
-	/*
 	txd->l3_offset = l3_offset - md_bytes;
 	txd->l4_offset = l4_offset - md_bytes;
-	*/
-
-	/*
-	-------------- Pacing modifications ----------------
-
-	If skb is from flow in pacing state, insert its pacing rate
-
-	Instead of setting l3/l4 offset, we use the whole field 
-		(vlan/l3+l4_offset) to set the pacing rate.
-
-	Firmware (modified):
-		Does not use l3/l4 offset values
-		Interprets vlan field as IDT in 250ns ticks
-
-	Convert sk_pacing_rate (B/s) -> IDT in 250ns (11 bits -> 250ns - 0.512ms)
-	*/
-	vlan = le16_to_cpu(txd->vlan);
-	if (likely(vlan))
-	{
-		struct sock *sk;
-		unsigned long pacing_rate;
-		u32 packet_size;
-		u64 idt_250ns, max_idt_250ns;
-
-		sk = skb->sk;
-		pacing_rate = sk ? READ_ONCE(sk->sk_pacing_rate) : 0;		
-
-		packet_size = (u32)mss + (hdrlen - md_bytes);
-		
-		idt_250ns = 0;			// If pacing rate is 0 -> IDT is 0
-
-		/* If pacing rate is not 0, 
-			calculate IDT (in 250ns ticks) for packets in burst 
-			( IDT = packet_size / bytes_per_second * 4*10^6 ) */
-		if (pacing_rate && pacing_rate != ~0UL)
-			idt_250ns = DIV_ROUND_UP( (u64)packet_size * 4000000ULL,
-													(u64)pacing_rate );
-		
-		/* Need a max idt to not wrap queue in firmware
-		   Total IDT for burst should not exceed 1ms
-			(TSO has >= 2 pkt, so effectively cap idt to <= 0.5 ms) */
-		if (txbuf->pkt_cnt) {
-			max_idt_250ns = DIV_ROUND_UP(4000ULL, txbuf->pkt_cnt);
-			if (idt_250ns > max_idt_250ns) 
-				idt_250ns = max_idt_250ns;
-		}
-		
-		/* Clamp to 11 bits */
-		if (idt_250ns > 0x7FF)
-			idt_250ns = 0x7FF;
-		
-		/* 16 bit Vlan field: 
-		15       11 10              0
-		+----------+----------------+
-		| FLOW_ID  |  PACING_RATE   |
-		+----------+----------------+
-		   5 bits       11 bits
-		*/
-		vlan |= idt_250ns;
-		txd->vlan = cpu_to_le16(vlan);
-
-		/* Print stats from 100th to 200th call */
-		// if (this_cpu_read(printk_call_counter) < 200) {
-		// 	this_cpu_inc(printk_call_counter);
-
-		// 	if (this_cpu_read(printk_call_counter) >= 100)
-		// 		printk(KERN_DEBUG "Kevin tso stats: pkt_cnt=%u, skb_len=%u, pacing_rate=%lu, packet_size=%u, idt=%u\n", 
-		// 									txbuf->pkt_cnt, skb->len, pacing_rate, packet_size, idt_250ns);
-		// }	
-	}
-
 	txd->lso_hdrlen = hdrlen - md_bytes;
 	txd->mss = cpu_to_le16(mss);
 	txd->flags |= PCIE_DESC_TX_LSO;
@@ -985,85 +1393,152 @@ static void nfp_net_tx_csum(struct nfp_net_dp *dp,
 	u64_stats_update_end(&r_vec->tx_sync);
 }
 
+/* BEGIN flow table */
+
+static inline s64 nfp_flow_key(u32 hash, u32 expires)
+{
+	return (s64)((u64)expires << 32 | hash);
+}
+
+static inline u32 nfp_flow_timeout_j(void)
+{
+	return msecs_to_jiffies(clamp(READ_ONCE(nfp_pace_flow_timeout_ms),
+				      NFP_FLOW_TIMEOUT_MIN_MS,
+				      NFP_FLOW_TIMEOUT_MAX_MS));
+}
+
+/* Slots expire the flow timeout after the last skb of their flow. Live
+   slots expire within that from now, any other expiry is stale (also
+   after jiffies wrapped the 32 bits kept) */
+static inline bool nfp_flow_key_live(s64 key, u32 now, u32 timeout)
+{
+	return (u32)((u64)key >> 32) - now <= timeout;
+}
+
 /**
- * nfp_net_tx_set_flow_id() - Set flowId field for Tx descriptors
- * @txd: Pointer to HW TX descriptor
+ * nfp_net_tx_flow_lookup() - Look up flow ID of skb in the flow table
+ * @pace: Pacing info for TX metadata
  * @skb: Pointer to SKB
  *
- * Set flowId field for Tx descriptors
+ * Set flow ID of pacing info, 0 if skb should not be paced. The flow hash
+ * picks a bucket of the flow table, a flow keeps the slot it has there.
+ * Bursts of new flows claim a free or expired slot of the bucket with
+ * cmpxchg, so CPUs never share a slot between flows. If all slots of the
+ * bucket are live, the flow is not paced.
  */
-static void nfp_net_tx_set_flow_id(struct nfp_net_tx_desc *txd,
-				struct sk_buff *skb) 
-{
-	/*
-	Flow state:
-
-							this maps to flowID 4 (index 3 + 1)
-											|
-		+-------------+-------+---------+----------+-----+
-		| hash 4 + ts |   -   | hs1+ts  | hs2 + ts | ... |
-		+-------------+-------+---------+----------+-----+
-		 0    |        1       2         3             30      
-		      |
-		maps to flowID 1 (as 0 is reserved for no pacing)
-
-	We have 5 bits, so 32-1 = 31 concurrent flows
-	*/
-
-	u16 flowId;
-	u32 flow_hash;
-	unsigned long now;
-	int i;
+static void nfp_net_tx_flow_lookup(struct nfp_net_tx_pace *pace,
+				   struct sk_buff *skb)
+{
+	struct flow_state_entry *bucket, *fs;
+	u32 flow_hash, now, timeout, i;
+	s64 key, old;
+
+	pace->flow_id = 0;
 
 	flow_hash = skb_get_hash(skb);
-	if (unlikely(!flow_hash)) return;
-
-	
-	flowId = 0;
-	/* Check if flow is in paced state */
-	for (i = 0; i < NFP_FLOW_SLOTS; i++) {
-		if (READ_ONCE(flow_state[i].hash) == flow_hash) {
-			flowId = i+1;
-			break;
-		}
+	if (unlikely(!flow_hash))
+		return;
+
+	timeout = nfp_flow_timeout_j();
+
+	bucket = &flow_state[hash_32(flow_hash, NFP_FLOW_BUCKET_BITS) *
+			     NFP_FLOW_WAYS];
+	for (i = 0; i < NFP_FLOW_WAYS; i++) {
+		fs = &bucket[i];
+		key = atomic64_read(&fs->key);
+		if ((u32)key == flow_hash)
+			goto found;
 	}
 
-	/* If not in state, either skip or insert into state */
-	if (!flowId) {
-		/* Not above burst threshold -> dont pace */
-		if (skb_shinfo(skb)->gso_segs < BURST_THRESH)
-			return;
+	/* Not above burst threshold -> dont pace */
+	if (skb_shinfo(skb)->gso_segs < READ_ONCE(nfp_pace_burst_segs))
+		return;
 
-		now = jiffies;
+	now = (u32)jiffies;
+	for (i = 0; i < NFP_FLOW_WAYS; i++) {
+		fs = &bucket[i];
+		key = atomic64_read(&fs->key);
+		/* Another CPU may have claimed a slot for this flow since */
+		if ((u32)key == flow_hash)
+			goto found;
+		if (key && nfp_flow_key_live(key, now, timeout))
+			continue;
 
-		/* Insert next free slot (first flow with expired timer) */
-		for (i = 0; i < NFP_FLOW_SLOTS; i++) {
-			if (READ_ONCE(flow_state[i].hash) == 0 || 
-				time_after_eq(now, flow_state[i].expires)) {
-				flowId = i+1;
-				break;
-			}
+		old = atomic64_cmpxchg(&fs->key, key,
+				       nfp_flow_key(flow_hash, now + timeout));
+		if (old == key) {
+			/* Firmware may still hold the rate of the previous
+			   flow */
+			WRITE_ONCE(fs->rate, NFP_FLOW_RATE_UNSENT);
+			goto out;
 		}
-		/* If no free slot found, dont pace */
-		if (!flowId)
-			return;
+		/* Lost the slot, maybe to this flow on another CPU */
+		if ((u32)old == flow_hash) {
+			key = old;
+			goto found;
+		}
+	}
+	/* If no free slot found, dont pace */
+	this_cpu_inc(nfp_pace_stats.no_slot);
+	return;
+
+found:
+	/* Update timestamp for flow, the line is only written once per
+	   jiffy. Fails if another CPU did it, or the slot expired and was
+	   taken meanwhile, this skb still goes with the ID it found. */
+	now = (u32)jiffies;
+	if ((u32)((u64)key >> 32) != now + timeout)
+		atomic64_cmpxchg(&fs->key, key,
+				 nfp_flow_key(flow_hash, now + timeout));
+out:
+	pace->flow_id = fs - flow_state + 1;
+}
+
+/**
+ * nfp_net_tx_set_flow_id() - Set flow ID of pacing info
+ * @pace: Pacing info for TX metadata
+ * @skb: Pointer to SKB
+ *
+ * Set flow ID of pacing info, 0 if skb should not be paced. A socket keeps
+ * its flow, so further skbs of it in the same jiffy take the flow ID from
+ * the per CPU cache, only the first one looks up (and refreshes) its slot.
+ * The hash is compared too, it changes if the socket is reused or rehashed.
+ * Skbs with a socket get its cache entry in @pace.
+ */
+static void nfp_net_tx_set_flow_id(struct nfp_net_tx_pace *pace,
+				   struct sk_buff *skb)
+{
+	const struct sock *sk = skb->sk;
+	struct flow_cache_entry *c;
+	u32 now = (u32)jiffies;
 
-		WRITE_ONCE(flow_state[flowId-1].hash, flow_hash);
+	pace->cache = NULL;
+	if (unlikely(!sk)) {
+		nfp_net_tx_flow_lookup(pace, skb);
+		return;
+	}
+
+	c = this_cpu_ptr(&flow_cache)->entry +
+	    hash_ptr(sk, NFP_FLOW_CACHE_BITS);
+	pace->cache = c;
+	if (likely(c->sk == sk && c->jiffy == now && c->hash == skb->hash)) {
+		pace->flow_id = c->flow_id;
+		return;
 	}
 
-	/* Update timestamp for flow */
-	WRITE_ONCE(flow_state[flowId-1].expires, jiffies+NFP_FLOW_TIMEOUT_J);
+	nfp_net_tx_flow_lookup(pace, skb);
+	if (!pace->flow_id)
+		return;
 
-	/* 16 bit Vlan field: 
-	15       11 10              0
-	+----------+----------------+
-	| FLOW_ID  |  PACING_RATE   |
-	+----------+----------------+
-		5 bits       11 bits
-	*/
-	txd->vlan = cpu_to_le16((flowId & 0x1F) << 11);
+	/* Keeps idt_rate and ns_per_byte, they hold for any flow */
+	c->sk = sk;
+	c->hash = skb->hash;
+	c->jiffy = now;
+	c->flow_id = pace->flow_id;
 }
 
+/* END flow table */
+
 static struct sk_buff *
 nfp_net_tls_tx(struct nfp_net_dp *dp, struct nfp_net_r_vector *r_vec,
 	       struct sk_buff *skb, u64 *tls_handle, int *nr_frags)
@@ -1164,23 +1639,52 @@ static void nfp_net_tx_xmit_more_flush(struct nfp_net_tx_ring *tx_ring)
 	tx_ring->wr_ptr_add = 0;
 }
 
+static unsigned char *
+nfp_net_prep_tx_meta_pace(unsigned char *data, u32 *meta_id,
+			  const struct nfp_net_tx_pace *pace)
+{
+	/* Pushed last, so it is the first field and firmware finds it at a
+	 * fixed offset
+	 */
+	data -= nfp_net_tx_pace_meta_len(pace);
+	if (pace->rate) {
+		put_unaligned_be32(pace->flow_id | NFP_NET_META_PACING_RATE,
+				   data);
+		put_unaligned_be32(pace->ns_per_byte, data + 4);
+	} else {
+		put_unaligned_be32(pace->flow_id, data);
+		put_unaligned_be32(pace->idt, data + 4);
+	}
+	*meta_id <<= NFP_NET_META_FIELD_SIZE;
+	if (pace->edt) {
+		put_unaligned_be32(pace->delay_ns, data + 8);
+		*meta_id |= NFP_NET_META_PACING_EDT;
+	} else {
+		*meta_id |= NFP_NET_META_PACING;
+	}
+
+	return data;
+}
+
 #ifdef COMPAT__HAVE_METADATA_IP_TUNNEL
-static int nfp_net_prep_tx_meta(struct sk_buff *skb, u64 tls_handle)
+static int nfp_net_prep_tx_meta(struct sk_buff *skb, u64 tls_handle,
+				const struct nfp_net_tx_pace *pace)
 {
 	struct metadata_dst *md_dst = skb_metadata_dst(skb);
+	unsigned int pace_len = nfp_net_tx_pace_meta_len(pace);
 	unsigned char *data;
 	u32 meta_id = 0;
 	int md_bytes;
 
-	if (likely(!md_dst && !tls_handle))
+	if (likely(!md_dst && !tls_handle && !pace_len))
 		return 0;
 	if (unlikely(md_dst && md_dst->type != METADATA_HW_PORT_MUX)) {
-		if (!tls_handle)
+		if (!tls_handle && !pace_len)
 			return 0;
 		md_dst = NULL;
 	}
 
-	md_bytes = 4 + !!md_dst * 4 + !!tls_handle * 8;
+	md_bytes = 4 + !!md_dst * 4 + !!tls_handle * 8 + pace_len;
 
 	if (unlikely(skb_cow_head(skb, md_bytes)))
 		return -ENOMEM;
@@ -1201,6 +1705,8 @@ static int nfp_net_prep_tx_meta(struct sk_buff *skb, u64 tls_handle)
 		meta_id <<= NFP_NET_META_FIELD_SIZE;
 		meta_id |= NFP_NET_META_CONN_HANDLE;
 	}
+	if (pace_len)
+		data = nfp_net_prep_tx_meta_pace(data, &meta_id, pace);
 
 	data -= 4;
 	put_unaligned_be32(meta_id, data);
@@ -1208,9 +1714,29 @@ static int nfp_net_prep_tx_meta(struct sk_buff *skb, u64 tls_handle)
 	return md_bytes;
 }
 #else
-static int nfp_net_prep_tx_meta(struct sk_buff *skb, u64 tls_handle)
+static int nfp_net_prep_tx_meta(struct sk_buff *skb, u64 tls_handle,
+				const struct nfp_net_tx_pace *pace)
 {
-	return 0;
+	unsigned int pace_len = nfp_net_tx_pace_meta_len(pace);
+	unsigned char *data;
+	u32 meta_id = 0;
+	int md_bytes;
+
+	if (likely(!pace_len))
+		return 0;
+
+	md_bytes = 4 + pace_len;
+
+	if (unlikely(skb_cow_head(skb, md_bytes)))
+		return -ENOMEM;
+
+	data = skb_push(skb, md_bytes) + md_bytes;
+	data = nfp_net_prep_tx_meta_pace(data, &meta_id, pace);
+
+	data -= 4;
+	put_unaligned_be32(meta_id, data);
+
+	return md_bytes;
 }
 #endif
 
@@ -1230,6 +1756,7 @@ static int nfp_net_tx(struct sk_buff *skb, struct net_device *netdev)
 	struct nfp_net_r_vector *r_vec;
 	struct nfp_net_tx_buf *txbuf;
 	struct nfp_net_tx_desc *txd;
+	struct nfp_net_tx_pace pace;
 	struct netdev_queue *nd_q;
 	struct nfp_net_dp *dp;
 	dma_addr_t dma_addr;
@@ -1262,7 +1789,17 @@ static int nfp_net_tx(struct sk_buff *skb, struct net_device *netdev)
 		return NETDEV_TX_OK;
 	}
 
-	md_bytes = nfp_net_prep_tx_meta(skb, tls_handle);
+	/* Pacing info goes in the metadata prepend, so set it up first */
+	pace.flow_id = 0;
+	pace.cache = NULL;
+	pace.idt = 0;
+	pace.rate = false;
+	if (!nfp_net_tx_pace_edt(netdev, &pace, skb, qidx)) {
+		nfp_net_tx_set_flow_id(&pace, skb);
+		nfp_net_tx_pace_idt(&pace, skb);
+	}
+
+	md_bytes = nfp_net_prep_tx_meta(skb, tls_handle, &pace);
 	if (unlikely(md_bytes < 0))
 		goto err_flush;
 
@@ -1296,19 +1833,13 @@ static int nfp_net_tx(struct sk_buff *skb, struct net_device *netdev)
 	txd->mss = 0;
 	txd->lso_hdrlen = 0;
 
-	txd->vlan = 0;
-	/* Do not reorder - tso may adjust pkt cnt */
-	nfp_net_tx_set_flow_id(txd, skb);
-	nfp_net_tx_non_tso_idt(txd, skb, md_bytes);
+	/* Do not reorder - tso may adjust pkt cnt, vlan may override fields */
 	nfp_net_tx_tso(r_vec, txbuf, txd, skb, md_bytes);
 	nfp_net_tx_csum(dp, r_vec, txbuf, txd, skb);
-	
-	/* K: Skip VLAN, as we dont need it and it would overwrite pacing rate! */
-
-	// if (skb_vlan_tag_present(skb) && dp->ctrl & NFP_NET_CFG_CTRL_TXVLAN) {
-	// 	txd->flags |= PCIE_DESC_TX_VLAN;
-	// 	txd->vlan = cpu_to_le16(skb_vlan_tag_get(skb));
-	// }
+	if (skb_vlan_tag_present(skb) && dp->ctrl & NFP_NET_CFG_CTRL_TXVLAN) {
+		txd->flags |= PCIE_DESC_TX_VLAN;
+		txd->vlan = cpu_to_le16(skb_vlan_tag_get(skb));
+	}
 
 	/* Gather DMA */
 	if (nr_frags > 0) {
@@ -1346,6 +1877,13 @@ static int nfp_net_tx(struct sk_buff *skb, struct net_device *netdev)
 
 	skb_tx_timestamp(skb);
 
+	if (pace.flow_id)
+		this_cpu_inc(nfp_pace_stats.paced);
+	if (pace.edt)
+		this_cpu_inc(nfp_pace_stats.edt);
+	if (pace.rate)
+		this_cpu_inc(nfp_pace_stats.rate_sent);
+
 	nd_q = netdev_get_tx_queue(dp->netdev, tx_ring->idx);
 
 	tx_ring->wr_p += nr_frags + 1;
@@ -1383,6 +1921,7 @@ err_flush:
 	r_vec->tx_errors++;
 	u64_stats_update_end(&r_vec->tx_sync);
 	nfp_net_tls_tx_undo(skb, tls_handle);
+	nfp_net_tx_pace_undo(&pace);
 	dev_kfree_skb_any(skb);
 	return NETDEV_TX_OK;
 }
@@ -3076,6 +3615,127 @@ nfp_net_tx_ring_hw_cfg_write(struct nfp_net *nn,
 	nn_writeb(nn, NFP_NET_CFG_TXR_VEC(idx), tx_ring->r_vec->irq_entry);
 }
 
+/* pq_config of notify.c, byte offsets of its words */
+#define NFP_PACE_FW_CONFIG_SYMBOL	"_pq_config"
+#define NFP_PACE_FW_CONFIG_GEN		0
+#define NFP_PACE_FW_CONFIG_FUTURE	4
+#define NFP_PACE_FW_CONFIG_OCC_HIGH	8
+#define NFP_PACE_FW_CONFIG_OCC_LOW	12
+#define NFP_PACE_FW_CONFIG_SHAPE	16
+
+/**
+ * nfp_pace_shape_rate() - Rate of the port shaper of firmware
+ * @netdev:  Netdev of the vNIC
+ * @qidx:    TX queue whose max rate is being set, or -1
+ * @maxrate: New max rate of that queue (Mbps)
+ *
+ * Firmware shapes all packets leaving its pacing queue together, so the max
+ * rates of the TX queues add up to one rate for the port, and a queue
+ * without one adds nothing (the kernel stores the new rate of @qidx only
+ * once it is set). Unlike other drivers no queue is held to its own max
+ * rate: one queue may take all of the sum.
+ *
+ * Return: ns per byte with 16 bit fraction, 0 if no queue has a max rate
+ * or the kernel has no max rates of TX queues
+ */
+static u32 nfp_pace_shape_rate(struct net_device *netdev, int qidx,
+			       u32 maxrate)
+{
+#if VER_NON_RHEL_GE(4, 1) || VER_RHEL_GE(8, 0)
+	unsigned int i;
+	u64 mbps = 0;
+
+	for (i = 0; i < netdev->real_num_tx_queues; i++)
+		mbps += i == qidx ? maxrate :
+			netdev_get_tx_queue(netdev, i)->tx_maxrate;
+	if (!mbps)
+		return 0;
+
+	/* 8000 ns per byte at 1 Mbps */
+	return div64_u64(8000ULL << 16, mbps);
+#else
+	return 0;
+#endif
+}
+
+/**
+ * nfp_pace_write_fw_config() - Write runtime pacing configuration to firmware
+ * @nn:         NFP Net device
+ * @shape_rate: Port shaper rate, see nfp_pace_shape_rate()
+ *
+ * Write the nfp_pace_fw_* parameters and the shaper rate to firmware as a
+ * seqlock: make the gen of the config odd, write the values, then make gen
+ * even. Firmware ignores the config while gen is odd or changes as it reads
+ * it, else takes it within a millisecond (or ignores it if out of range).
+ * Firmware has one config for all its vNICs, so writers take
+ * nfp_pace_fw_config_lock.
+ *
+ * Return: 0, -EOPNOTSUPP if firmware has no pq_config, or -EIO
+ */
+static int nfp_pace_write_fw_config(struct nfp_net *nn, u32 shape_rate)
+{
+	const struct nfp_rtsym *sym;
+	struct nfp_cpp *cpp;
+	int err = 0;
+	u32 gen;
+
+	if (!nn->app || !nn->app->pf || !nn->app->pf->rtbl)
+		return -EOPNOTSUPP;
+
+	sym = nfp_rtsym_lookup(nn->app->pf->rtbl, NFP_PACE_FW_CONFIG_SYMBOL);
+	if (!sym)
+		return -EOPNOTSUPP;
+	cpp = nn->app->cpp;
+
+	/* gen may be odd already if a write failed half way */
+	mutex_lock(&nfp_pace_fw_config_lock);
+	if (nfp_rtsym_readl(cpp, sym, NFP_PACE_FW_CONFIG_GEN, &gen) ||
+	    nfp_rtsym_writel(cpp, sym, NFP_PACE_FW_CONFIG_GEN, gen | 1) ||
+	    nfp_rtsym_writel(cpp, sym, NFP_PACE_FW_CONFIG_FUTURE,
+			     READ_ONCE(nfp_pace_fw_future_slots)) ||
+	    nfp_rtsym_writel(cpp, sym, NFP_PACE_FW_CONFIG_OCC_HIGH,
+			     READ_ONCE(nfp_pace_fw_occupancy_high)) ||
+	    nfp_rtsym_writel(cpp, sym, NFP_PACE_FW_CONFIG_OCC_LOW,
+			     READ_ONCE(nfp_pace_fw_occupancy_low)) ||
+	    nfp_rtsym_writel(cpp, sym, NFP_PACE_FW_CONFIG_SHAPE, shape_rate) ||
+	    nfp_rtsym_writel(cpp, sym, NFP_PACE_FW_CONFIG_GEN, (gen | 1) + 1)) {
+		nn_err(nn, "Failed to write pacing config to firmware\n");
+		err = -EIO;
+	}
+	mutex_unlock(&nfp_pace_fw_config_lock);
+
+	return err;
+}
+
+/* Set op of the nfp_pace_fw_* parameters: write the new value to firmware
+   through each running vNIC, as enabling them would. rtnl keeps it from
+   racing with that and with TX queue max rates being set */
+static int nfp_pace_fw_param_set(const char *val,
+				 const struct kernel_param *kp)
+{
+	struct nfp_pace_vnic *vnic;
+	struct net_device *netdev;
+	int err;
+
+	err = param_set_uint(val, kp);
+	if (err)
+		return err;
+
+	rtnl_lock();
+	mutex_lock(&nfp_pace_vnics_lock);
+	list_for_each_entry(vnic, &nfp_pace_vnics, list) {
+		netdev = vnic->nn->dp.netdev;
+		if (netif_running(netdev))
+			nfp_pace_write_fw_config(vnic->nn,
+						 nfp_pace_shape_rate(netdev,
+								     -1, 0));
+	}
+	mutex_unlock(&nfp_pace_vnics_lock);
+	rtnl_unlock();
+
+	return 0;
+}
+
 /**
  * nfp_net_set_config_and_enable() - Write control BAR and enable NFP
  * @nn:      NFP Net device to reconfigure
@@ -3136,6 +3796,12 @@ static int nfp_net_set_config_and_enable(struct nfp_net *nn)
 
 	nn->dp.ctrl = new_ctrl;
 
+	/* The control vNIC has no TX queues to take the shaper rate from */
+	if (nn->dp.netdev)
+		nfp_pace_write_fw_config(nn,
+					 nfp_pace_shape_rate(nn->dp.netdev,
+							     -1, 0));
+
 	for (r = 0; r < nn->dp.num_rx_rings; r++)
 		nfp_net_rx_ring_fill_freelist(&nn->dp, &nn->dp.rx_rings[r]);
 
@@ -4087,6 +4753,20 @@ static int nfp_net_set_mac_address(struct net_device *netdev, void *addr)
 	return 0;
 }
 
+#if VER_NON_RHEL_GE(4, 1) || VER_RHEL_GE(8, 0)
+/* The max rate of a queue adds to the rate of the port shaper of firmware,
+   see nfp_pace_shape_rate() */
+static int nfp_net_set_tx_maxrate(struct net_device *netdev, int queue_index,
+				  u32 maxrate)
+{
+	struct nfp_net *nn = netdev_priv(netdev);
+
+	return nfp_pace_write_fw_config(nn, nfp_pace_shape_rate(netdev,
+								queue_index,
+								maxrate));
+}
+#endif
+
 const struct net_device_ops nfp_net_netdev_ops = {
 	.ndo_init		= nfp_app_ndo_init,
 	.ndo_uninit		= nfp_app_ndo_uninit,
@@ -4111,7 +4791,9 @@ const struct net_device_ops nfp_net_netdev_ops = {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
 	.ndo_set_vf_link_state  = nfp_app_set_vf_link_state,
 #endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	.ndo_setup_tc		= nfp_net_setup_tc,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
 	.ndo_setup_tc		= nfp_port_setup_tc,
 #endif
 	.ndo_tx_timeout		= nfp_net_tx_timeout,
@@ -4123,6 +4805,9 @@ const struct net_device_ops nfp_net_netdev_ops = {
 #endif
 	.ndo_set_mac_address	= nfp_net_set_mac_address,
 	.ndo_set_features	= nfp_net_set_features,
+#if VER_NON_RHEL_GE(4, 1) || VER_RHEL_GE(8, 0)
+	.ndo_set_tx_maxrate	= nfp_net_set_tx_maxrate,
+#endif
 #if COMPAT__HAVE_NDO_FEATURES_CHECK
 	.ndo_features_check	= nfp_net_features_check,
 #endif
@@ -4379,6 +5064,193 @@ static void nfp_net_irqmod_init(struct nfp_net *nn)
 	nn->tx_coalesce_max_frames = 64;
 }
 
+/* Pacing counters of firmware, pq_counters of notify.c (index PQ_CNT_*).
+   Some are added up in firmware and written in batches, so they may lag
+   while traffic flows */
+#define NFP_PACE_FW_SYMBOL	"_pq_counters"
+#define NFP_PACE_FW_COUNTERS	16
+
+/* Lateness histogram of firmware, pq_late_hist of notify.c: packets
+   dequeued [2^(b-1), 2^b) ticks of 20 ns behind their slot in bucket b,
+   the last bucket anything later */
+#define NFP_PACE_HIST_SYMBOL	"_pq_late_hist"
+#define NFP_PACE_HIST_BUCKETS	16
+#define NFP_PACE_TICK_NS	20
+
+static const struct {
+	char name[ETH_GSTRING_LEN];
+	u32 index;
+} nfp_pace_fw_stats[] = {
+	{ "pace_fw_paced",		7 },
+	{ "pace_fw_late",		8 },
+	{ "pace_fw_horizon",		9 },
+	{ "pace_fw_squashed",		10 },
+	{ "pace_fw_shaped",		11 },
+	{ "pace_fw_slot_collision",	5 },
+	{ "pace_fw_ovf_send_now",	0 },
+	{ "pace_fw_ovf_spill",		1 },
+	{ "pace_fw_ovf_ring_full",	2 },
+	{ "pace_fw_backpressure",	3 },
+	{ "pace_fw_deq_sig_busy",	4 },
+	{ "pace_fw_trace_drop",		6 },
+};
+
+static const char nfp_pace_drv_stats[][ETH_GSTRING_LEN] = {
+	"pace_paced",
+	"pace_edt",
+	"pace_rate_sent",
+	"pace_no_slot",
+	"pace_edt_invalid",
+};
+
+#define NFP_PACE_STATS	(ARRAY_SIZE(nfp_pace_drv_stats) + \
+			 ARRAY_SIZE(nfp_pace_fw_stats) + NFP_PACE_HIST_BUCKETS)
+
+/* The pacing stats are appended to the ethtool stats of the vNIC (see
+   nfp_net_ethtool.c) by wrapping its ops */
+static const struct ethtool_ops *nfp_pace_base_ethtool_ops;
+static struct ethtool_ops nfp_pace_ethtool_ops;
+
+static int nfp_pace_get_sset_count(struct net_device *netdev, int sset)
+{
+	int cnt;
+
+	cnt = nfp_pace_base_ethtool_ops->get_sset_count(netdev, sset);
+	if (sset != ETH_SS_STATS || cnt < 0)
+		return cnt;
+	return cnt + NFP_PACE_STATS;
+}
+
+static void nfp_pace_get_strings(struct net_device *netdev, u32 sset,
+				 u8 *data)
+{
+	unsigned int i;
+
+	nfp_pace_base_ethtool_ops->get_strings(netdev, sset, data);
+	if (sset != ETH_SS_STATS)
+		return;
+
+	data += nfp_pace_base_ethtool_ops->get_sset_count(netdev, sset) *
+		ETH_GSTRING_LEN;
+	for (i = 0; i < ARRAY_SIZE(nfp_pace_drv_stats); i++) {
+		memcpy(data, nfp_pace_drv_stats[i], ETH_GSTRING_LEN);
+		data += ETH_GSTRING_LEN;
+	}
+	for (i = 0; i < ARRAY_SIZE(nfp_pace_fw_stats); i++) {
+		memcpy(data, nfp_pace_fw_stats[i].name, ETH_GSTRING_LEN);
+		data += ETH_GSTRING_LEN;
+	}
+	for (i = 0; i < NFP_PACE_HIST_BUCKETS - 1; i++) {
+		snprintf(data, ETH_GSTRING_LEN, "pace_fw_late_lt_%uns",
+			 NFP_PACE_TICK_NS << i);
+		data += ETH_GSTRING_LEN;
+	}
+	snprintf(data, ETH_GSTRING_LEN, "pace_fw_late_ge_%uns",
+		 NFP_PACE_TICK_NS << (NFP_PACE_HIST_BUCKETS - 2));
+}
+
+/**
+ * nfp_pace_read_fw_stats() - Read pacing counters of firmware
+ * @nn: NFP Net device
+ * @name: Symbol of the counters
+ * @cnt: Counters, by index in firmware
+ * @num: Number of counters, at most NFP_PACE_FW_COUNTERS
+ *
+ * All counters read as 0 if the firmware has none (VFs, firmware without
+ * pacing), the counters are read with one CPP transaction.
+ */
+static void nfp_pace_read_fw_stats(struct nfp_net *nn, const char *name,
+				   u32 *cnt, unsigned int num)
+{
+	__le32 raw[NFP_PACE_FW_COUNTERS] = {};
+	const struct nfp_rtsym *sym;
+	unsigned int i;
+	u64 len;
+
+	memset(cnt, 0, num * sizeof(*cnt));
+	if (!nn->app || !nn->app->pf || !nn->app->pf->rtbl)
+		return;
+
+	sym = nfp_rtsym_lookup(nn->app->pf->rtbl, name);
+	if (!sym)
+		return;
+
+	len = min_t(u64, sym->size, num * sizeof(raw[0]));
+	if (nfp_rtsym_read(nn->app->cpp, sym, 0, raw, len) != (int)len)
+		return;
+
+	for (i = 0; i < num; i++)
+		cnt[i] = le32_to_cpu(raw[i]);
+}
+
+static void nfp_pace_get_ethtool_stats(struct net_device *netdev,
+				       struct ethtool_stats *stats, u64 *data)
+{
+	struct nfp_net *nn = netdev_priv(netdev);
+	u32 fw_cnt[NFP_PACE_FW_COUNTERS];
+	u32 hist[NFP_PACE_HIST_BUCKETS];
+	struct nfp_pace_stats sum = {};
+	struct nfp_pace_stats *ps;
+	unsigned int i;
+	int cpu;
+
+	nfp_pace_base_ethtool_ops->get_ethtool_stats(netdev, stats, data);
+	data += nfp_pace_base_ethtool_ops->get_sset_count(netdev,
+							  ETH_SS_STATS);
+
+	for_each_possible_cpu(cpu) {
+		ps = per_cpu_ptr(&nfp_pace_stats, cpu);
+		sum.paced += READ_ONCE(ps->paced);
+		sum.edt += READ_ONCE(ps->edt);
+		sum.rate_sent += READ_ONCE(ps->rate_sent);
+		sum.no_slot += READ_ONCE(ps->no_slot);
+		sum.edt_invalid += READ_ONCE(ps->edt_invalid);
+	}
+	*data++ = sum.paced;
+	*data++ = sum.edt;
+	*data++ = sum.rate_sent;
+	*data++ = sum.no_slot;
+	*data++ = sum.edt_invalid;
+
+	nfp_pace_read_fw_stats(nn, NFP_PACE_FW_SYMBOL, fw_cnt,
+			       NFP_PACE_FW_COUNTERS);
+	for (i = 0; i < ARRAY_SIZE(nfp_pace_fw_stats); i++)
+		*data++ = fw_cnt[nfp_pace_fw_stats[i].index];
+
+	nfp_pace_read_fw_stats(nn, NFP_PACE_HIST_SYMBOL, hist,
+			       NFP_PACE_HIST_BUCKETS);
+	for (i = 0; i < NFP_PACE_HIST_BUCKETS; i++)
+		*data++ = hist[i];
+}
+
+/**
+ * nfp_pace_set_ethtool_ops() - Add pacing stats to ethtool ops of vNIC
+ * @netdev: netdev of the vNIC, after nfp_net_set_ethtool_ops()
+ *
+ * All vNICs share one copy of the ops, made from the first one. A netdev
+ * with other ops is left as it is.
+ */
+static void nfp_pace_set_ethtool_ops(struct net_device *netdev)
+{
+	const struct ethtool_ops *base = netdev->ethtool_ops;
+
+	if (!base || !base->get_sset_count || !base->get_strings ||
+	    !base->get_ethtool_stats)
+		return;
+
+	if (!nfp_pace_base_ethtool_ops) {
+		nfp_pace_ethtool_ops = *base;
+		nfp_pace_ethtool_ops.get_sset_count = nfp_pace_get_sset_count;
+		nfp_pace_ethtool_ops.get_strings = nfp_pace_get_strings;
+		nfp_pace_ethtool_ops.get_ethtool_stats =
+			nfp_pace_get_ethtool_stats;
+		nfp_pace_base_ethtool_ops = base;
+	}
+
+	if (base == nfp_pace_base_ethtool_ops)
+		netdev->ethtool_ops = &nfp_pace_ethtool_ops;
+}
+
 static void nfp_net_netdev_init(struct nfp_net *nn)
 {
 	struct net_device *netdev = nn->dp.netdev;
@@ -4476,6 +5348,7 @@ static void nfp_net_netdev_init(struct nfp_net *nn)
 	netif_carrier_off(netdev);
 
 	nfp_net_set_ethtool_ops(netdev);
+	nfp_pace_set_ethtool_ops(netdev);
 }
 
 static int nfp_net_read_caps(struct nfp_net *nn)
@@ -4592,7 +5465,14 @@ int nfp_net_init(struct nfp_net *nn)
 
 	if (!nn->dp.netdev)
 		return 0;
-	return register_netdev(nn->dp.netdev);
+
+	err = nfp_pace_vnic_add(nn);
+	if (err)
+		return err;
+	err = register_netdev(nn->dp.netdev);
+	if (err)
+		nfp_pace_vnic_del(nn);
+	return err;
 
 err_clean_mbox:
 	nfp_ccm_mbox_clean(nn);
@@ -4609,6 +5489,7 @@ void nfp_net_clean(struct nfp_net *nn)
 		return;
 
 	unregister_netdev(nn->dp.netdev);
+	nfp_pace_vnic_del(nn);
 	nfp_ccm_mbox_clean(nn);
 	nfp_net_reconfig_wait_posted(nn);
 }
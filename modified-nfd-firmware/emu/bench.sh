@@ -0,0 +1,21 @@
+#!/bin/bash
+set -euo pipefail
+
+# Run the same descriptor traces on notify.c and the variants in misc/,
+# and print one table (see notify_bench.c), then the cost of the free slot
+# search by occupancy (see slot_bench.c):
+#   ./bench.sh                  all traces
+#   ./bench.sh -t paced         one trace
+#   ./bench.sh -C emem=400      with other costs
+
+cd "$(dirname "$0")"
+
+./build.sh --no-run
+
+./notify_bench_pacing -H
+for variant in pacing org less_cs ctm; do
+  "./notify_bench_$variant" "$@"
+done
+
+echo
+./slot_bench
@@ -0,0 +1,35 @@
+#!/bin/bash
+set -euo pipefail
+
+# Build notify.c for the host (gcc, no NFP toolchain needed), with the
+# pacing scenarios (pacing_test), the sizing simulator (pacing_sim), the
+# benchmark of notify.c and the variants in misc/ (notify_bench_*, run by
+# bench.sh) and of the slot search (slot_bench), and run the scenarios:
+#   ./build.sh            build and run all scenarios
+#   ./build.sh paced lso  build and run some of them
+#   ./build.sh --no-run   only build
+
+cd "$(dirname "$0")"
+
+CC="${CC:-gcc}"
+CFLAGS="${CFLAGS:--O2 -g}"
+
+# notify.c is written for NFCC, some of its idioms gcc can't see through
+WARN="-Wall -Wno-unused -Wno-maybe-uninitialized"
+
+for prog in pacing_test pacing_sim slot_bench; do
+  $CC -std=gnu11 $CFLAGS $WARN -DNOTIFY_EMU -I. -Iinclude \
+      -o "$prog" nfp_emu.c notify_emu.c "$prog.c" -lm
+done
+
+for variant in PACING ORG LESS_CS CTM; do
+  $CC -std=gnu11 $CFLAGS $WARN -DNOTIFY_EMU -I. -Iinclude \
+      -DNOTIFY_EMU_VARIANT=NOTIFY_EMU_$variant \
+      -o "notify_bench_${variant,,}" nfp_emu.c notify_emu.c notify_bench.c
+done
+
+if [ "${1:-}" = "--no-run" ]; then
+  exit 0
+fi
+
+./pacing_test "$@"
@@ -0,0 +1,2 @@
+/* Emulated by nfp_emu.h */
+#include <nfp_emu.h>
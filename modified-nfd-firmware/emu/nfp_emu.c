@@ -0,0 +1,750 @@
+/*
+ * @file          modified-nfd-firmware/emu/nfp_emu.c
+ * @brief         Cooperative ME context scheduler and memory for nfp_emu.h
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#include "nfp_emu.h"
+
+#define EMU_STACK_SZ            (1024 * 1024)
+#define EMU_MAX_CTX_VARS        64
+#define EMU_MAX_SIGNALS         32
+#define EMU_NUM_RINGS           8
+#define EMU_RING_WORDS          (64 * 1024)
+#define EMU_NUM_XFERS           (EMU_NUM_CTX << 5)
+#define EMU_MAX_EVENTS          256
+#define EMU_MAX_REGIONS         16
+
+/* Packet buffers are placed below 2^43, so buf_addr (addr >> 11) fits, and
+ * has bits in NFD_MU_PTR_DBG_MSK set like a real MU pointer */
+#define EMU_BUF_BASE            0x800000000ull
+#define EMU_BUF_SZ              2048
+
+/*
+ * Rough NFP-6xxx figures: an EMEM access that hits the cache, a ring or
+ * work queue command on the MU and a queue controller update over PCIe all
+ * take a few hundred cycles, CTM of the own island a few tens.
+ */
+struct emu_cost emu_cost = {
+    .ctx_arb = 2,
+    .alu_slice = 12,
+    .alu = 1,
+    .csr = 3,
+    .cmd = 1,
+    .mem_lat = {
+        [EMU_MEM_EMEM] = 250,
+        [EMU_MEM_CTM] = 50,
+        [EMU_MEM_RING] = 250,
+        [EMU_MEM_WORKQ] = 250,
+        [EMU_MEM_QC] = 150,
+    },
+};
+
+uint64_t emu_cycles;
+struct emu_stats emu_stats;
+
+struct emu_context {
+    ucontext_t uc;
+    void *stack;
+    int dead;
+    SIGNAL **wait_sigs;         /* not ready until these are raised */
+    int wait_all;
+    uint64_t ready_at;          /* not ready before, for sync commands */
+};
+
+/* Signal of a memory command, raised once the command completes */
+struct emu_event {
+    uint64_t when;
+    unsigned int ctx;
+    SIGNAL *sig;
+    SIGNAL *odd;                /* second signal of a pair, if set */
+    int odd_val;
+};
+
+struct emu_region {
+    unsigned char *start;
+    size_t size;
+    enum emu_mem_target target;
+    uint64_t cmds;
+};
+
+static struct emu_context emu_ctxs[EMU_NUM_CTX];
+static ucontext_t emu_sched_uc;
+static unsigned int emu_cur_ctx;
+static void (*emu_entry)(void);
+
+static struct emu_ctx_var emu_vars[EMU_MAX_CTX_VARS];
+static unsigned char *emu_var_save[EMU_MAX_CTX_VARS][EMU_NUM_CTX];
+static unsigned int emu_num_vars;
+
+static SIGNAL *emu_sig_table[EMU_MAX_SIGNALS];
+static unsigned int emu_num_sigs;
+
+static struct emu_event emu_events[EMU_MAX_EVENTS];
+static unsigned int emu_num_events;
+
+static struct emu_region emu_regions[EMU_MAX_REGIONS];
+static unsigned int emu_num_regions;
+
+static uint32_t emu_xfer_file[EMU_NUM_XFERS];
+static void *emu_xfer_map[32];
+
+struct emu_ring {
+    uint32_t words[EMU_RING_WORDS];
+    uint32_t head;
+    uint32_t tail;
+};
+
+static struct emu_ring emu_rings[EMU_NUM_RINGS];
+
+static emu_workq_fn emu_workq;
+static void *emu_workq_arg;
+
+
+void
+emu_halt(const char *file, int line)
+{
+    fprintf(stderr, "ME halted by ctx %u at %s:%d (cycle %llu)\n",
+            emu_cur_ctx, file, line, (unsigned long long)emu_cycles);
+    exit(2);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Per context variables                                                     */
+/* ------------------------------------------------------------------------- */
+
+void
+emu_ctx_vars_register(const struct emu_ctx_var *vars, unsigned int n)
+{
+    unsigned int i, ctx;
+
+    for (i = 0; i < n; i++) {
+        if (emu_num_vars == EMU_MAX_CTX_VARS)
+            emu_halt(__FILE__, __LINE__);
+
+        emu_vars[emu_num_vars] = vars[i];
+        for (ctx = 0; ctx < EMU_NUM_CTX; ctx++) {
+            emu_var_save[emu_num_vars][ctx] = malloc(vars[i].size);
+            memcpy(emu_var_save[emu_num_vars][ctx], vars[i].addr,
+                   vars[i].size);
+        }
+        emu_num_vars++;
+    }
+}
+
+void *
+emu_ctx_ptr(unsigned int ctx, void *addr)
+{
+    unsigned char *p = addr;
+    unsigned char *start;
+    unsigned int i;
+
+    if (ctx == emu_cur_ctx)
+        return addr;
+
+    for (i = 0; i < emu_num_vars; i++) {
+        start = emu_vars[i].addr;
+        if (p >= start && p < start + emu_vars[i].size)
+            return emu_var_save[i][ctx] + (p - start);
+    }
+    return addr;
+}
+
+static void
+emu_ctx_vars_switch(unsigned int from, unsigned int to)
+{
+    unsigned int i;
+
+    for (i = 0; i < emu_num_vars; i++) {
+        memcpy(emu_var_save[i][from], emu_vars[i].addr, emu_vars[i].size);
+        memcpy(emu_vars[i].addr, emu_var_save[i][to], emu_vars[i].size);
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* Scheduler                                                                 */
+/* ------------------------------------------------------------------------- */
+
+static int emu_sigs_raised(unsigned int ctx, SIGNAL *sigs[], int all);
+
+unsigned int
+emu_ctx(void)
+{
+    return emu_cur_ctx;
+}
+
+void
+emu_ctx_swap(int kill_ctx)
+{
+    emu_stats.ctx_swaps++;
+    if (kill_ctx)
+        emu_ctxs[emu_cur_ctx].dead = 1;
+    swapcontext(&emu_ctxs[emu_cur_ctx].uc, &emu_sched_uc);
+}
+
+static void
+emu_ctx_start(void)
+{
+    emu_entry();
+
+    /* Returning from main stops the context, like ctx_swap(kill) */
+    for (;;)
+        emu_ctx_swap(1);
+}
+
+/* Raise signals of commands that completed by now */
+static void
+emu_events_complete(void)
+{
+    struct emu_event *ev;
+    unsigned int i = 0;
+
+    while (i < emu_num_events) {
+        ev = &emu_events[i];
+        if (ev->when > emu_cycles) {
+            i++;
+            continue;
+        }
+
+        *(SIGNAL *)emu_ctx_ptr(ev->ctx, (void *)ev->sig) = 1;
+        if (ev->odd)
+            *(SIGNAL *)emu_ctx_ptr(ev->ctx, (void *)ev->odd) = ev->odd_val;
+        *ev = emu_events[--emu_num_events];
+    }
+}
+
+/* Earliest cycle a command completes or a context is ready again */
+static uint64_t
+emu_next_event(void)
+{
+    uint64_t next = UINT64_MAX;
+    unsigned int i;
+
+    for (i = 0; i < emu_num_events; i++) {
+        if (emu_events[i].when < next)
+            next = emu_events[i].when;
+    }
+    for (i = 0; i < EMU_NUM_CTX; i++) {
+        if (!emu_ctxs[i].dead && emu_ctxs[i].ready_at > emu_cycles &&
+            emu_ctxs[i].ready_at < next)
+            next = emu_ctxs[i].ready_at;
+    }
+    return next;
+}
+
+static int
+emu_ctx_ready(unsigned int ctx)
+{
+    struct emu_context *c = &emu_ctxs[ctx];
+
+    if (c->dead || c->ready_at > emu_cycles)
+        return 0;
+    return !c->wait_sigs || emu_sigs_raised(ctx, c->wait_sigs, c->wait_all);
+}
+
+void
+emu_run(void (*entry)(void), emu_step_fn step, void *arg)
+{
+    unsigned int ctx, i, prev = EMU_NUM_CTX - 1;
+    uint64_t start, cmds, next;
+    struct emu_ctx_stats *st;
+
+    emu_entry = entry;
+    for (ctx = 0; ctx < EMU_NUM_CTX; ctx++) {
+        emu_ctxs[ctx].stack = malloc(EMU_STACK_SZ);
+        emu_ctxs[ctx].dead = 0;
+        emu_ctxs[ctx].wait_sigs = NULL;
+        emu_ctxs[ctx].ready_at = 0;
+        getcontext(&emu_ctxs[ctx].uc);
+        emu_ctxs[ctx].uc.uc_stack.ss_sp = emu_ctxs[ctx].stack;
+        emu_ctxs[ctx].uc.uc_stack.ss_size = EMU_STACK_SZ;
+        emu_ctxs[ctx].uc.uc_link = NULL;
+        makecontext(&emu_ctxs[ctx].uc, emu_ctx_start, 0);
+    }
+
+    /* Round robin over the contexts that are ready, starting after the one
+     * that ran last, as the ME arbiter does. With none ready, time moves on
+     * to the next command completion. */
+    for (;;) {
+        emu_events_complete();
+        if (step && !step(arg))
+            break;
+
+        for (i = 1; i <= EMU_NUM_CTX; i++) {
+            ctx = (prev + i) % EMU_NUM_CTX;
+            if (emu_ctx_ready(ctx))
+                break;
+        }
+        if (i > EMU_NUM_CTX) {
+            next = emu_next_event();
+            if (next == UINT64_MAX || next <= emu_cycles)
+                next = emu_cycles + emu_cost.ctx_arb;
+            emu_stats.idle_cycles += next - emu_cycles;
+            emu_cycles = next;
+            continue;
+        }
+
+        emu_ctx_vars_switch(emu_cur_ctx, ctx);
+        emu_cur_ctx = prev = ctx;
+
+        start = emu_cycles;
+        cmds = emu_stats.mem_cmds;
+        emu_cycles += emu_cost.ctx_arb + emu_cost.alu_slice;
+        swapcontext(&emu_sched_uc, &emu_ctxs[ctx].uc);
+
+        st = &emu_stats.ctx[ctx];
+        st->runs++;
+        st->busy_cycles += emu_cycles - start;
+        if (emu_stats.mem_cmds != cmds)
+            st->work_cycles += emu_cycles - start;
+    }
+
+    for (ctx = 0; ctx < EMU_NUM_CTX; ctx++)
+        free(emu_ctxs[ctx].stack);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Signals                                                                   */
+/* ------------------------------------------------------------------------- */
+
+unsigned int
+emu_signal_number(SIGNAL *sig)
+{
+    unsigned int i;
+
+    for (i = 1; i <= emu_num_sigs; i++) {
+        if (emu_sig_table[i] == sig)
+            return i;
+    }
+    if (emu_num_sigs == EMU_MAX_SIGNALS - 1)
+        emu_halt(__FILE__, __LINE__);
+
+    emu_sig_table[++emu_num_sigs] = sig;
+    return emu_num_sigs;
+}
+
+SIGNAL_MASK
+emu_signals(SIGNAL *sigs[])
+{
+    SIGNAL_MASK mask = 0;
+
+    for (; *sigs; sigs++)
+        mask |= 1u << emu_signal_number(*sigs);
+    return mask;
+}
+
+int
+signal_test(SIGNAL *sig)
+{
+    int raised = *sig;
+
+    emu_cycles += emu_cost.alu;
+    *sig = 0;
+    return raised;
+}
+
+void
+signal_raise(SIGNAL *sig)
+{
+    *sig = 1;
+}
+
+/* Signals are per context variables, so check them through emu_ctx_ptr() */
+static int
+emu_sigs_raised(unsigned int ctx, SIGNAL *sigs[], int all)
+{
+    int raised;
+
+    for (; *sigs; sigs++) {
+        raised = *(SIGNAL *)emu_ctx_ptr(ctx, (void *)*sigs);
+        if (raised && !all)
+            return 1;
+        if (!raised && all)
+            return 0;
+    }
+    return all;
+}
+
+static void
+emu_wait(SIGNAL *sigs[], int all)
+{
+    struct emu_context *c = &emu_ctxs[emu_cur_ctx];
+
+    /* ctx_arb always swaps out, even if the signals are already raised */
+    c->wait_sigs = sigs;
+    c->wait_all = all;
+    emu_ctx_swap(0);
+    c->wait_sigs = NULL;
+}
+
+void
+emu_wait_all(SIGNAL *sigs[])
+{
+    emu_wait(sigs, 1);
+    for (; *sigs; sigs++)
+        **sigs = 0;
+}
+
+void
+emu_wait_any(SIGNAL *sigs[])
+{
+    /* Signals are left raised, for signal_test() to clear */
+    emu_wait(sigs, 0);
+}
+
+void
+wait_sig_mask(SIGNAL_MASK mask)
+{
+    SIGNAL *sigs[EMU_MAX_SIGNALS + 1];
+    unsigned int i, n = 0;
+
+    for (i = 1; i < EMU_MAX_SIGNALS; i++) {
+        if (mask & (1u << i))
+            sigs[n++] = emu_sig_table[i];
+    }
+    sigs[n] = NULL;
+    emu_wait_all(sigs);
+}
+
+/* ------------------------------------------------------------------------- */
+/* CSRs and xfer registers                                                   */
+/* ------------------------------------------------------------------------- */
+
+void
+local_csr_write(int csr, uint32_t val)
+{
+    unsigned int sig_no, ctx;
+    SIGNAL *sig;
+
+    emu_cycles += emu_cost.csr;
+    if (csr != local_csr_same_me_signal)
+        return;
+
+    sig_no = (val >> 3) & 0x1f;
+    ctx = val & 0x7;
+    if (sig_no == 0 || sig_no > emu_num_sigs)
+        return;
+
+    sig = emu_ctx_ptr(ctx, (void *)emu_sig_table[sig_no]);
+    *sig = 1;
+}
+
+void
+__assign_relative_register(void *reg, int num)
+{
+    (void)reg;
+    (void)num;
+}
+
+void
+emu_xfer_register(unsigned int reg, void *addr)
+{
+    emu_xfer_map[reg & 31] = addr;
+}
+
+uint32_t
+emu_xfer_read(unsigned int xnum)
+{
+    void *reg = emu_xfer_map[xnum & 31];
+
+    if (reg)
+        return *(uint32_t *)emu_ctx_ptr((xnum >> 5) % EMU_NUM_CTX, reg);
+    return emu_xfer_file[xnum % EMU_NUM_XFERS];
+}
+
+void
+emu_xfer_copy(void *dst, unsigned int xnum, size_t size)
+{
+    memcpy(dst, &emu_xfer_file[xnum % EMU_NUM_XFERS], size);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Memory commands (data moves at issue, signal after the latency)           */
+/* ------------------------------------------------------------------------- */
+
+uint64_t
+me_tsc_read(void)
+{
+    emu_cycles += emu_cost.csr;
+    return emu_cycles >> EMU_TSC_SHIFT;
+}
+
+void
+emu_mem_region_register(void *addr, size_t size, enum emu_mem_target target)
+{
+    if (emu_num_regions == EMU_MAX_REGIONS)
+        emu_halt(__FILE__, __LINE__);
+
+    emu_regions[emu_num_regions].start = addr;
+    emu_regions[emu_num_regions].size = size;
+    emu_regions[emu_num_regions].target = target;
+    emu_regions[emu_num_regions].cmds = 0;
+    emu_num_regions++;
+}
+
+uint64_t
+emu_mem_region_cmds(void *addr)
+{
+    unsigned char *p = addr;
+    unsigned int i;
+
+    for (i = 0; i < emu_num_regions; i++) {
+        if (p >= emu_regions[i].start &&
+            p < emu_regions[i].start + emu_regions[i].size)
+            return emu_regions[i].cmds;
+    }
+    return 0;
+}
+
+static enum emu_mem_target
+emu_mem_target(void *addr)
+{
+    unsigned char *p = addr;
+    unsigned int i;
+
+    for (i = 0; i < emu_num_regions; i++) {
+        if (p >= emu_regions[i].start &&
+            p < emu_regions[i].start + emu_regions[i].size) {
+            emu_regions[i].cmds++;
+            return emu_regions[i].target;
+        }
+    }
+    return EMU_MEM_EMEM;
+}
+
+/* Issue a command to target, raising sig (and odd of a pair) on completion.
+ * Returns the cycle the command completes. */
+static uint64_t
+emu_mem_cmd(enum emu_mem_target target, SIGNAL *sig, SIGNAL *odd, int odd_val)
+{
+    struct emu_event *ev;
+    uint64_t when;
+
+    emu_stats.mem_cmds++;
+    emu_cycles += emu_cost.cmd;
+    when = emu_cycles + emu_cost.mem_lat[target];
+    if (!sig)
+        return when;
+
+    /* Not raised until the command completes (it may be a local that
+     * was never initialized) */
+    *sig = 0;
+    if (odd)
+        *odd = 0;
+
+    if (emu_num_events == EMU_MAX_EVENTS)
+        emu_halt(__FILE__, __LINE__);
+    ev = &emu_events[emu_num_events++];
+    ev->when = when;
+    ev->ctx = emu_cur_ctx;
+    ev->sig = sig;
+    ev->odd = odd;
+    ev->odd_val = odd_val;
+    return when;
+}
+
+/* Swap out until a command without signal (ctx_swap sync) completes */
+static void
+emu_mem_sync(uint64_t when)
+{
+    emu_ctxs[emu_cur_ctx].ready_at = when;
+    emu_ctx_swap(0);
+}
+
+void
+mem_read32(void *data, void *addr, size_t size)
+{
+    memcpy(data, addr, size);
+    emu_mem_sync(emu_mem_cmd(emu_mem_target(addr), NULL, NULL, 0));
+}
+
+void
+mem_write32(void *data, void *addr, size_t size)
+{
+    memcpy(addr, data, size);
+    emu_mem_sync(emu_mem_cmd(emu_mem_target(addr), NULL, NULL, 0));
+}
+
+void
+__mem_read32(void *data, void *addr, size_t size, size_t max_size,
+             sync_t sync, SIGNAL *sig)
+{
+    (void)max_size;
+    (void)sync;
+    memcpy(data, addr, size);
+    emu_mem_cmd(emu_mem_target(addr), sig, NULL, 0);
+}
+
+void
+__mem_write32(void *data, void *addr, size_t size, size_t max_size,
+              sync_t sync, SIGNAL *sig)
+{
+    (void)max_size;
+    (void)sync;
+    memcpy(addr, data, size);
+    emu_mem_cmd(emu_mem_target(addr), sig, NULL, 0);
+}
+
+void
+__mem_read64(void *data, void *addr, size_t size, size_t max_size,
+             sync_t sync, SIGNAL *sig)
+{
+    __mem_read32(data, addr, size, max_size, sync, sig);
+}
+
+void
+__mem_write64(void *data, void *addr, size_t size, size_t max_size,
+              sync_t sync, SIGNAL *sig)
+{
+    __mem_write32(data, addr, size, max_size, sync, sig);
+}
+
+void
+mem_incr32(void *addr)
+{
+    (*(uint32_t *)addr)++;
+    emu_mem_cmd(emu_mem_target(addr), NULL, NULL, 0);
+}
+
+void
+mem_add32(void *data, void *addr, size_t size)
+{
+    uint32_t *dst = addr;
+    const uint32_t *src = data;
+    size_t i;
+
+    for (i = 0; i < size / 4; i++)
+        dst[i] += src[i];
+    emu_mem_sync(emu_mem_cmd(emu_mem_target(addr), NULL, NULL, 0));
+}
+
+/* ------------------------------------------------------------------------- */
+/* Rings, work queues and queue controller                                   */
+/* ------------------------------------------------------------------------- */
+
+void
+emu_ring_put(unsigned int rnum, const void *data, size_t size)
+{
+    struct emu_ring *ring = &emu_rings[rnum % EMU_NUM_RINGS];
+    const uint32_t *words = data;
+    size_t i;
+
+    if (ring->tail - ring->head + size / 4 > EMU_RING_WORDS)
+        emu_halt(__FILE__, __LINE__);
+
+    for (i = 0; i < size / 4; i++)
+        ring->words[ring->tail++ % EMU_RING_WORDS] = words[i];
+}
+
+unsigned int
+emu_ring_words(unsigned int rnum)
+{
+    struct emu_ring *ring = &emu_rings[rnum % EMU_NUM_RINGS];
+
+    return ring->tail - ring->head;
+}
+
+static int
+emu_ring_pop(unsigned int rnum, void *data, size_t size)
+{
+    struct emu_ring *ring = &emu_rings[rnum % EMU_NUM_RINGS];
+    uint32_t *words = data;
+    size_t i;
+
+    if (ring->tail - ring->head < size / 4)
+        return 0;
+
+    for (i = 0; i < size / 4; i++)
+        words[i] = ring->words[ring->head++ % EMU_RING_WORDS];
+    return 1;
+}
+
+void
+ctm_ring_get(unsigned int isl, unsigned int rnum, void *data,
+             size_t size, SIGNAL *sig)
+{
+    (void)isl;
+
+    /* Notify only gets messages issue DMA said are there */
+    if (!emu_ring_pop(rnum, data, size))
+        emu_halt(__FILE__, __LINE__);
+    emu_mem_cmd(EMU_MEM_CTM, sig, NULL, 0);
+}
+
+void
+emu_ring_get(unsigned int rnum, unsigned int xnum, size_t size,
+             SIGNAL_PAIR *sigpair)
+{
+    int empty;
+
+    empty = !emu_ring_pop(rnum, &emu_xfer_file[xnum % EMU_NUM_XFERS], size);
+    emu_mem_cmd(EMU_MEM_RING, &sigpair->even, &sigpair->odd, empty);
+}
+
+void
+emu_set_workq_fn(emu_workq_fn fn, void *arg)
+{
+    emu_workq = fn;
+    emu_workq_arg = arg;
+}
+
+void
+__mem_workq_add_work(unsigned int rnum, mem_ring_addr_t raddr,
+                     void *data, size_t size, size_t max_size,
+                     sync_t sync, SIGNAL *sig)
+{
+    (void)raddr;
+    (void)max_size;
+    (void)sync;
+
+    emu_stats.workq_msgs++;
+    if (emu_workq)
+        emu_workq(emu_workq_arg, rnum, data, size);
+    emu_mem_cmd(EMU_MEM_WORKQ, sig, NULL, 0);
+}
+
+void
+__qc_add_to_ptr_ind(unsigned int isl, unsigned int queue, int ptr,
+                    unsigned int value, unsigned int xnum, sync_t sync,
+                    SIGNAL *sig)
+{
+    (void)isl;
+    (void)queue;
+    (void)ptr;
+    (void)value;
+    (void)xnum;
+    (void)sync;
+
+    emu_stats.qc_updates++;
+    emu_mem_cmd(EMU_MEM_QC, sig, NULL, 0);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Packet buffers                                                            */
+/* ------------------------------------------------------------------------- */
+
+void *
+emu_buf_alloc(unsigned int num_bufs)
+{
+    void *bufs;
+
+    bufs = mmap((void *)EMU_BUF_BASE, (size_t)num_bufs * EMU_BUF_SZ,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (bufs != (void *)EMU_BUF_BASE) {
+        perror("emu_buf_alloc");
+        exit(2);
+    }
+    return bufs;
+}
+
+uint32_t
+emu_buf_addr(void *buf)
+{
+    return (uint32_t)((uintptr_t)buf >> 11);
+}
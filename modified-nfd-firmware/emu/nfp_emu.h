@@ -0,0 +1,416 @@
+/*
+ * @file          modified-nfd-firmware/emu/nfp_emu.h
+ * @brief         Host emulation of the NFP ME intrinsics used by notify.c
+ *
+ * notify.c is compiled with gcc (-DNOTIFY_EMU) against this header, so the
+ * pacing queue can run as a userspace program. The eight ME contexts run
+ * cooperatively on one thread, and only swap where the ME would (ctx_swap,
+ * waiting on signals, synchronous memory commands).
+ *
+ * Memory is host memory: xfer registers, GPRs, LM, CTM and EMEM are plain C
+ * variables. Data moves when a memory command is issued, but its signal is
+ * raised after the latency of the command target (struct emu_cost), and
+ * contexts are charged cycles for the instructions the emulation sees.
+ * Non-shared globals are per context on the ME, so the glue registers them
+ * (emu_ctx_vars_register) and they are swapped on every context switch.
+ */
+#ifndef _NFP_EMU_H_
+#define _NFP_EMU_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* ------------------------------------------------------------------------- */
+/* NFCC qualifiers and builtins                                              */
+/* ------------------------------------------------------------------------- */
+
+#define __xread
+#define __xwrite
+#define __xrw
+#define __shared
+#define __gpr
+#define __lmem
+#define __ctm40
+#define __emem
+#define __mem40
+#define __export
+#define __remote
+#define __intrinsic static inline __attribute__((unused))
+
+#define __critical_path()
+#define __implicit_read(_x)             ((void)(_x))
+#define __implicit_write(_x)            ((void)(_x))
+#define __is_ct_const(_x)               1
+#define __is_aligned(_x, _a)            (((_x) & ((_a) - 1)) == 0)
+#define ctassert(_x)                    ((void)0)
+
+#define _NFP_CHIPRES_ASM(...)
+#define NFD_INIT_DONE_DECLARE
+#define NFD_IN_RING_NUM_ALLOC(_isl, _num)
+
+typedef volatile int SIGNAL;
+typedef struct { SIGNAL even; SIGNAL odd; } SIGNAL_PAIR;
+typedef unsigned int SIGNAL_MASK;
+typedef uint32_t mem_ring_addr_t;
+
+typedef enum { sig_done, ctx_swap_sync } sync_t;
+
+/* ------------------------------------------------------------------------- */
+/* NFD configuration of the emulated notify ME (override with -D)            */
+/* ------------------------------------------------------------------------- */
+
+#ifndef PCIE_ISL
+#define PCIE_ISL                        0
+#endif
+
+#define NFD_IN_HAS_ISSUE0
+#define NFD_IN_HAS_ISSUE1
+#define NFD_IN_ADD_SEQN
+
+#ifndef NFD_IN_NUM_SEQRS
+#define NFD_IN_NUM_SEQRS                4
+#endif
+#define NFD_IN_SEQR_NUM(_raw0)          (((_raw0) >> 24) & (NFD_IN_NUM_SEQRS - 1))
+
+#define NFD_IN_NUM_WQS                  1
+#define NFD_IN_WQ_SZ                    4096
+#define NFD_IN_MAX_BATCH_SZ             8
+#define NFD_IN_DATA_OFFSET              64
+
+#define NFD_IN_NOTIFY_STRIDE            2
+#define NFD_IN_NOTIFY_MANAGER0          0
+#define NFD_IN_NOTIFY_MANAGER1          1
+#define NFD_IN_NOTIFY_DATA_RD           1
+#define NFD_IN_NOTIFY_JUMBO_RD          2
+#define NFD_IN_NOTIFY_RESET_RD          3
+#define NFD_IN_NOTIFY_QC_RD             4
+
+/* Ring numbers, as used by NFD_RING_LINK() */
+#define NFD_IN_ISSUED_RING0_NUM         0
+#define NFD_IN_ISSUED_RING1_NUM         1
+#define NFD_IN_ISSUED_LSO_RING0_NUM     2
+#define NFD_IN_ISSUED_LSO_RING1_NUM     3
+#define NFD_IN_WQ_RING_NUM              4
+
+#define NFD_IN_ISSUED_DESC_LSO_NULL     0
+#define NFD_IN_ISSUED_DESC_LSO_RET      1
+#define NFD_IN_ISSUED_DESC_LSO_NO_RET   2
+
+#define NFD_IN_TX_QUEUE                 0
+#define NFD_IN_NOTIFY_MU_PTR_INVALID    0x0badb0b0
+#define NFD_IN_NOTIFY_LSO_DESC_INVALID  0x0badde5c
+#define NFD_IN_DATA_DMA_ME0             0
+#define NFD_IN_DATA_DMA_ME1             0
+#define NFD_IN_ISSUE_MANAGER            0
+
+#define NFD_RING_LINK(_isl, _comp, _num) (_num)
+#define NFD_EMEM_LINK(_isl)             0
+#define NFD_PCIE0_EMEM                  emem0
+#define NFD_NATQ2QC(_natq, _type)       (_natq)
+/* LSO debug counters are not built (no NFD_IN_LSO_CNTR_ENABLE) */
+#define NFD_IN_LSO_CNTR_INCR(_addr, _cntr)
+#define NFD_BMQ2NATQ(_bmq)              (_bmq)
+#define QC_RPTR                         0
+
+/* ------------------------------------------------------------------------- */
+/* NFD descriptors (NFP bit layout, fields listed LSB first for gcc)         */
+/* ------------------------------------------------------------------------- */
+
+struct nfd_in_issued_desc {
+    union {
+        struct {
+            unsigned int q_num:8;
+            unsigned int sp1:8;
+            unsigned int num_batch:4;
+            unsigned int sp0:1;
+            unsigned int lso_end:1;
+            unsigned int lso:2;
+            unsigned int offset:7;
+            unsigned int eop:1;
+
+            unsigned int buf_addr:32;
+
+            unsigned int lso_seq_cnt:8;
+            unsigned int l4_offset:8;
+            unsigned int l3_offset:8;
+            unsigned int flags:8;
+
+            unsigned int vlan:16;
+            unsigned int data_len:16;
+        };
+        unsigned int __raw[4];
+    };
+};
+
+struct nfd_in_pkt_desc {
+    union {
+        struct {
+            unsigned int offset:7;
+            unsigned int is_nfd:1;
+            unsigned int seq_num:16;
+            unsigned int q_num:6;
+            unsigned int intf:2;
+
+            unsigned int buf_addr:32;
+
+            unsigned int lso_seq_cnt:8;
+            unsigned int l4_offset:8;
+            unsigned int l3_offset:8;
+            unsigned int flags:8;
+
+            unsigned int vlan:16;
+            unsigned int data_len:16;
+        };
+        unsigned int __raw[4];
+    };
+};
+
+struct nfd_in_lso_desc {
+    struct nfd_in_issued_desc desc;
+    unsigned int jumbo_seq;
+};
+
+/* ------------------------------------------------------------------------- */
+/* ME CSRs                                                                   */
+/* ------------------------------------------------------------------------- */
+
+enum {
+    local_csr_same_me_signal,
+    local_csr_active_lm_addr_3,
+    local_csr_cmd_indirect_ref_0,
+    local_csr_t_index,
+    local_csr_mailbox_0,
+    local_csr_mailbox_1,
+};
+
+#define NFP_MECSR_SAME_ME_SIGNAL_SIG_NO(_x)     (((_x) & 0x1f) << 3)
+#define NFP_MECSR_SAME_ME_SIGNAL_CTX(_x)        ((_x) & 0x7)
+#define NFP_MECSR_PREV_ALU_OVE_DATA(_x)         ((_x) << 3)
+#define NFP_MECSR_PREV_ALU_DATA16_shift         20
+#define NFP_MECSR_PREV_ALU_OV_SIG_NUM_bit       13
+#define MECSR_XFER_INDEX(_x)                    ((_x) << 2)
+
+struct nfp_mecsr_cmd_indirect_ref_0 {
+    union {
+        struct {
+            unsigned int signal_num:4;
+            unsigned int signal_ctx:3;
+            unsigned int reserved:25;
+        };
+        unsigned int __raw;
+    };
+};
+
+void local_csr_write(int csr, uint32_t val);
+void __assign_relative_register(void *reg, int num);
+
+/* ------------------------------------------------------------------------- */
+/* Contexts and signals                                                      */
+/* ------------------------------------------------------------------------- */
+
+#define EMU_NUM_CTX                     8
+
+unsigned int emu_ctx(void);
+void emu_ctx_swap(int kill_ctx);
+void emu_halt(const char *file, int line) __attribute__((noreturn));
+
+#define ctx()                           emu_ctx()
+/* ctx_swap() or ctx_swap(kill), named so kill() of libc can be used too */
+#define ctx_swap(...)                   emu_ctx_swap(#__VA_ARGS__[0] == 'k')
+#define ctx_wait(_how)                  emu_ctx_swap(0)
+#define halt()                          emu_halt(__FILE__, __LINE__)
+
+unsigned int emu_signal_number(SIGNAL *sig);
+SIGNAL_MASK emu_signals(SIGNAL *sigs[]);
+void emu_wait_all(SIGNAL *sigs[]);
+void emu_wait_any(SIGNAL *sigs[]);
+void wait_sig_mask(SIGNAL_MASK mask);
+
+#define __signal_number(_sig, ...)      emu_signal_number((SIGNAL *)(_sig))
+#define __signals(...)                  emu_signals((SIGNAL *[]){__VA_ARGS__, NULL})
+#define __xfer_reg_number(...)          0
+#define wait_for_all(...)               emu_wait_all((SIGNAL *[]){__VA_ARGS__, NULL})
+#define wait_for_any(...)               emu_wait_any((SIGNAL *[]){__VA_ARGS__, NULL})
+#define wait_for_all_single(_sig)       wait_for_all(_sig)
+
+int signal_test(SIGNAL *sig);
+void signal_raise(SIGNAL *sig);
+
+/* Ordering of contexts (vnic/utils/ordering.h): a context signals the
+ * next one, with the same signal, when it is done */
+__intrinsic void
+reorder_start(unsigned int start_ctx, SIGNAL *sig)
+{
+    local_csr_write(local_csr_same_me_signal,
+                    NFP_MECSR_SAME_ME_SIGNAL_SIG_NO(__signal_number(sig)) |
+                    NFP_MECSR_SAME_ME_SIGNAL_CTX(start_ctx));
+}
+
+__intrinsic unsigned int
+reorder_get_next_ctx_off(unsigned int start_ctx, unsigned int off)
+{
+    return NFP_MECSR_SAME_ME_SIGNAL_CTX(start_ctx + off);
+}
+
+__intrinsic void
+reorder_done_opt(unsigned int *next_ctx, SIGNAL *sig)
+{
+    local_csr_write(local_csr_same_me_signal,
+                    NFP_MECSR_SAME_ME_SIGNAL_SIG_NO(__signal_number(sig)) |
+                    *next_ctx);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Cost model                                                                */
+/* ------------------------------------------------------------------------- */
+
+/* Targets of memory commands, each with its own latency */
+enum emu_mem_target {
+    EMU_MEM_EMEM,               /* addresses not registered as anything else */
+    EMU_MEM_CTM,
+    EMU_MEM_RING,               /* MU ring get */
+    EMU_MEM_WORKQ,
+    EMU_MEM_QC,
+    EMU_MEM_NUM
+};
+
+/*
+ * ME cycles charged by the emulation. Plain C between two intrinsics is not
+ * seen instruction by instruction, it is charged as alu_slice each time a
+ * context is swapped in.
+ */
+struct emu_cost {
+    unsigned int ctx_arb;       /* swapping in a context */
+    unsigned int alu_slice;     /* ALU/LM instructions of one run of a ctx */
+    unsigned int alu;           /* find first set, branch on signal */
+    unsigned int csr;           /* local CSR or timestamp access */
+    unsigned int cmd;           /* issuing a memory command */
+    unsigned int mem_lat[EMU_MEM_NUM];  /* from issue to signal */
+};
+
+extern struct emu_cost emu_cost;
+
+/* Emulated time, in ME cycles */
+extern uint64_t emu_cycles;
+
+/* Memory commands to [addr, addr + size) go to target instead of EMEM
+   (register EMEM regions to count the commands to them) */
+void emu_mem_region_register(void *addr, size_t size,
+                             enum emu_mem_target target);
+
+/* Memory commands issued to the registered region holding addr */
+uint64_t emu_mem_region_cmds(void *addr);
+
+/* ------------------------------------------------------------------------- */
+/* Timestamp and ALU helpers                                                 */
+/* ------------------------------------------------------------------------- */
+
+/* ME timestamp counter ticks once every 16 cycles */
+#define EMU_TSC_SHIFT                   4
+
+uint64_t me_tsc_read(void);
+
+/* Bit index of least significant bit set, like the ME instruction */
+static inline unsigned int
+emu_ffs(uint32_t x)
+{
+    emu_cycles += emu_cost.alu;
+    return x ? (unsigned int)__builtin_ctz(x) : 32;
+}
+
+#define ffs(_x)                         emu_ffs(_x)
+
+/* ------------------------------------------------------------------------- */
+/* Memory, rings and queue controller                                        */
+/* ------------------------------------------------------------------------- */
+
+void mem_read32(void *data, void *addr, size_t size);
+void mem_write32(void *data, void *addr, size_t size);
+void __mem_read32(void *data, void *addr, size_t size, size_t max_size,
+                  sync_t sync, SIGNAL *sig);
+void __mem_write32(void *data, void *addr, size_t size, size_t max_size,
+                   sync_t sync, SIGNAL *sig);
+void __mem_read64(void *data, void *addr, size_t size, size_t max_size,
+                  sync_t sync, SIGNAL *sig);
+void __mem_write64(void *data, void *addr, size_t size, size_t max_size,
+                   sync_t sync, SIGNAL *sig);
+void mem_incr32(void *addr);
+void mem_add32(void *data, void *addr, size_t size);
+
+void ctm_ring_get(unsigned int isl, unsigned int rnum, void *data,
+                  size_t size, SIGNAL *sig);
+void __mem_workq_add_work(unsigned int rnum, mem_ring_addr_t raddr,
+                          void *data, size_t size, size_t max_size,
+                          sync_t sync, SIGNAL *sig);
+void __qc_add_to_ptr_ind(unsigned int isl, unsigned int queue, int ptr,
+                         unsigned int value, unsigned int xnum, sync_t sync,
+                         SIGNAL *sig);
+
+/* Ring get of an emulated MU ring into xfer registers (odd signal = empty) */
+void emu_ring_get(unsigned int rnum, unsigned int xnum, size_t size,
+                  SIGNAL_PAIR *sigpair);
+
+/* Absolute xfer registers (ctx << 5 | reg) */
+uint32_t emu_xfer_read(unsigned int xnum);
+void emu_xfer_copy(void *dst, unsigned int xnum, size_t size);
+
+/* ------------------------------------------------------------------------- */
+/* Host side of the emulation                                                */
+/* ------------------------------------------------------------------------- */
+
+/* A per context global (a register or LM variable without __shared) */
+struct emu_ctx_var {
+    void *addr;
+    size_t size;
+};
+
+#define EMU_CTX_VAR(_var)               { (void *)&(_var), sizeof(_var) }
+
+void emu_ctx_vars_register(const struct emu_ctx_var *vars, unsigned int n);
+
+/* Per context copy of a registered variable (the variable itself if
+ * it is not registered, or ctx is the running context) */
+void *emu_ctx_ptr(unsigned int ctx, void *addr);
+
+/* Map xfer register reg (of each context) to a registered variable */
+void emu_xfer_register(unsigned int reg, void *addr);
+
+/* Called between context switches, return 0 to stop the emulation */
+typedef int (*emu_step_fn)(void *arg);
+
+/* Called for each message added to a work queue */
+typedef void (*emu_workq_fn)(void *arg, unsigned int rnum,
+                             const void *data, size_t size);
+
+/* Run entry on all contexts (like the ME runs main) until step stops */
+void emu_run(void (*entry)(void), emu_step_fn step, void *arg);
+
+void emu_set_workq_fn(emu_workq_fn fn, void *arg);
+
+/* Host side of MU rings feeding the ME */
+void emu_ring_put(unsigned int rnum, const void *data, size_t size);
+unsigned int emu_ring_words(unsigned int rnum);
+
+struct emu_ctx_stats {
+    uint64_t runs;
+    uint64_t busy_cycles;       /* cycles the context ran */
+    uint64_t work_cycles;       /* of those, in runs that issued commands */
+};
+
+struct emu_stats {
+    uint64_t ctx_swaps;
+    uint64_t mem_cmds;
+    uint64_t workq_msgs;
+    uint64_t qc_updates;
+    uint64_t idle_cycles;       /* no context ready to run */
+    struct emu_ctx_stats ctx[EMU_NUM_CTX];
+};
+
+extern struct emu_stats emu_stats;
+
+/* Memory packet buffers live in, so buf_addr << 11 is a host pointer */
+void *emu_buf_alloc(unsigned int num_bufs);
+uint32_t emu_buf_addr(void *buf);
+
+#endif /* !_NFP_EMU_H_ */
@@ -0,0 +1,463 @@
+/*
+ * @file          modified-nfd-firmware/emu/notify_bench.c
+ * @brief         Compare the notify variants on identical descriptor traces
+ *
+ * Built once per variant (notify_bench_<variant>, see NOTIFY_EMU_VARIANT),
+ * bench.sh runs them all and prints one table. Traces are generated from a
+ * fixed seed, so every variant is issued the same descriptors at the same
+ * times:
+ *  - unpaced: batches of 8 without pacing metadata, as fast as notify
+ *    takes them
+ *  - paced: 16 flows at 1 Gbps, batches of 8 packets with a pacing rate
+ *  - tso: 4 flows at 2.5 Gbps, each sending 44 segment TSO packets
+ *  - mixed: the paced flows, and as many unpaced packets
+ *
+ * Reported: descriptors sent until the last one went to the work queue
+ * (Mpps, the throughput for the unpaced trace). Per descriptor sent, ME
+ * cycles (of all contexts, and of the runs that issued commands), context
+ * swaps and memory commands. For paced flows, how far the gap between two
+ * departures of a flow is from its IDT. Variants without pacing send a
+ * batch back to back, so their gap error is close to the IDT.
+ *
+ * usage: notify_bench [-H] [-t trace] [-C cost=cycles]...
+ *
+ * -H prints the table header, -t runs one trace. Costs are as for
+ * pacing_sim.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "notify_emu.h"
+
+#define MAX_PKTS                (64 * 1024)
+#define MAX_SEGS                64
+#define DRAIN_TICKS             (5 * 1000 * 1000 / 20)
+
+#define NS_TO_TICKS(_ns)        ((uint64_t)((_ns) / NOTIFY_EMU_TICK_NS))
+#define TICKS_TO_US(_t)         ((double)(_t) * NOTIFY_EMU_TICK_NS / 1000.0)
+
+struct trace {
+    const char *name;
+    unsigned int flows;
+    double gbps;
+    unsigned int tso;           /* flows send TSO packets of segs */
+    unsigned int segs;
+    unsigned int unpaced;       /* unpaced packets, 0 = none */
+    unsigned int duration_us;   /* 0 = unpaced packets all at once */
+};
+
+static const struct trace traces[] = {
+    { "unpaced", 0, 0, 0, 0, 16 * 1024, 0 },
+    { "paced", 16, 1.0, 0, 0, 0, 1000 },
+    { "tso", 4, 2.5, 1, 44, 0, 1000 },
+    { "mixed", 16, 1.0, 0, 0, 10 * 1024, 1000 },
+};
+
+#define NUM_TRACES (sizeof(traces) / sizeof(traces[0]))
+
+#define PKT_LEN                 1514
+
+struct pkt {
+    uint32_t flow;              /* 0 = not paced */
+    uint32_t idt_ns;
+    uint64_t out_time;
+    uint32_t out_cnt;
+};
+
+struct batch {
+    uint64_t time;
+    unsigned int side;
+    unsigned int q_num;
+    unsigned int first;
+    unsigned int num;
+    unsigned int lso;
+};
+
+static const struct trace *tr;
+
+static struct pkt *pkts;
+static unsigned int num_pkts;
+static unsigned int num_out;
+static unsigned char *bufs;
+
+static struct batch *batches;
+static unsigned int num_batches;
+static unsigned int next_batch;
+static unsigned int side_issued[2];
+
+static uint64_t start_time;
+static int started;
+static uint64_t end_time;       /* last packet sent */
+
+/* Counters when notify got ready */
+static struct emu_stats stats0;
+
+static uint32_t rand_state = 1;
+
+
+static uint32_t
+bench_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+static unsigned int
+add_pkt(uint32_t flow, uint32_t idt_ns)
+{
+    struct pkt *p = &pkts[num_pkts];
+
+    if (num_pkts == MAX_PKTS) {
+        fprintf(stderr, "%s: more than %u packets\n", tr->name, MAX_PKTS);
+        exit(2);
+    }
+    p->flow = flow;
+    p->idt_ns = idt_ns;
+    return num_pkts++;
+}
+
+static void
+add_batch(uint64_t time, unsigned int side, unsigned int q_num,
+          unsigned int first, unsigned int num, unsigned int lso)
+{
+    struct batch *b = &batches[num_batches++];
+
+    b->time = time;
+    b->side = side;
+    b->q_num = q_num;
+    b->first = first;
+    b->num = num;
+    b->lso = lso;
+}
+
+static int
+batch_cmp(const void *a, const void *b)
+{
+    const struct batch *x = a, *y = b;
+
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return x->first < y->first ? -1 : 1;
+}
+
+/* Flows send at their rate from a random phase, as in pacing_sim */
+static void
+build(void)
+{
+    uint64_t duration = NS_TO_TICKS(tr->duration_us * 1000.0);
+    uint64_t t, gap;
+    unsigned int flow, i, first, n;
+    uint32_t idt_ns = 0;
+
+    if (tr->flows)
+        idt_ns = (uint32_t)(PKT_LEN * 8 / tr->gbps);
+
+    for (flow = 1; flow <= tr->flows; flow++) {
+        n = tr->tso ? tr->segs : NFD_IN_MAX_BATCH_SZ;
+        gap = NS_TO_TICKS((double)n * idt_ns);
+
+        for (t = bench_rand() % gap; t < duration; t += gap) {
+            first = num_pkts;
+            for (i = 0; i < n; i++)
+                add_pkt(flow, idt_ns);
+            add_batch(t, flow & 1, flow & 0x3f, first, n, tr->tso);
+        }
+    }
+
+    n = tr->unpaced / NFD_IN_MAX_BATCH_SZ;
+    gap = n ? duration / n : 0;
+    for (i = 0; i < n; i++) {
+        first = num_pkts;
+        for (flow = 0; flow < NFD_IN_MAX_BATCH_SZ; flow++)
+            add_pkt(0, 0);
+        add_batch(i * gap, i & 1, 0, first, NFD_IN_MAX_BATCH_SZ, 0);
+    }
+
+    qsort(batches, num_batches, sizeof(*batches), batch_cmp);
+}
+
+static void
+fill_desc(struct nfd_in_issued_desc *desc, unsigned int i)
+{
+    struct pkt *p = &pkts[i];
+    uint32_t *meta;
+    unsigned int meta_len = p->flow ? 4 + 8 : 0;
+
+    memset(desc, 0, sizeof(*desc));
+    desc->eop = 1;
+    desc->offset = meta_len;
+    desc->buf_addr = emu_buf_addr(bufs + (size_t)i * 2048);
+    desc->data_len = meta_len + PKT_LEN;
+
+    if (meta_len) {
+        meta = (uint32_t *)(bufs + (size_t)i * 2048 +
+                            NFD_IN_DATA_OFFSET - meta_len);
+        meta[0] = NOTIFY_EMU_META_PACING;
+        meta[1] = p->flow;
+        meta[2] = notify_emu_idt_word(p->idt_ns);
+    }
+}
+
+static void
+issue_batch(struct batch *b)
+{
+    struct nfd_in_issued_desc descs[NFD_IN_MAX_BATCH_SZ];
+    struct nfd_in_lso_desc segs[MAX_SEGS];
+    unsigned int i;
+
+    memset(descs, 0, sizeof(descs));
+    if (b->lso) {
+        for (i = 0; i < b->num; i++) {
+            fill_desc(&segs[i].desc, b->first + i);
+            segs[i].desc.lso = (i == b->num - 1) ?
+                NFD_IN_ISSUED_DESC_LSO_RET : NFD_IN_ISSUED_DESC_LSO_NO_RET;
+            segs[i].desc.lso_end = (i == b->num - 1);
+        }
+        notify_emu_issue_lso(b->side, segs, b->num);
+
+        descs[0].eop = 0;
+        descs[0].lso = NFD_IN_ISSUED_DESC_LSO_NO_RET;
+        descs[0].num_batch = 1;
+    } else {
+        for (i = 0; i < b->num; i++)
+            fill_desc(&descs[i], b->first + i);
+        descs[0].num_batch = b->num;
+    }
+    descs[0].q_num = b->q_num;
+
+    notify_emu_issue(b->side, descs);
+}
+
+static void
+workq_msg(void *arg, unsigned int rnum, const void *data, size_t size)
+{
+    const struct nfd_in_pkt_desc *desc = data;
+    unsigned int i;
+
+    (void)arg;
+    (void)rnum;
+    (void)size;
+
+    i = desc->buf_addr - emu_buf_addr(bufs);
+    if (i >= num_pkts)
+        return;
+
+    pkts[i].out_time = emu_cycles >> EMU_TSC_SHIFT;
+    pkts[i].out_cnt++;
+    num_out++;
+    end_time = pkts[i].out_time;
+}
+
+static int
+step(void *arg)
+{
+    uint64_t now = emu_cycles >> EMU_TSC_SHIFT;
+    unsigned int side, served;
+    struct batch *b;
+
+    (void)arg;
+
+    if (!started) {
+        if (!notify_emu_ready())
+            return 1;
+        start_time = now;
+        started = 1;
+        stats0 = emu_stats;
+    }
+
+    /* Keep at most 4 batches per side in flight, like issue DMA */
+    while (next_batch < num_batches &&
+           start_time + batches[next_batch].time <= now) {
+        b = &batches[next_batch];
+        side = b->side;
+        served = notify_emu_served(side) / NFD_IN_MAX_BATCH_SZ;
+        if (side_issued[side] - served >= 4)
+            break;
+
+        issue_batch(b);
+        side_issued[side]++;
+        next_batch++;
+    }
+
+    if (num_out >= num_pkts && next_batch == num_batches)
+        return 0;
+    return now < start_time + NS_TO_TICKS(tr->duration_us * 1000.0) +
+                 DRAIN_TICKS;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Report                                                                    */
+/* ------------------------------------------------------------------------- */
+
+static int
+err_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* |gap - IDT| of consecutive departures of each paced flow, sorted */
+static unsigned int
+gap_errors(uint64_t *err)
+{
+    static uint64_t prev_out[MAX_PKTS];
+    unsigned int i, n = 0;
+    int64_t gap, idt;
+    struct pkt *p;
+
+    for (i = 0; i < num_pkts; i++) {
+        p = &pkts[i];
+        if (!p->flow || p->out_cnt != 1)
+            continue;
+
+        if (prev_out[p->flow]) {
+            gap = (int64_t)(p->out_time - prev_out[p->flow]);
+            idt = (int64_t)NS_TO_TICKS(p->idt_ns);
+            err[n++] = gap > idt ? gap - idt : idt - gap;
+        }
+        prev_out[p->flow] = p->out_time;
+    }
+    qsort(err, n, sizeof(*err), err_cmp);
+    return n;
+}
+
+static void
+run(void)
+{
+    static uint64_t err[MAX_PKTS];
+    uint64_t busy = 0, work = 0, sum = 0;
+    unsigned int i, n, lost = 0, dup = 0;
+    double per;
+
+    pkts = calloc(MAX_PKTS, sizeof(*pkts));
+    batches = calloc(MAX_PKTS, sizeof(*batches));
+    bufs = emu_buf_alloc(MAX_PKTS);
+    build();
+
+    notify_emu_init();
+    emu_set_workq_fn(workq_msg, NULL);
+    notify_emu_run(step, NULL);
+
+    for (i = 0; i < num_pkts; i++) {
+        lost += pkts[i].out_cnt == 0;
+        dup += pkts[i].out_cnt > 1;
+    }
+    for (i = 0; i < EMU_NUM_CTX; i++) {
+        busy += emu_stats.ctx[i].busy_cycles - stats0.ctx[i].busy_cycles;
+        work += emu_stats.ctx[i].work_cycles - stats0.ctx[i].work_cycles;
+    }
+    per = num_out ? 1.0 / num_out : 0;
+
+    n = gap_errors(err);
+    for (i = 0; i < n; i++)
+        sum += err[i];
+
+    printf("%-8s %-8s %6u %5u %7.2f %8.1f %8.1f %7.2f %7.2f",
+           notify_emu_variant(), tr->name, num_out, lost + dup,
+           num_out / TICKS_TO_US(end_time - start_time), busy * per,
+           work * per,
+           (emu_stats.ctx_swaps - stats0.ctx_swaps) * per,
+           (emu_stats.mem_cmds - stats0.mem_cmds) * per);
+    if (n)
+        printf(" %8.2f %8.2f\n", TICKS_TO_US(sum / n),
+               TICKS_TO_US(err[(unsigned int)(n * 0.99)]));
+    else
+        printf(" %8s %8s\n", "-", "-");
+}
+
+static void
+run_child(const struct trace *t)
+{
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        tr = t;
+        run();
+        exit(0);
+    }
+
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status))
+        printf("%-8s %-8s killed by signal %d\n", notify_emu_variant(),
+               t->name, WTERMSIG(status));
+    else if (!WIFEXITED(status) || WEXITSTATUS(status))
+        printf("%-8s %-8s halted\n", notify_emu_variant(), t->name);
+}
+
+static int
+set_cost(const char *arg)
+{
+    static const struct {
+        const char *name;
+        unsigned int *cost;
+    } costs[] = {
+        { "ctx_arb", &emu_cost.ctx_arb },
+        { "alu_slice", &emu_cost.alu_slice },
+        { "alu", &emu_cost.alu },
+        { "csr", &emu_cost.csr },
+        { "cmd", &emu_cost.cmd },
+        { "emem", &emu_cost.mem_lat[EMU_MEM_EMEM] },
+        { "ctm", &emu_cost.mem_lat[EMU_MEM_CTM] },
+        { "ring", &emu_cost.mem_lat[EMU_MEM_RING] },
+        { "workq", &emu_cost.mem_lat[EMU_MEM_WORKQ] },
+        { "qc", &emu_cost.mem_lat[EMU_MEM_QC] },
+    };
+    const char *eq = strchr(arg, '=');
+    unsigned int i;
+
+    for (i = 0; eq && i < sizeof(costs) / sizeof(costs[0]); i++) {
+        if (strlen(costs[i].name) == (size_t)(eq - arg) &&
+            !strncmp(costs[i].name, arg, eq - arg)) {
+            *costs[i].cost = atoi(eq + 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: notify_bench [-H] [-t trace] [-C cost=cycles]...\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *only = NULL;
+    unsigned int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "Ht:C:")) != -1) {
+        switch (opt) {
+        case 'H':
+            printf("                                  ME cycles/desc"
+                   "     per desc   gap-IDT us\n");
+            printf("variant  trace      sent  lost    Mpps     busy"
+                   "     work   swaps    cmds     mean      p99\n");
+            return 0;
+        case 't': only = optarg; break;
+        case 'C':
+            if (!set_cost(optarg))
+                usage();
+            break;
+        default: usage();
+        }
+    }
+
+    for (i = 0; i < NUM_TRACES; i++) {
+        if (!only || !strcmp(only, traces[i].name))
+            run_child(&traces[i]);
+    }
+    return 0;
+}
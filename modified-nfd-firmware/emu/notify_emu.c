@@ -0,0 +1,357 @@
+/*
+ * @file          modified-nfd-firmware/emu/notify_emu.c
+ * @brief         Build notify.c (or a variant of it, NOTIFY_EMU_VARIANT) for
+ *                the host, and drive it like issue DMA
+ */
+
+#include "notify_emu.h"
+
+#define main notify_main
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+#include "../notify.c"
+#elif NOTIFY_EMU_VARIANT == NOTIFY_EMU_ORG
+#include "../misc/notify-org.c"
+#elif NOTIFY_EMU_VARIANT == NOTIFY_EMU_LESS_CS
+#include "../misc/notify-less-cs.c"
+#elif NOTIFY_EMU_VARIANT == NOTIFY_EMU_CTM
+#include "../misc/notify-ctm.c"
+#else
+#error "Unknown NOTIFY_EMU_VARIANT"
+#endif
+#undef main
+
+/* Globals that are per context on the ME (no __shared) */
+static const struct emu_ctx_var notify_ctx_vars[] = {
+    EMU_CTX_VAR(nfd_in_data_compl_refl_in),
+    EMU_CTX_VAR(nfd_in_jumbo_compl_refl_in),
+    EMU_CTX_VAR(notify_reset_state_xfer),
+    EMU_CTX_VAR(data_dma_seq_sent),
+    EMU_CTX_VAR(lso_ring_addr),
+    EMU_CTX_VAR(lso_ring_num),
+    EMU_CTX_VAR(wq_sig0),
+    EMU_CTX_VAR(wq_sig1),
+    EMU_CTX_VAR(wq_sig2),
+    EMU_CTX_VAR(wq_sig3),
+    EMU_CTX_VAR(wq_sig4),
+    EMU_CTX_VAR(wq_sig5),
+    EMU_CTX_VAR(wq_sig6),
+    EMU_CTX_VAR(wq_sig7),
+    EMU_CTX_VAR(msg_sig0),
+    EMU_CTX_VAR(msg_sig1),
+    EMU_CTX_VAR(qc_sig),
+    EMU_CTX_VAR(wait_msk),
+    EMU_CTX_VAR(batch_out),
+    EMU_CTX_VAR(dst_q),
+#if NOTIFY_EMU_VARIANT != NOTIFY_EMU_ORG
+    EMU_CTX_VAR(next_batch_out),
+#endif
+#if NOTIFY_EMU_VARIANT != NOTIFY_EMU_PACING
+    EMU_CTX_VAR(get_order_sig),
+    EMU_CTX_VAR(msg_order_sig),
+    EMU_CTX_VAR(next_ctx),
+#endif
+};
+
+static uint32_t notify_emu_jumbo_seq[2];
+
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+_Static_assert(NOTIFY_EMU_CNT_OVF_SEND_NOW == PQ_CNT_OVF_SEND_NOW &&
+               NOTIFY_EMU_CNT_OVF_SPILL == PQ_CNT_OVF_SPILL &&
+               NOTIFY_EMU_CNT_OVF_RING_FULL == PQ_CNT_OVF_RING_FULL &&
+               NOTIFY_EMU_CNT_BACKPRESSURE == PQ_CNT_BACKPRESSURE &&
+               NOTIFY_EMU_CNT_DEQ_SIG_BUSY == PQ_CNT_DEQ_SIG_BUSY &&
+               NOTIFY_EMU_CNT_SLOT_COLLISION == PQ_CNT_SLOT_COLLISION &&
+               NOTIFY_EMU_CNT_TRACE_DROP == PQ_CNT_TRACE_DROP &&
+               NOTIFY_EMU_CNT_PACED == PQ_CNT_PACED &&
+               NOTIFY_EMU_CNT_LATE == PQ_CNT_LATE &&
+               NOTIFY_EMU_CNT_HORIZON == PQ_CNT_HORIZON &&
+               NOTIFY_EMU_CNT_SQUASHED == PQ_CNT_SQUASHED &&
+               NOTIFY_EMU_CNT_SHAPED == PQ_CNT_SHAPED,
+               "NOTIFY_EMU_CNT_* out of sync with PQ_CNT_*");
+_Static_assert(NOTIFY_EMU_TRACE_LENGTH == PQ_TRACE_LENGTH,
+               "NOTIFY_EMU_TRACE_LENGTH out of sync with PQ_TRACE_LENGTH");
+_Static_assert(NOTIFY_EMU_SLOTS == PQ_CTM_LENGTH &&
+               NOTIFY_EMU_SLOT_NONE == PQ_SLOT_NONE,
+               "NOTIFY_EMU_SLOT* out of sync with notify.c");
+_Static_assert(NOTIFY_EMU_LATE_HIST_LENGTH == PQ_LATE_HIST_LENGTH,
+               "NOTIFY_EMU_LATE_HIST_LENGTH out of sync with "
+               "PQ_LATE_HIST_LENGTH");
+#endif
+
+
+void
+notify_emu_init(void)
+{
+    emu_ctx_vars_register(notify_ctx_vars,
+                          sizeof(notify_ctx_vars) / sizeof(notify_ctx_vars[0]));
+
+    /* Xfers the managers get reflected, read by copy_absolute_xfer() */
+    emu_xfer_register(NFD_IN_NOTIFY_DATA_RD, &nfd_in_data_compl_refl_in);
+    emu_xfer_register(NFD_IN_NOTIFY_JUMBO_RD, &nfd_in_jumbo_compl_refl_in);
+    emu_xfer_register(NFD_IN_NOTIFY_RESET_RD, &notify_reset_state_xfer);
+
+    /* Everything else notify accesses is in EMEM */
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING || \
+    NOTIFY_EMU_VARIANT == NOTIFY_EMU_CTM
+    emu_mem_region_register(ctm_pacing_queue, sizeof(ctm_pacing_queue),
+                            EMU_MEM_CTM);
+#endif
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+    emu_mem_region_register(emem_flow_table, sizeof(emem_flow_table),
+                            EMU_MEM_EMEM);
+#endif
+}
+
+const char *
+notify_emu_variant(void)
+{
+    static const char *const names[] = {
+        [NOTIFY_EMU_PACING] = "pacing",
+        [NOTIFY_EMU_ORG] = "org",
+        [NOTIFY_EMU_LESS_CS] = "less-cs",
+        [NOTIFY_EMU_CTM] = "ctm",
+    };
+
+    return names[NOTIFY_EMU_VARIANT];
+}
+
+static void
+notify_emu_main(void)
+{
+    notify_main();
+}
+
+void
+notify_emu_run(emu_step_fn step, void *arg)
+{
+    emu_run(notify_emu_main, step, arg);
+}
+
+int
+notify_emu_ready(void)
+{
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+    /* Manager 0 sets up shared state first, and raises qc_sig when done.
+     * It never uses qc_sig after that, so it stays raised. */
+    return *(SIGNAL *)emu_ctx_ptr(NFD_IN_NOTIFY_MANAGER0, (void *)&qc_sig);
+#else
+    unsigned int ctx;
+
+    /* Setup does not swap, so it is done once every context ran */
+    for (ctx = 0; ctx < EMU_NUM_CTX; ctx++) {
+        if (!emu_stats.ctx[ctx].runs)
+            return 0;
+    }
+    return 1;
+#endif
+}
+
+void
+notify_emu_issue(unsigned int side, const struct nfd_in_issued_desc *batch)
+{
+    unsigned int mgr = side ? NFD_IN_NOTIFY_MANAGER1 : NFD_IN_NOTIFY_MANAGER0;
+    unsigned int *compl;
+
+    emu_ring_put(side ? NFD_IN_ISSUED_RING1_NUM : NFD_IN_ISSUED_RING0_NUM,
+                 batch, NFD_IN_MAX_BATCH_SZ * sizeof(*batch));
+
+    compl = emu_ctx_ptr(mgr, (void *)&nfd_in_data_compl_refl_in);
+    *compl += NFD_IN_MAX_BATCH_SZ;
+}
+
+void
+notify_emu_issue_lso(unsigned int side, struct nfd_in_lso_desc *segs,
+                     unsigned int num_segs)
+{
+    unsigned int mgr = side ? NFD_IN_NOTIFY_MANAGER1 : NFD_IN_NOTIFY_MANAGER0;
+    unsigned int *jumbo_compl;
+    unsigned int i;
+
+    /* Jumbo DMAs complete right away */
+    notify_emu_jumbo_seq[side]++;
+    for (i = 0; i < num_segs; i++) {
+        segs[i].jumbo_seq = notify_emu_jumbo_seq[side];
+        emu_ring_put(side ? NFD_IN_ISSUED_LSO_RING1_NUM :
+                            NFD_IN_ISSUED_LSO_RING0_NUM,
+                     &segs[i], sizeof(segs[i]));
+    }
+
+    jumbo_compl = emu_ctx_ptr(mgr, (void *)&nfd_in_jumbo_compl_refl_in);
+    *jumbo_compl = notify_emu_jumbo_seq[side];
+}
+
+uint32_t
+notify_emu_served(unsigned int side)
+{
+    return side ? data_dma_seq_served1 : data_dma_seq_served0;
+}
+
+uint32_t
+notify_emu_occupancy(void)
+{
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+    return pq_occupancy;
+#elif NOTIFY_EMU_VARIANT == NOTIFY_EMU_CTM
+    return pq_ctm_len;
+#else
+    return 0;
+#endif
+}
+
+uint32_t
+notify_emu_counter(unsigned int cnt)
+{
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+    return pq_counters[cnt];
+#else
+    return 0;
+#endif
+}
+
+uint32_t
+notify_emu_late_hist(unsigned int bucket)
+{
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+    return pq_late_hist[bucket];
+#else
+    return 0;
+#endif
+}
+
+void
+notify_emu_config_begin(uint32_t tresh_future_slots, uint32_t occupancy_high,
+                        uint32_t occupancy_low, uint32_t shape_rate)
+{
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+    pq_config.gen |= 1;
+    pq_config.tresh_future_slots = tresh_future_slots;
+    pq_config.occupancy_high = occupancy_high;
+    pq_config.occupancy_low = occupancy_low;
+    pq_config.shape_rate = shape_rate;
+#else
+    (void)tresh_future_slots;
+    (void)occupancy_high;
+    (void)occupancy_low;
+    (void)shape_rate;
+#endif
+}
+
+void
+notify_emu_config_end(void)
+{
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+    pq_config.gen++;
+#endif
+}
+
+void
+notify_emu_config(uint32_t tresh_future_slots, uint32_t occupancy_high,
+                  uint32_t occupancy_low, uint32_t shape_rate)
+{
+    notify_emu_config_begin(tresh_future_slots, occupancy_high,
+                            occupancy_low, shape_rate);
+    notify_emu_config_end();
+}
+
+uint32_t
+notify_emu_config_taken(void)
+{
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+    return pq_config_gen == pq_config.gen &&
+           pq_tresh_future_slots == (pq_config.tresh_future_slots ?
+                                     pq_config.tresh_future_slots :
+                                     PQ_TRESH_FUTURE_SLOTS) &&
+           pq_shape_rate == pq_config.shape_rate;
+#else
+    return 0;
+#endif
+}
+
+void
+notify_emu_config_poll_now(void)
+{
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+    pq_config_polled = (uint32_t)me_tsc_read() - PQ_CONFIG_POLL_TICKS;
+#endif
+}
+
+uint32_t
+notify_emu_cw_cascading(void)
+{
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+    /* pq_cw_enqueue() takes the lock too, but the head slot is only due
+       for pq_cw_cascade(), which clears its count once all of it is in */
+    return pq_cw_lock && emem_pacing_wheel_cnt[pq_cw_head] != 0 &&
+           pq_cw_head_time + PQ_CW_SLOT_TICKS <= pq_head_time +
+           ((uint64_t)pq_tresh_future_slots << PQ_TICKS_TO_SLOT_SHIFT);
+#else
+    return 0;
+#endif
+}
+
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+void
+notify_emu_slots_clear(void)
+{
+    memset(bitmasks, 0, sizeof(bitmasks));
+    memset(full_bitmasks, 0, sizeof(full_bitmasks));
+    pq_occupancy = 0;
+    pq_ctm_head = 0;
+}
+
+void
+notify_emu_slot_mark(uint32_t slot)
+{
+    pq_mark_slot(slot);
+}
+
+uint32_t
+notify_emu_slot_find(uint32_t desired)
+{
+    return pq_find_next_available_slot(desired);
+}
+
+const uint32_t *
+notify_emu_slot_bitmasks(void)
+{
+    return bitmasks;
+}
+#endif
+
+uint64_t
+notify_emu_flow_table_cmds(void)
+{
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+    return emu_mem_region_cmds(emem_flow_table);
+#else
+    return 0;
+#endif
+}
+
+int64_t
+notify_emu_head_lag(void)
+{
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING
+    return (int64_t)((emu_cycles >> EMU_TSC_SHIFT) - pq_head_time);
+#else
+    return 0;
+#endif
+}
+
+int
+notify_emu_trace_read(void *arg, size_t off, void *buf, size_t len)
+{
+    (void)arg;
+
+#if NOTIFY_EMU_VARIANT == NOTIFY_EMU_PACING && PQ_TRACE
+    if (off + len > sizeof(pq_trace))
+        return -1;
+    memcpy(buf, (char *)pq_trace + off, len);
+    return 0;
+#else
+    (void)off;
+    (void)buf;
+    (void)len;
+    return -1;
+#endif
+}
@@ -0,0 +1,153 @@
+/*
+ * @file          modified-nfd-firmware/emu/notify_emu.h
+ * @brief         Host side of the emulated notify ME (issue DMA and app)
+ */
+#ifndef _NOTIFY_EMU_H_
+#define _NOTIFY_EMU_H_
+
+#include "nfp_emu.h"
+
+/* notify source the emulation is built from (-DNOTIFY_EMU_VARIANT=) */
+#define NOTIFY_EMU_PACING               0   /* notify.c */
+#define NOTIFY_EMU_ORG                  1   /* misc/notify-org.c, NFD */
+#define NOTIFY_EMU_LESS_CS              2   /* misc/notify-less-cs.c */
+#define NOTIFY_EMU_CTM                  3   /* misc/notify-ctm.c, FIFO */
+
+#ifndef NOTIFY_EMU_VARIANT
+#define NOTIFY_EMU_VARIANT              NOTIFY_EMU_PACING
+#endif
+
+/* Pacing metadata types, as placed in front of packet by the driver */
+#define NOTIFY_EMU_META_PACING          14
+#define NOTIFY_EMU_META_PACING_EDT      15
+#define NOTIFY_EMU_META_PACING_RATE     0x80000000
+
+/* IDT word of pacing metadata, as the driver encodes it: mantissa (low 28
+   bits) << exponent (high 4 bits) in 1/256 ns (PQ_IDT_* in notify.c) */
+#define NOTIFY_EMU_IDT_FRAC             8
+#define NOTIFY_EMU_IDT_MANT_BITS        28
+
+static inline uint32_t
+notify_emu_idt_word(uint32_t idt_ns)
+{
+    uint64_t idt = (uint64_t)idt_ns << NOTIFY_EMU_IDT_FRAC;
+    uint32_t exp = 0;
+
+    while (idt >> NOTIFY_EMU_IDT_MANT_BITS) {
+        idt >>= 1;
+        exp++;
+    }
+    return exp << NOTIFY_EMU_IDT_MANT_BITS | (uint32_t)idt;
+}
+
+/* Pacing counters (PQ_CNT_* in notify.c) */
+#define NOTIFY_EMU_CNT_OVF_SEND_NOW     0
+#define NOTIFY_EMU_CNT_OVF_SPILL        1
+#define NOTIFY_EMU_CNT_OVF_RING_FULL    2
+#define NOTIFY_EMU_CNT_BACKPRESSURE     3
+#define NOTIFY_EMU_CNT_DEQ_SIG_BUSY     4
+#define NOTIFY_EMU_CNT_SLOT_COLLISION   5
+#define NOTIFY_EMU_CNT_TRACE_DROP       6
+#define NOTIFY_EMU_CNT_PACED            7
+#define NOTIFY_EMU_CNT_LATE             8
+#define NOTIFY_EMU_CNT_HORIZON          9
+#define NOTIFY_EMU_CNT_SQUASHED         10
+#define NOTIFY_EMU_CNT_SHAPED           11
+
+/* Buckets of the lateness histogram (PQ_LATE_HIST_LENGTH in notify.c),
+   bucket b counts dequeues [2^(b-1), 2^b) ticks behind their slot */
+#define NOTIFY_EMU_LATE_HIST_LENGTH     16
+
+/* Records in the trace ring (PQ_TRACE_LENGTH in notify.c) */
+#define NOTIFY_EMU_TRACE_LENGTH         65536
+
+/* ns per ME timestamp tick (16 cycles of 800 MHz ME clock) */
+#define NOTIFY_EMU_TICK_NS              20.0
+
+/* Register per context variables of notify.c, must be called before run */
+void notify_emu_init(void);
+
+/* Name of the variant built */
+const char *notify_emu_variant(void);
+
+/* Run notify.c main() on the 8 contexts until step returns 0 */
+void notify_emu_run(emu_step_fn step, void *arg);
+
+/* Setup of all contexts is done, and notify can take packets */
+int notify_emu_ready(void);
+
+/*
+ * Hand a batch of issued descriptors to notify, as issue DMA does once
+ * the gather DMAs completed. Batches are always NFD_IN_MAX_BATCH_SZ
+ * messages, num_batch of pkt 0 tells how many are packets.
+ */
+void notify_emu_issue(unsigned int side,
+                      const struct nfd_in_issued_desc *batch);
+
+/* Put LSO segments on the issued LSO ring, before issuing their batch */
+void notify_emu_issue_lso(unsigned int side, struct nfd_in_lso_desc *segs,
+                          unsigned int num_segs);
+
+/* Batches notify has taken from the issued ring */
+uint32_t notify_emu_served(unsigned int side);
+
+/* Packets in the pacing queue (CTM/LM), 0 for variants without one */
+uint32_t notify_emu_occupancy(void);
+
+/* Value of pacing counter (NOTIFY_EMU_CNT_*), 0 for other variants */
+uint32_t notify_emu_counter(unsigned int cnt);
+
+/* Count of lateness histogram bucket, as the host reads it (flushed from
+   LM in batches), 0 for other variants */
+uint32_t notify_emu_late_hist(unsigned int bucket);
+
+/* Write runtime configuration (pq_config, 0 = default, shaper rate in ns
+   per byte << 16, 0 = off) like the driver does over CPP: gen made odd,
+   the values, gen incremented to even */
+void notify_emu_config(uint32_t tresh_future_slots, uint32_t occupancy_high,
+                       uint32_t occupancy_low, uint32_t shape_rate);
+
+/* First half of notify_emu_config(), leaving gen odd as a host that is
+   still writing, and the second half */
+void notify_emu_config_begin(uint32_t tresh_future_slots,
+                             uint32_t occupancy_high,
+                             uint32_t occupancy_low, uint32_t shape_rate);
+void notify_emu_config_end(void);
+
+/* 1 if notify took the last configuration written (and the threshold and
+   shaper rate of it), 0 before that or for other variants */
+uint32_t notify_emu_config_taken(void);
+
+/* Make the next pq_config_poll() read the configuration, without waiting
+   for PQ_CONFIG_POLL_TICKS to pass */
+void notify_emu_config_poll_now(void);
+
+/* 1 while a coarse slot with packets in it is cascaded into the pacing
+   queue, 0 otherwise and for other variants */
+uint32_t notify_emu_cw_cascading(void);
+
+/* EMEM commands to the flow table, two per miss of its LM cache (write
+   back and fill) once every line holds a flow, 0 for other variants */
+uint64_t notify_emu_flow_table_cmds(void);
+
+/* Ticks the head of the pacing queue is behind the timestamp */
+int64_t notify_emu_head_lag(void);
+
+/* Slots of the pacing queue (PQ_CTM_LENGTH), for driving its slot search
+   without running notify: empty all slots, occupy one, find the first free
+   slot from a desired one (PQ_SLOT_NONE = NOTIFY_EMU_SLOT_NONE if there is
+   none before head, which is at slot 0), and the occupancy bitmask words
+   (NOTIFY_EMU_SLOTS / 32). Pacing variant only */
+#define NOTIFY_EMU_SLOTS                4096
+#define NOTIFY_EMU_SLOT_NONE            0xFFFFFFFF
+
+void notify_emu_slots_clear(void);
+void notify_emu_slot_mark(uint32_t slot);
+uint32_t notify_emu_slot_find(uint32_t desired);
+const uint32_t *notify_emu_slot_bitmasks(void);
+
+/* Read len bytes at off of the trace ring, like the host reads it over
+   PCIe (pq_trace_read_fn of trace/pq_trace.h), -1 if there is none */
+int notify_emu_trace_read(void *arg, size_t off, void *buf, size_t len);
+
+#endif /* !_NOTIFY_EMU_H_ */
@@ -0,0 +1,743 @@
+/*
+ * @file          modified-nfd-firmware/emu/pacing_sim.c
+ * @brief         Size the notify ME with synthetic traffic and the emulated
+ *                cycle costs
+ *
+ * Paced flows of one rate (a share of them sending TSO packets), and
+ * optionally unpaced packets, are issued to notify for a while. Reported:
+ *  - departure lateness of paced packets: when notify sent the packet to
+ *    the work queue minus its ideal time, one IDT after the ideal time of
+ *    the previous packet of the flow, or when notify took the packet
+ *  - slot collisions: paced packets placed after their desired slot
+ *  - how far the head of the pacing queue fell behind the timestamp
+ *  - ME utilization of each context role (busy, and busy issuing commands)
+ *
+ * usage: pacing_sim [-f flows] [-r gbps] [-l bytes] [-t tso_pct] [-g segs]
+ *                   [-u unpaced_pct] [-d us] [-w pkts] [-s gbps]
+ *                   [-T gbps] [-C cost=cycles]... [-S]
+ *
+ * -S sweeps the number of flows, doubling from -f up to 4095, marking the
+ * steps where the ME can no longer keep up. Reported per step are also ME
+ * cycles per packet (of runs that issued commands) and EMEM commands to the
+ * flow table per paced packet: firmware caches flow state in 16 LM lines,
+ * and with more flows than that a packet usually misses, writing back the
+ * line it evicts and reading its own. Costs are ctx_arb, alu_slice, alu, csr, cmd and the
+ * latencies emem, ctm, ring, workq and qc (see struct emu_cost).
+ *
+ * -w keeps the flows backlogged instead: their packets are issued as soon
+ * as fewer than that many are in notify, so only pacing sets their rate.
+ * Also reported then is how far the rate each flow got is from its IDT.
+ *
+ * -s turns on the port shaper of notify at that rate, for all packets.
+ *
+ * -T sets the rate of all flows together instead of -r, split evenly, so a
+ * sweep keeps the load and only changes the number of flows.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "notify_emu.h"
+
+#define MAX_PKTS                (256 * 1024)
+/* Flow IDs firmware keeps state for (PQ_FLOW_TABLE_LENGTH - 1, as ID 4096
+   would take the tag of an empty flow cache line) */
+#define MAX_FLOWS               4095
+#define MAX_SEGS                64
+#define SLOT_TICKS              32      /* PQ_SLOT_TICKS in notify.c */
+#define DRAIN_TICKS             (1000 * 1000 / 20)
+
+/* ME keeps up while p99 lateness and head lag stay within this */
+#define SATURATED_TICKS         (8 * SLOT_TICKS)
+
+#define NS_TO_TICKS(_ns)        ((uint64_t)((_ns) / NOTIFY_EMU_TICK_NS))
+#define TICKS_TO_US(_t)         ((double)(_t) * NOTIFY_EMU_TICK_NS / 1000.0)
+
+struct sim_cfg {
+    unsigned int flows;
+    double gbps;
+    unsigned int pkt_len;
+    unsigned int tso_pct;
+    unsigned int segs;
+    unsigned int unpaced_pct;
+    unsigned int duration_us;
+    unsigned int window;        /* backlogged flows, pkts in notify */
+    double shape_gbps;          /* port shaper, 0 = off */
+    double total_gbps;          /* of all flows, sets gbps (0 = -r) */
+};
+
+struct pkt {
+    uint32_t flow;              /* 0 = not paced */
+    uint32_t idt_ns;
+    uint64_t notify_time;
+    uint64_t out_time;
+    uint32_t out_cnt;
+};
+
+struct batch {
+    uint64_t time;
+    unsigned int side;
+    unsigned int q_num;
+    unsigned int first;
+    unsigned int num;
+    unsigned int lso;
+};
+
+static struct sim_cfg cfg = {
+    .flows = 16,
+    .gbps = 1.0,
+    .pkt_len = 1514,
+    .tso_pct = 0,
+    .segs = 44,
+    .unpaced_pct = 0,
+    .duration_us = 2000,
+};
+
+static struct pkt *pkts;
+static unsigned int num_pkts;
+static unsigned int num_out;
+static unsigned char *bufs;
+
+static struct batch *batches;
+static unsigned int num_batches;
+static unsigned int next_batch;
+
+static unsigned int num_issued;
+static unsigned int *side_batches[2];
+static unsigned int side_issued[2];
+static unsigned int side_noted[2];
+
+static uint64_t start_time;
+static int started;
+static uint64_t end_time;
+static int64_t max_head_lag;
+
+/* Counters when notify got ready, utilization is from then on */
+static struct emu_stats stats0;
+static uint64_t cycles0;
+static uint64_t flow_cmds0;
+
+static uint32_t rand_state = 1;
+
+
+static uint32_t
+sim_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+static unsigned int
+add_pkt(uint32_t flow, uint32_t idt_ns)
+{
+    struct pkt *p = &pkts[num_pkts];
+
+    if (num_pkts == MAX_PKTS) {
+        fprintf(stderr, "more than %u packets, shorten -d\n", MAX_PKTS);
+        exit(2);
+    }
+    p->flow = flow;
+    p->idt_ns = idt_ns;
+    return num_pkts++;
+}
+
+static void
+add_batch(uint64_t time, unsigned int side, unsigned int q_num,
+          unsigned int first, unsigned int num, unsigned int lso)
+{
+    struct batch *b = &batches[num_batches++];
+
+    b->time = time;
+    b->side = side;
+    b->q_num = q_num;
+    b->first = first;
+    b->num = num;
+    b->lso = lso;
+}
+
+static int
+batch_cmp(const void *a, const void *b)
+{
+    const struct batch *x = a, *y = b;
+
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return x->first < y->first ? -1 : 1;
+}
+
+/*
+ * Each flow sends at its rate from a random phase: batches of 8 packets,
+ * or one TSO packet per batch. Unpaced packets come in batches of 8, at
+ * the share of all packets asked for.
+ */
+static void
+build(void)
+{
+    uint64_t duration = NS_TO_TICKS(cfg.duration_us * 1000.0);
+    uint64_t t, gap;
+    unsigned int flow, i, first, n, lso, num_paced;
+    uint32_t idt_ns;
+
+    if (cfg.total_gbps > 0)
+        cfg.gbps = cfg.total_gbps / cfg.flows;
+    idt_ns = (uint32_t)(cfg.pkt_len * 8 / cfg.gbps);
+
+    for (flow = 1; flow <= cfg.flows; flow++) {
+        lso = (flow - 1) * 100 < cfg.tso_pct * cfg.flows;
+        n = lso ? cfg.segs : NFD_IN_MAX_BATCH_SZ;
+        gap = NS_TO_TICKS((double)n * idt_ns);
+
+        for (t = sim_rand() % gap; t < duration; t += gap) {
+            first = num_pkts;
+            for (i = 0; i < n; i++)
+                add_pkt(flow, idt_ns);
+            add_batch(t, flow & 1, flow & 0x3f, first, n, lso);
+        }
+    }
+
+    num_paced = num_pkts;
+    if (cfg.unpaced_pct && num_paced) {
+        n = (uint64_t)num_paced * cfg.unpaced_pct / (100 - cfg.unpaced_pct);
+        n = (n + NFD_IN_MAX_BATCH_SZ - 1) / NFD_IN_MAX_BATCH_SZ;
+        gap = duration / n;
+        for (i = 0; i < n; i++) {
+            first = num_pkts;
+            for (flow = 0; flow < NFD_IN_MAX_BATCH_SZ; flow++)
+                add_pkt(0, 0);
+            add_batch(i * gap, i & 1, 0, first, NFD_IN_MAX_BATCH_SZ, 0);
+        }
+    }
+
+    qsort(batches, num_batches, sizeof(*batches), batch_cmp);
+}
+
+static void
+fill_desc(struct nfd_in_issued_desc *desc, unsigned int i)
+{
+    struct pkt *p = &pkts[i];
+    uint32_t *meta;
+    unsigned int meta_len = p->flow ? 4 + 8 : 0;
+
+    memset(desc, 0, sizeof(*desc));
+    desc->eop = 1;
+    desc->offset = meta_len;
+    desc->buf_addr = emu_buf_addr(bufs + (size_t)i * 2048);
+    desc->data_len = meta_len + cfg.pkt_len;
+
+    if (meta_len) {
+        meta = (uint32_t *)(bufs + (size_t)i * 2048 +
+                            NFD_IN_DATA_OFFSET - meta_len);
+        meta[0] = NOTIFY_EMU_META_PACING;
+        meta[1] = p->flow;
+        meta[2] = notify_emu_idt_word(p->idt_ns);
+    }
+}
+
+static void
+issue_batch(struct batch *b)
+{
+    struct nfd_in_issued_desc descs[NFD_IN_MAX_BATCH_SZ];
+    struct nfd_in_lso_desc segs[MAX_SEGS];
+    unsigned int i;
+
+    memset(descs, 0, sizeof(descs));
+    if (b->lso) {
+        for (i = 0; i < b->num; i++) {
+            fill_desc(&segs[i].desc, b->first + i);
+            segs[i].desc.lso = (i == b->num - 1) ?
+                NFD_IN_ISSUED_DESC_LSO_RET : NFD_IN_ISSUED_DESC_LSO_NO_RET;
+        }
+        notify_emu_issue_lso(b->side, segs, b->num);
+
+        descs[0].eop = 0;
+        descs[0].lso = NFD_IN_ISSUED_DESC_LSO_NO_RET;
+        descs[0].num_batch = 1;
+    } else {
+        for (i = 0; i < b->num; i++)
+            fill_desc(&descs[i], b->first + i);
+        descs[0].num_batch = b->num;
+    }
+    descs[0].q_num = b->q_num;
+
+    notify_emu_issue(b->side, descs);
+}
+
+static void
+workq_msg(void *arg, unsigned int rnum, const void *data, size_t size)
+{
+    const struct nfd_in_pkt_desc *desc = data;
+    unsigned int i;
+
+    (void)arg;
+    (void)rnum;
+    (void)size;
+
+    i = desc->buf_addr - emu_buf_addr(bufs);
+    if (i >= num_pkts)
+        return;
+
+    pkts[i].out_time = emu_cycles >> EMU_TSC_SHIFT;
+    pkts[i].out_cnt++;
+    num_out++;
+}
+
+static int
+step(void *arg)
+{
+    uint64_t now = emu_cycles >> EMU_TSC_SHIFT;
+    unsigned int side, i, served;
+    int64_t lag;
+    struct batch *b;
+
+    (void)arg;
+
+    if (!started) {
+        if (!notify_emu_ready())
+            return 1;
+        start_time = now;
+        started = 1;
+        stats0 = emu_stats;
+        cycles0 = emu_cycles;
+        flow_cmds0 = notify_emu_flow_table_cmds();
+    }
+
+    lag = notify_emu_head_lag();
+    if (lag > max_head_lag)
+        max_head_lag = lag;
+
+    for (side = 0; side < 2; side++) {
+        served = notify_emu_served(side) / NFD_IN_MAX_BATCH_SZ;
+        while (side_noted[side] < side_issued[side] &&
+               side_noted[side] < served) {
+            b = &batches[side_batches[side][side_noted[side]++]];
+            for (i = 0; i < b->num; i++)
+                pkts[b->first + i].notify_time = now;
+        }
+    }
+
+    /* Keep at most 4 batches per side in flight, like issue DMA */
+    while (next_batch < num_batches &&
+           (cfg.window ? num_issued - num_out < cfg.window :
+                         start_time + batches[next_batch].time <= now)) {
+        b = &batches[next_batch];
+        side = b->side;
+        served = notify_emu_served(side) / NFD_IN_MAX_BATCH_SZ;
+        if (side_issued[side] - served >= 4)
+            break;
+
+        issue_batch(b);
+        num_issued += b->num;
+        side_batches[side][side_issued[side]++] = next_batch++;
+    }
+
+    end_time = now;
+    if (num_out >= num_pkts && next_batch == num_batches)
+        return 0;
+    return now < start_time + NS_TO_TICKS(cfg.duration_us * 1000.0) +
+                 DRAIN_TICKS;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Report                                                                    */
+/* ------------------------------------------------------------------------- */
+
+static int
+late_cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int64_t
+percentile(const int64_t *late, unsigned int n, double pct)
+{
+    unsigned int i = (unsigned int)(n * pct / 100.0);
+
+    if (n == 0)
+        return 0;
+    return late[i < n ? i : n - 1];
+}
+
+/* Lateness of delivered paced packets, sorted, returns how many */
+static unsigned int
+lateness(int64_t *late)
+{
+    static double ideal_prev[MAX_FLOWS + 1];
+    double ideal;
+    unsigned int i, n = 0;
+    struct pkt *p;
+
+    for (i = 0; i < num_pkts; i++) {
+        p = &pkts[i];
+        if (!p->flow || p->out_cnt != 1)
+            continue;
+
+        ideal = ideal_prev[p->flow] + p->idt_ns / NOTIFY_EMU_TICK_NS;
+        if (!ideal_prev[p->flow] || ideal < p->notify_time)
+            ideal = p->notify_time;
+        ideal_prev[p->flow] = ideal;
+        late[n++] = (int64_t)(p->out_time - ideal);
+    }
+    qsort(late, n, sizeof(*late), late_cmp);
+    return n;
+}
+
+/* Latency from notify to the work queue of delivered unpaced packets,
+ * sorted, returns how many */
+static unsigned int
+latency_unpaced(int64_t *lat)
+{
+    unsigned int i, n = 0;
+    struct pkt *p;
+
+    for (i = 0; i < num_pkts; i++) {
+        p = &pkts[i];
+        if (!p->flow && p->out_cnt == 1)
+            lat[n++] = (int64_t)(p->out_time - p->notify_time);
+    }
+    qsort(lat, n, sizeof(*lat), late_cmp);
+    return n;
+}
+
+/* Rate of each backlogged flow against its IDT, from its first to its last
+ * departure */
+static void
+report_rate(void)
+{
+    static uint64_t first[MAX_FLOWS + 1], last[MAX_FLOWS + 1];
+    static unsigned int n[MAX_FLOWS + 1], idt_ns[MAX_FLOWS + 1];
+    double ideal, err, max_err = 0, drift = 0;
+    unsigned int i, flow, max_flow = 0;
+    struct pkt *p;
+
+    for (i = 0; i < num_pkts; i++) {
+        p = &pkts[i];
+        if (!p->flow || p->out_cnt != 1)
+            continue;
+        if (!n[p->flow]++)
+            first[p->flow] = p->out_time;
+        idt_ns[p->flow] = p->idt_ns;
+        last[p->flow] = p->out_time;
+    }
+
+    for (flow = 1; flow <= cfg.flows; flow++) {
+        if (n[flow] < 2)
+            continue;
+        ideal = (double)(n[flow] - 1) * idt_ns[flow] / NOTIFY_EMU_TICK_NS;
+        err = ideal / (last[flow] - first[flow]) - 1;
+        if (fabs(err) >= fabs(max_err)) {
+            max_err = err;
+            max_flow = flow;
+            drift = (last[flow] - first[flow]) - ideal;
+        }
+    }
+    printf("  rate against IDT: max error %+.4f %% (flow %u, %u pkts, "
+           "%+.2f us over %.3f s)\n", 100 * max_err, max_flow, n[max_flow],
+           TICKS_TO_US(drift),
+           TICKS_TO_US(last[max_flow] - first[max_flow]) / 1e6);
+}
+
+static double
+util(uint64_t cycles, uint64_t elapsed)
+{
+    return elapsed ? 100.0 * cycles / elapsed : 0;
+}
+
+static const struct {
+    const char *name;
+    unsigned int first, last;
+} roles[] = {
+    { "manager", 0, 1 },
+    { "notify", 2, 3 },
+    { "dequeue", 4, 7 },
+};
+
+#define NUM_ROLES (sizeof(roles) / sizeof(roles[0]))
+
+static void
+report_util(uint64_t elapsed, int print, double *busy, double *work)
+{
+    uint64_t b, w;
+    unsigned int r, ctx;
+
+    *busy = *work = 0;
+    for (r = 0; r < NUM_ROLES; r++) {
+        b = w = 0;
+        for (ctx = roles[r].first; ctx <= roles[r].last; ctx++) {
+            b += emu_stats.ctx[ctx].busy_cycles -
+                 stats0.ctx[ctx].busy_cycles;
+            w += emu_stats.ctx[ctx].work_cycles -
+                 stats0.ctx[ctx].work_cycles;
+        }
+        if (print)
+            printf("    %-8s ctx %u-%u: busy %5.1f %%, issuing commands "
+                   "%5.1f %%\n", roles[r].name, roles[r].first,
+                   roles[r].last, util(b, elapsed), util(w, elapsed));
+        *busy += util(b, elapsed);
+        *work += util(w, elapsed);
+    }
+}
+
+static const struct {
+    const char *name;
+    int64_t below;              /* in slots */
+} hist_buckets[] = {
+    { "< 0", 0 }, { "0-1", 1 }, { "1-2", 2 }, { "2-4", 4 }, { "4-8", 8 },
+    { "8-16", 16 }, { "16-64", 64 }, { ">= 64", INT64_MAX },
+};
+
+#define NUM_BUCKETS (sizeof(hist_buckets) / sizeof(hist_buckets[0]))
+
+/* Run the configured traffic, returns 1 if the ME kept up */
+static int
+run(int table)
+{
+    static int64_t late[MAX_PKTS], late_unpaced[MAX_PKTS];
+    unsigned int n, n_unpaced, b, i, paced, hist[NUM_BUCKETS] = { 0 };
+    uint64_t elapsed, paced_in = 0;
+    double busy, work, mpps, gbps, coll, work_cyc, flow_cmds;
+    int64_t p99;
+    int ok;
+
+    pkts = calloc(MAX_PKTS, sizeof(*pkts));
+    batches = calloc(MAX_PKTS, sizeof(*batches));
+    side_batches[0] = calloc(MAX_PKTS, sizeof(unsigned int));
+    side_batches[1] = calloc(MAX_PKTS, sizeof(unsigned int));
+    bufs = emu_buf_alloc(MAX_PKTS);
+    build();
+
+    notify_emu_init();
+    if (cfg.shape_gbps > 0)
+        notify_emu_config(0, 0, 0, (uint32_t)(8 / cfg.shape_gbps * 65536));
+    emu_set_workq_fn(workq_msg, NULL);
+    notify_emu_run(step, NULL);
+
+    for (i = 0; i < num_pkts; i++)
+        paced_in += pkts[i].flow != 0;
+    n = lateness(late);
+    p99 = percentile(late, n, 99);
+    paced = (unsigned int)paced_in;
+
+    elapsed = emu_cycles - cycles0;
+    mpps = num_pkts / (double)cfg.duration_us;
+    gbps = mpps * cfg.pkt_len * 8 / 1000.0;
+    coll = paced ? 100.0 *
+           notify_emu_counter(NOTIFY_EMU_CNT_SLOT_COLLISION) / paced : 0;
+
+    work_cyc = 0;
+    for (i = 0; i < EMU_NUM_CTX; i++)
+        work_cyc += emu_stats.ctx[i].work_cycles - stats0.ctx[i].work_cycles;
+    work_cyc = num_out ? work_cyc / num_out : 0;
+    flow_cmds = paced ? (double)(notify_emu_flow_table_cmds() - flow_cmds0) /
+                        paced : 0;
+
+    /* Backlogged flows never catch up with notify, so their lateness adds
+       up any error of their rate */
+    ok = num_out == num_pkts && max_head_lag <= SATURATED_TICKS &&
+         (cfg.window || p99 <= SATURATED_TICKS);
+
+    if (table) {
+        report_util(elapsed, 0, &busy, &work);
+        printf("%6u %7.2f %7.1f %8u %8.2f %8.2f %8.2f %6.2f %8.2f "
+               "%5.1f %5.1f %7.1f %6.2f  %s\n",
+               cfg.flows, mpps, gbps, num_pkts - num_out,
+               TICKS_TO_US(percentile(late, n, 50)), TICKS_TO_US(p99),
+               TICKS_TO_US(n ? late[n - 1] : 0), coll,
+               TICKS_TO_US(max_head_lag), busy, work, work_cyc, flow_cmds,
+               ok ? "ok" : "behind");
+        return ok;
+    }
+
+    printf("%u flows at %.2f Gbps (%u%% TSO of %u segs, %u%% unpaced), "
+           "%u B packets, %u us\n",
+           cfg.flows, cfg.gbps, cfg.tso_pct, cfg.segs, cfg.unpaced_pct,
+           cfg.pkt_len, cfg.duration_us);
+    if (cfg.window)
+        printf("  backlogged, %u pkts in notify\n", cfg.window);
+    printf("  offered: %u pkts, %.2f Mpps, %.1f Gbps\n",
+           num_pkts, mpps, gbps);
+    printf("  sent: %u pkts, %u not sent in %.1f us\n", num_out,
+           num_pkts - num_out, TICKS_TO_US(end_time - start_time));
+
+    printf("  lateness of %u paced pkts (us): min %.2f p50 %.2f p90 %.2f "
+           "p99 %.2f p99.9 %.2f max %.2f\n", n,
+           TICKS_TO_US(n ? late[0] : 0),
+           TICKS_TO_US(percentile(late, n, 50)),
+           TICKS_TO_US(percentile(late, n, 90)), TICKS_TO_US(p99),
+           TICKS_TO_US(percentile(late, n, 99.9)),
+           TICKS_TO_US(n ? late[n - 1] : 0));
+    n_unpaced = latency_unpaced(late_unpaced);
+    if (n_unpaced)
+        printf("  latency of %u unpaced pkts (us): p50 %.2f p99 %.2f "
+               "max %.2f\n", n_unpaced,
+               TICKS_TO_US(percentile(late_unpaced, n_unpaced, 50)),
+               TICKS_TO_US(percentile(late_unpaced, n_unpaced, 99)),
+               TICKS_TO_US(late_unpaced[n_unpaced - 1]));
+    for (i = 0; i < n; i++) {
+        for (b = 0; b < NUM_BUCKETS - 1; b++) {
+            if (late[i] < hist_buckets[b].below * SLOT_TICKS)
+                break;
+        }
+        hist[b]++;
+    }
+    printf("  lateness in slots of %.2f us:\n", TICKS_TO_US(SLOT_TICKS));
+    for (b = 0; b < NUM_BUCKETS; b++)
+        printf("    %-6s %8u  %5.1f %%\n", hist_buckets[b].name, hist[b],
+               n ? 100.0 * hist[b] / n : 0);
+
+    printf("  slot collisions: %u (%.2f %% of paced pkts), "
+           "%u spilled, %u sent early\n",
+           notify_emu_counter(NOTIFY_EMU_CNT_SLOT_COLLISION), coll,
+           notify_emu_counter(NOTIFY_EMU_CNT_OVF_SPILL),
+           notify_emu_counter(NOTIFY_EMU_CNT_OVF_SEND_NOW));
+    printf("  firmware counters: %u paced, %u late, %u at horizon, "
+           "%u squashed, %u shaped (batched ones may lag)\n",
+           notify_emu_counter(NOTIFY_EMU_CNT_PACED),
+           notify_emu_counter(NOTIFY_EMU_CNT_LATE),
+           notify_emu_counter(NOTIFY_EMU_CNT_HORIZON),
+           notify_emu_counter(NOTIFY_EMU_CNT_SQUASHED),
+           notify_emu_counter(NOTIFY_EMU_CNT_SHAPED));
+    printf("  dequeued behind slot (firmware histogram, < us):");
+    for (b = 0; b < NOTIFY_EMU_LATE_HIST_LENGTH; b++) {
+        if (notify_emu_late_hist(b))
+            printf(" %.2f: %u", b < NOTIFY_EMU_LATE_HIST_LENGTH - 1 ?
+                   TICKS_TO_US(1u << b) : INFINITY, notify_emu_late_hist(b));
+    }
+    printf("\n");
+    printf("  queue head behind timestamp: max %.2f us\n",
+           TICKS_TO_US(max_head_lag));
+    if (cfg.window)
+        report_rate();
+
+    printf("  ME utilization over %.1f us:\n", TICKS_TO_US(elapsed >>
+                                                           EMU_TSC_SHIFT));
+    report_util(elapsed, 1, &busy, &work);
+    printf("    all      ctx 0-7: idle %5.1f %%, %.1f cycles per pkt, "
+           "%.1f mem cmds per pkt\n",
+           util(emu_stats.idle_cycles - stats0.idle_cycles, elapsed),
+           num_out ? (double)elapsed / num_out : 0,
+           num_out ? (double)(emu_stats.mem_cmds - stats0.mem_cmds) /
+                     num_out : 0);
+    printf("    %.1f cycles per pkt issuing commands, %.2f flow table "
+           "cmds per paced pkt (flow cache misses)\n", work_cyc, flow_cmds);
+    printf("  %s\n", ok ? "ME keeps up" : "ME falls behind");
+    return ok;
+}
+
+static int
+run_child(int table)
+{
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0)
+        exit(run(table) ? 0 : 1);
+
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status))
+        fprintf(stderr, "%u flows: killed by signal %d\n", cfg.flows,
+                WTERMSIG(status));
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int
+set_cost(const char *arg)
+{
+    static const struct {
+        const char *name;
+        unsigned int *cost;
+    } costs[] = {
+        { "ctx_arb", &emu_cost.ctx_arb },
+        { "alu_slice", &emu_cost.alu_slice },
+        { "alu", &emu_cost.alu },
+        { "csr", &emu_cost.csr },
+        { "cmd", &emu_cost.cmd },
+        { "emem", &emu_cost.mem_lat[EMU_MEM_EMEM] },
+        { "ctm", &emu_cost.mem_lat[EMU_MEM_CTM] },
+        { "ring", &emu_cost.mem_lat[EMU_MEM_RING] },
+        { "workq", &emu_cost.mem_lat[EMU_MEM_WORKQ] },
+        { "qc", &emu_cost.mem_lat[EMU_MEM_QC] },
+    };
+    const char *eq = strchr(arg, '=');
+    unsigned int i;
+
+    for (i = 0; eq && i < sizeof(costs) / sizeof(costs[0]); i++) {
+        if (strlen(costs[i].name) == (size_t)(eq - arg) &&
+            !strncmp(costs[i].name, arg, eq - arg)) {
+            *costs[i].cost = atoi(eq + 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: pacing_sim [-f flows] [-r gbps] [-l bytes] [-t tso_pct] "
+            "[-g segs]\n"
+            "                  [-u unpaced_pct] [-d us] [-w pkts] "
+            "[-s gbps]\n"
+            "                  [-T gbps] [-C cost=cycles]... [-S]\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    int opt, sweep = 0;
+
+    while ((opt = getopt(argc, argv, "f:r:l:t:g:u:d:w:s:T:C:S")) != -1) {
+        switch (opt) {
+        case 'f': cfg.flows = atoi(optarg); break;
+        case 'r': cfg.gbps = atof(optarg); break;
+        case 'l': cfg.pkt_len = atoi(optarg); break;
+        case 't': cfg.tso_pct = atoi(optarg); break;
+        case 'g': cfg.segs = atoi(optarg); break;
+        case 'u': cfg.unpaced_pct = atoi(optarg); break;
+        case 'd': cfg.duration_us = atoi(optarg); break;
+        case 'w': cfg.window = atoi(optarg); break;
+        case 's': cfg.shape_gbps = atof(optarg); break;
+        case 'T': cfg.total_gbps = atof(optarg); break;
+        case 'C':
+            if (!set_cost(optarg))
+                usage();
+            break;
+        case 'S': sweep = 1; break;
+        default: usage();
+        }
+    }
+    if (cfg.flows < 1 || cfg.flows > MAX_FLOWS || cfg.gbps <= 0 ||
+        cfg.segs < 1 || cfg.segs > MAX_SEGS || cfg.unpaced_pct >= 100 ||
+        cfg.shape_gbps < 0 || cfg.total_gbps < 0 ||
+        cfg.pkt_len < 64 || cfg.pkt_len > 2048 - NFD_IN_DATA_OFFSET)
+        usage();
+
+    if (!sweep)
+        return run_child(0) ? 0 : 1;
+
+    printf("%.2f Gbps %s, %u%% TSO of %u segs, %u%% unpaced, "
+           "%u B packets, %u us\n",
+           cfg.total_gbps > 0 ? cfg.total_gbps : cfg.gbps,
+           cfg.total_gbps > 0 ? "of all flows" : "per flow", cfg.tso_pct,
+           cfg.segs, cfg.unpaced_pct, cfg.pkt_len, cfg.duration_us);
+    printf("                          late us  late us  late us  coll "
+           "  lag us  busy  work  cycles  flow\n");
+    printf(" flows    Mpps    Gbps  not sent      p50      p99      max "
+           "     %%      max     %%     %%  /pkt    cmds\n");
+    for (;;) {
+        run_child(1);
+        if (cfg.flows >= MAX_FLOWS)
+            break;
+        cfg.flows = cfg.flows * 2 < MAX_FLOWS ? cfg.flows * 2 : MAX_FLOWS;
+    }
+    return 0;
+}
@@ -0,0 +1,995 @@
+/*
+ * @file          modified-nfd-firmware/emu/pacing_test.c
+ * @brief         Run traffic through the emulated notify ME and check pacing
+ *
+ * Each scenario runs in its own process (notify.c state is global), feeds
+ * issued descriptors to notify like issue DMA does, and records what
+ * notify adds to the work queue. Checks:
+ *  - every packet leaves notify exactly once, with pacing metadata stripped
+ *  - sequence numbers of each sequencer are consecutive (no reordering)
+ *  - paced flows keep their inter departure time, EDT packets their delay
+ *  - with the port shaper on, all packets together stay within its rate
+ *  - the trace ring, drained while notify runs as pq_trace_drain does,
+ *    has a record for each paced packet (and the reader copes with the
+ *    ring wrapping past it, on a ring filled by the test)
+ *
+ * usage: pacing_test [-c slice_cycles] [scenario...]
+ *        (all scenarios if none given, -c sets emu_cost.alu_slice)
+ * Exit status is 0 only if all scenarios pass.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "notify_emu.h"
+#include "../trace/pq_trace.h"
+
+_Static_assert(PQ_TRACE_LENGTH == NOTIFY_EMU_TRACE_LENGTH,
+               "trace/pq_trace.h out of sync with notify.c");
+
+#define MAX_PKTS                4096
+#define MAX_FLOWS               8
+#define SLOT_TICKS              32      /* PQ_SLOT_TICKS in notify.c */
+#define RUN_LIMIT_TICKS         (2 * 1000 * 1000)
+#define SETTLE_TICKS            (4 * SLOT_TICKS)  /* run on once all are out */
+
+#define NS_TO_TICKS(_ns)        ((uint64_t)((_ns) / NOTIFY_EMU_TICK_NS))
+#define TICKS_TO_US(_t)         ((double)(_t) * NOTIFY_EMU_TICK_NS / 1000.0)
+
+struct pkt {
+    uint32_t flow;              /* 0 = not paced */
+    uint32_t idt_ns;
+    uint32_t edt;
+    uint32_t delay_ns;
+    uint32_t meta_len;
+    uint32_t payload_len;
+
+    uint64_t notify_time;       /* notify took its batch from the ring */
+    uint64_t out_time;
+    uint32_t out_cnt;
+    struct nfd_in_pkt_desc out;
+};
+
+struct scenario {
+    const char *name;
+    const char *desc;
+    void (*build)(void);
+    int (*check)(void);
+};
+
+static struct pkt pkts[MAX_PKTS];
+static unsigned int num_pkts;
+static unsigned int num_out;
+static unsigned char *bufs;
+
+/* Batches to issue, in order, each batch at its issue time */
+struct batch {
+    uint64_t time;
+    unsigned int side;
+    unsigned int q_num;
+    unsigned int first;
+    unsigned int num;
+    unsigned int lso;           /* one LSO packet of num segments */
+};
+
+static struct batch batches[MAX_PKTS];
+static unsigned int num_batches;
+static unsigned int next_batch;
+
+/* Batches issued to each side, and how many of them notify took */
+static unsigned int side_batches[2][MAX_PKTS];
+static unsigned int side_issued[2];
+static unsigned int side_noted[2];
+
+/* Time notify was ready, batch times are relative to it */
+static uint64_t start_time;
+static int started;
+
+/* Time all packets were out, notify runs on for SETTLE_TICKS after it to
+   flush its batched counters */
+static uint64_t done_time;
+
+static uint32_t seqn_next[NFD_IN_NUM_SEQRS];
+static unsigned int seqn_errors;
+
+/* Trace records drained while running (scenarios setting trace_on) */
+#define TRACE_POLL_TICKS        2500
+#define TRACE_MAX_RECS          (2 * MAX_PKTS)
+
+static int trace_on;
+
+/* Runtime configuration written before notify starts (scenarios setting
+   config_on), threshold in slots, shaper rate in ns per byte << 16 */
+static int config_on;
+static uint32_t config_tresh;
+static uint32_t config_shape;
+
+/* Threshold written again while a coarse slot is cascaded, once all
+   batches are issued (scenarios setting reconfig_tresh) */
+static uint32_t reconfig_tresh;
+static int reconfig_done;
+
+/* Threshold written up to gen, which is left odd for TORN_TICKS, with
+   notify polling every TORN_POLL_TICKS meanwhile (scenarios setting
+   torn_tresh). Notify must not take it before gen is even */
+#define TORN_TICKS              10000
+#define TORN_POLL_TICKS         2500
+
+static uint32_t torn_tresh;
+static int torn_done;
+static int torn_taken;
+static uint64_t torn_polled;
+static struct pq_trace_reader trace_reader;
+static struct pq_trace_rec trace_recs[TRACE_MAX_RECS];
+static unsigned int trace_num;
+static uint64_t trace_polled;
+
+static void
+trace_poll(void)
+{
+    int n;
+
+    n = pq_trace_poll(&trace_reader, trace_recs + trace_num,
+                      TRACE_MAX_RECS - trace_num);
+    if (n < 0) {
+        fprintf(stderr, "cannot read trace ring\n");
+        exit(1);
+    }
+    trace_num += n;
+}
+
+
+static unsigned int
+add_pkt(uint32_t flow, uint32_t idt_ns, uint32_t edt, uint32_t delay_ns,
+        uint32_t payload_len)
+{
+    struct pkt *p = &pkts[num_pkts];
+
+    p->flow = flow;
+    p->idt_ns = idt_ns;
+    p->edt = edt;
+    p->delay_ns = delay_ns;
+    p->payload_len = payload_len;
+    if (edt)
+        p->meta_len = 4 + 12;
+    else if (flow)
+        p->meta_len = 4 + 8;
+    return num_pkts++;
+}
+
+static void
+add_batch(uint64_t time, unsigned int side, unsigned int q_num,
+          unsigned int first, unsigned int num, unsigned int lso)
+{
+    struct batch *b = &batches[num_batches++];
+
+    b->time = time;
+    b->side = side;
+    b->q_num = q_num;
+    b->first = first;
+    b->num = num;
+    b->lso = lso;
+}
+
+/* Pacing prepend in front of packet data, as the driver writes it */
+static void
+write_meta(unsigned int i)
+{
+    struct pkt *p = &pkts[i];
+    uint32_t *meta = (uint32_t *)(bufs + (size_t)i * 2048 +
+                                  NFD_IN_DATA_OFFSET - p->meta_len);
+
+    if (!p->meta_len)
+        return;
+
+    if (p->edt) {
+        meta[0] = NOTIFY_EMU_META_PACING_EDT;
+        meta[1] = p->flow;
+        meta[2] = notify_emu_idt_word(p->idt_ns);
+        meta[3] = p->delay_ns;
+    } else {
+        meta[0] = NOTIFY_EMU_META_PACING;
+        meta[1] = p->flow;
+        meta[2] = notify_emu_idt_word(p->idt_ns);
+    }
+}
+
+static void
+fill_desc(struct nfd_in_issued_desc *desc, unsigned int i)
+{
+    struct pkt *p = &pkts[i];
+
+    memset(desc, 0, sizeof(*desc));
+    desc->eop = 1;
+    desc->offset = p->meta_len;
+    desc->buf_addr = emu_buf_addr(bufs + (size_t)i * 2048);
+    desc->data_len = p->meta_len + p->payload_len;
+    write_meta(i);
+}
+
+static void
+issue_batch(struct batch *b)
+{
+    struct nfd_in_issued_desc descs[NFD_IN_MAX_BATCH_SZ];
+    struct nfd_in_lso_desc segs[MAX_PKTS];
+    unsigned int i;
+
+    memset(descs, 0, sizeof(descs));
+    if (b->lso) {
+        for (i = 0; i < b->num; i++) {
+            fill_desc(&segs[i].desc, b->first + i);
+            segs[i].desc.lso = (i == b->num - 1) ?
+                NFD_IN_ISSUED_DESC_LSO_RET : NFD_IN_ISSUED_DESC_LSO_NO_RET;
+        }
+        notify_emu_issue_lso(b->side, segs, b->num);
+
+        descs[0].eop = 0;
+        descs[0].lso = NFD_IN_ISSUED_DESC_LSO_NO_RET;
+        descs[0].num_batch = 1;
+    } else {
+        for (i = 0; i < b->num; i++)
+            fill_desc(&descs[i], b->first + i);
+        descs[0].num_batch = b->num;
+    }
+    descs[0].q_num = b->q_num;
+
+    notify_emu_issue(b->side, descs);
+}
+
+static void
+workq_msg(void *arg, unsigned int rnum, const void *data, size_t size)
+{
+    const struct nfd_in_pkt_desc *desc = data;
+    unsigned int i, seqr;
+    struct pkt *p;
+
+    (void)arg;
+    (void)rnum;
+    (void)size;
+
+    i = desc->buf_addr - emu_buf_addr(bufs);
+    if (i >= num_pkts) {
+        fprintf(stderr, "unknown buffer 0x%x on work queue\n",
+                desc->buf_addr);
+        exit(1);
+    }
+
+    p = &pkts[i];
+    p->out = *desc;
+    p->out_time = me_tsc_read();
+    p->out_cnt++;
+    num_out++;
+
+    seqr = NFD_IN_SEQR_NUM(desc->__raw[0]);
+    if (desc->seq_num != (seqn_next[seqr] & 0xFFFF))
+        seqn_errors++;
+    seqn_next[seqr] = desc->seq_num + 1;
+}
+
+static int
+step(void *arg)
+{
+    uint64_t now = me_tsc_read();
+    unsigned int side, i, served;
+    struct batch *b;
+
+    (void)arg;
+
+    if (!started) {
+        if (!notify_emu_ready())
+            return now < RUN_LIMIT_TICKS;
+        start_time = now;
+        started = 1;
+
+        if (trace_on &&
+            pq_trace_reader_init(&trace_reader, notify_emu_trace_read,
+                                 NULL, 0)) {
+            fprintf(stderr, "cannot read trace ring\n");
+            exit(1);
+        }
+    }
+
+    if (trace_on && now - trace_polled >= TRACE_POLL_TICKS) {
+        trace_poll();
+        trace_polled = now;
+    }
+
+    /* Note when notify takes batches, it takes them in order per side */
+    for (side = 0; side < 2; side++) {
+        served = notify_emu_served(side) / NFD_IN_MAX_BATCH_SZ;
+        while (side_noted[side] < side_issued[side] &&
+               side_noted[side] < served) {
+            b = &batches[side_batches[side][side_noted[side]++]];
+            for (i = 0; i < b->num; i++)
+                pkts[b->first + i].notify_time = now;
+        }
+    }
+
+    /* Keep at most 4 batches per side in flight, like issue DMA */
+    while (next_batch < num_batches &&
+           start_time + batches[next_batch].time <= now) {
+        b = &batches[next_batch];
+        side = b->side;
+        served = notify_emu_served(side) / NFD_IN_MAX_BATCH_SZ;
+        if (side_issued[side] - served >= 4)
+            break;
+
+        issue_batch(b);
+        side_batches[side][side_issued[side]++] = next_batch++;
+    }
+
+    if (torn_tresh && !torn_done) {
+        torn_taken |= notify_emu_config_taken();
+        if (now - start_time >= TORN_TICKS) {
+            notify_emu_config_end();
+            torn_done = 1;
+        } else if (now - torn_polled >= TORN_POLL_TICKS) {
+            notify_emu_config_poll_now();
+            torn_polled = now;
+        }
+    }
+
+    if (reconfig_tresh && !reconfig_done && next_batch == num_batches &&
+        notify_emu_cw_cascading()) {
+        notify_emu_config(reconfig_tresh, 0, 0, 0);
+        notify_emu_config_poll_now();
+        config_tresh = reconfig_tresh;
+        reconfig_done = 1;
+    }
+
+    if (num_out >= num_pkts && next_batch == num_batches) {
+        if (!done_time)
+            done_time = now;
+        if (now - done_time >= SETTLE_TICKS)
+            return 0;
+    }
+    return now < start_time + RUN_LIMIT_TICKS;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Checks                                                                    */
+/* ------------------------------------------------------------------------- */
+
+static int
+check_delivery(void)
+{
+    unsigned int i, errors = 0;
+    struct pkt *p;
+
+    for (i = 0; i < num_pkts; i++) {
+        p = &pkts[i];
+        if (p->out_cnt != 1) {
+            printf("    pkt %u sent %u times\n", i, p->out_cnt);
+            errors++;
+            continue;
+        }
+        if (p->out.offset != 0 || p->out.data_len != p->payload_len) {
+            printf("    pkt %u offset %u len %u, metadata not stripped\n",
+                   i, p->out.offset, p->out.data_len);
+            errors++;
+        }
+    }
+    if (seqn_errors) {
+        printf("    %u sequence numbers out of order\n", seqn_errors);
+        errors++;
+    }
+    return errors == 0;
+}
+
+/* Departures of each paced flow are one IDT apart (within a few slots) */
+static int
+check_idt(void)
+{
+    unsigned int flow, i, n, errors = 0;
+    uint64_t prev, first;
+    int64_t late, max_late, min_gap;
+    double idt, mean_gap;
+
+    for (flow = 1; flow < MAX_FLOWS; flow++) {
+        n = 0;
+        max_late = 0;
+        min_gap = INT64_MAX;
+        prev = first = idt = 0;
+
+        for (i = 0; i < num_pkts; i++) {
+            if (pkts[i].flow != flow || pkts[i].out_cnt != 1)
+                continue;
+
+            idt = pkts[i].idt_ns / NOTIFY_EMU_TICK_NS;
+            if (n == 0) {
+                first = pkts[i].out_time;
+            } else {
+                if ((int64_t)(pkts[i].out_time - prev) < min_gap)
+                    min_gap = pkts[i].out_time - prev;
+                late = (int64_t)(pkts[i].out_time - first - n * idt);
+                if (late < 0) late = -late;
+                if (late > max_late) max_late = late;
+            }
+            prev = pkts[i].out_time;
+            n++;
+        }
+        if (n < 2)
+            continue;
+
+        mean_gap = (double)(prev - first) / (n - 1);
+        printf("    flow %u: %u pkts, idt %.2f us, mean gap %.2f us, "
+               "min gap %.2f us, max drift %.2f us\n",
+               flow, n, TICKS_TO_US(idt), TICKS_TO_US(mean_gap),
+               TICKS_TO_US(min_gap), TICKS_TO_US(max_late));
+
+        if (mean_gap < idt * 0.98 || mean_gap > idt * 1.02 ||
+            min_gap + 4 * SLOT_TICKS < (int64_t)idt ||
+            max_late > 4 * SLOT_TICKS)
+            errors++;
+    }
+    return errors == 0;
+}
+
+/* EDT packets depart after their delay, within max_late ticks (lateness
+ * is from when notify took the batch, so it includes the rest of the
+ * batch) */
+static int
+check_edt_within(int64_t max_late_ok)
+{
+    unsigned int i, n = 0, errors = 0;
+    int64_t late, min_late = INT64_MAX, max_late = INT64_MIN;
+
+    for (i = 0; i < num_pkts; i++) {
+        if (!pkts[i].edt || pkts[i].out_cnt != 1)
+            continue;
+
+        late = pkts[i].out_time -
+               (pkts[i].notify_time + NS_TO_TICKS(pkts[i].delay_ns));
+        if (late < min_late) min_late = late;
+        if (late > max_late) max_late = late;
+        n++;
+    }
+    printf("    edt: %u pkts, lateness %.2f .. %.2f us\n",
+           n, TICKS_TO_US(min_late), TICKS_TO_US(max_late));
+
+    if (min_late < -SLOT_TICKS || max_late > max_late_ok)
+        errors++;
+    return errors == 0;
+}
+
+static int
+check_edt(void)
+{
+    return check_edt_within(12 * SLOT_TICKS);
+}
+
+/* Every packet of a flow went through the pacing queue once, and the
+ * batched counters of notify.c reached pq_counters when the queue emptied,
+ * with every packet in the lateness histogram */
+static int
+check_counters(void)
+{
+    unsigned int i, n_paced = 0, n_hist = 0, late = 0;
+
+    for (i = 0; i < num_pkts; i++)
+        n_paced += pkts[i].flow != 0;
+
+    printf("    lateness histogram:");
+    for (i = 0; i < NOTIFY_EMU_LATE_HIST_LENGTH; i++) {
+        printf(" %u", notify_emu_late_hist(i));
+        n_hist += notify_emu_late_hist(i);
+        if (i >= 9)
+            late += notify_emu_late_hist(i);
+    }
+    printf("\n");
+
+    if (n_hist != n_paced ||
+        late != notify_emu_counter(NOTIFY_EMU_CNT_LATE)) {
+        printf("    expected %u in histogram, %u late\n", n_paced,
+               notify_emu_counter(NOTIFY_EMU_CNT_LATE));
+        return 0;
+    }
+
+    printf("    counters: %u paced, %u late, %u at horizon, %u squashed\n",
+           notify_emu_counter(NOTIFY_EMU_CNT_PACED),
+           notify_emu_counter(NOTIFY_EMU_CNT_LATE),
+           notify_emu_counter(NOTIFY_EMU_CNT_HORIZON),
+           notify_emu_counter(NOTIFY_EMU_CNT_SQUASHED));
+
+    if (notify_emu_counter(NOTIFY_EMU_CNT_PACED) != n_paced) {
+        printf("    expected %u paced\n", n_paced);
+        return 0;
+    }
+    return notify_emu_counter(NOTIFY_EMU_CNT_HORIZON) == 0 &&
+           notify_emu_counter(NOTIFY_EMU_CNT_SQUASHED) == 0;
+}
+
+static int
+cmp_out_time(const void *a, const void *b)
+{
+    const struct pkt *pa = *(const struct pkt * const *)a;
+    const struct pkt *pb = *(const struct pkt * const *)b;
+
+    return (pa->out_time > pb->out_time) - (pa->out_time < pb->out_time);
+}
+
+/* Packets leave at the shaper rate (config_shape) on average, and at no
+ * point more than max_ahead bytes ahead of it since the first one left */
+static int
+check_shape_within(uint32_t max_ahead)
+{
+    static struct pkt *out[MAX_PKTS];
+    unsigned int i, n = 0;
+    uint64_t bytes = 0;
+    double ns_per_byte, rate_ns_per_byte, ahead, max_seen = 0;
+
+    for (i = 0; i < num_pkts; i++)
+        if (pkts[i].out_cnt == 1)
+            out[n++] = &pkts[i];
+    if (n < 2)
+        return 0;
+    qsort(out, n, sizeof(out[0]), cmp_out_time);
+
+    rate_ns_per_byte = config_shape / 65536.0;
+    for (i = 0; i < n; i++) {
+        bytes += out[i]->payload_len;
+        ahead = bytes - (double)(out[i]->out_time - out[0]->out_time) *
+                        NOTIFY_EMU_TICK_NS / rate_ns_per_byte;
+        if (ahead > max_seen) max_seen = ahead;
+    }
+    ns_per_byte = (double)(out[n - 1]->out_time - out[0]->out_time) *
+                  NOTIFY_EMU_TICK_NS / (bytes - out[n - 1]->payload_len);
+
+    printf("    shaper: %.3f Gbps (set %.3f Gbps), up to %.0f B ahead, "
+           "%u pkts held\n", 8 / ns_per_byte, 8 / rate_ns_per_byte,
+           max_seen, notify_emu_counter(NOTIFY_EMU_CNT_SHAPED));
+
+    return ns_per_byte > rate_ns_per_byte * 0.98 &&
+           ns_per_byte < rate_ns_per_byte * 1.02 &&
+           max_seen <= max_ahead &&
+           notify_emu_counter(NOTIFY_EMU_CNT_SHAPED) > 0;
+}
+
+/* Every paced packet has one trace record, in seq order, with its flow
+ * and the time it was sent to the work queue */
+static int
+check_trace_records(void)
+{
+    unsigned int i, j, n_paced = 0, errors = 0;
+    unsigned int next_pkt[MAX_FLOWS] = { 0 };
+    struct pq_trace_rec *rec;
+    uint32_t flow;
+    struct pkt *p;
+
+    /* Records written after the last poll */
+    trace_poll();
+
+    for (i = 0; i < num_pkts; i++)
+        n_paced += pkts[i].flow != 0;
+
+    printf("    trace: %u records, %llu lost, %u dropped\n", trace_num,
+           (unsigned long long)trace_reader.lost,
+           notify_emu_counter(NOTIFY_EMU_CNT_TRACE_DROP));
+
+    if (trace_num != n_paced || trace_reader.lost ||
+        notify_emu_counter(NOTIFY_EMU_CNT_TRACE_DROP)) {
+        printf("    expected %u records\n", n_paced);
+        return 0;
+    }
+
+    for (i = 0; i < trace_num; i++) {
+        rec = &trace_recs[i];
+        flow = PQ_TRACE_FLOW(rec);
+        if (rec->seq != i + 1 || flow == 0 || flow >= MAX_FLOWS) {
+            printf("    record %u: seq %u flow %u\n", i, rec->seq, flow);
+            errors++;
+            continue;
+        }
+
+        /* Packets of a flow leave in the order they came */
+        for (j = next_pkt[flow]; j < num_pkts; j++)
+            if (pkts[j].flow == flow)
+                break;
+        if (j == num_pkts) {
+            printf("    record %u: no packet left of flow %u\n", i, flow);
+            errors++;
+            continue;
+        }
+        next_pkt[flow] = j + 1;
+        p = &pkts[j];
+
+        if ((int32_t)(rec->deq_time - rec->slot_time) < 0 ||
+            (int32_t)((uint32_t)p->out_time - rec->deq_time) < 0 ||
+            (uint32_t)p->out_time - rec->deq_time > SLOT_TICKS ||
+            PQ_TRACE_OCC(rec) == 0) {
+            printf("    record %u: slot %u deq %u occupancy %u, "
+                   "pkt %u out %u\n", i, rec->slot_time, rec->deq_time,
+                   PQ_TRACE_OCC(rec), j, (uint32_t)p->out_time);
+            errors++;
+        }
+    }
+    return errors == 0;
+}
+
+/* Ring filled by the test, as notify fills it */
+static struct pq_trace_rec lap_ring[PQ_TRACE_LENGTH];
+static uint32_t lap_seq;
+
+static int
+lap_read(void *arg, size_t off, void *buf, size_t len)
+{
+    (void)arg;
+    memcpy(buf, (char *)lap_ring + off, len);
+    return 0;
+}
+
+static void
+lap_write(unsigned int n)
+{
+    while (n--) {
+        lap_seq++;
+        lap_ring[lap_seq & PQ_TRACE_MASK].seq = lap_seq;
+    }
+}
+
+/* Take what is written, expecting it to start at seq first */
+static int
+lap_drain(struct pq_trace_reader *r, uint32_t first, unsigned int expect)
+{
+    static struct pq_trace_rec recs[PQ_TRACE_LENGTH];
+    unsigned int i, taken = 0;
+    int n;
+
+    while ((n = pq_trace_poll(r, recs, PQ_TRACE_LENGTH / 3)) > 0) {
+        for (i = 0; i < (unsigned int)n; i++) {
+            if (recs[i].seq != first + taken + i)
+                return 0;
+        }
+        taken += n;
+    }
+    return taken == expect;
+}
+
+/* The reader takes records across the seq wrap, and skips over the ones
+ * the ring overwrote before it got to them */
+static int
+check_trace_lap(void)
+{
+    struct pq_trace_reader r;
+    uint32_t first;
+    int ok = 1;
+
+    /* Seq close to wrapping, the reader starts after the newest record */
+    lap_seq = UINT32_MAX - 1000 - PQ_TRACE_LENGTH;
+    lap_write(PQ_TRACE_LENGTH);
+    pq_trace_reader_init(&r, lap_read, NULL, 0);
+    ok &= r.next == lap_seq + 1;
+    ok &= lap_drain(&r, lap_seq + 1, 0);
+
+    /* Across the wrap */
+    first = lap_seq + 1;
+    lap_write(3000);
+    ok &= lap_drain(&r, first, 3000);
+
+    /* Twice around the ring before the reader looks: only the last ring
+       of records is left */
+    lap_write(2 * PQ_TRACE_LENGTH + 100);
+    ok &= lap_drain(&r, lap_seq + 1 - PQ_TRACE_LENGTH, PQ_TRACE_LENGTH);
+    ok &= r.lost == PQ_TRACE_LENGTH + 100;
+
+    /* From the oldest record */
+    pq_trace_reader_init(&r, lap_read, NULL, 1);
+    ok &= lap_drain(&r, lap_seq + 1 - PQ_TRACE_LENGTH, PQ_TRACE_LENGTH);
+
+    printf("    trace reader: %s on a ring wrapping past it\n",
+           ok ? "ok" : "wrong records");
+    return ok;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Scenarios                                                                 */
+/* ------------------------------------------------------------------------- */
+
+static void
+build_unpaced(void)
+{
+    unsigned int b, i, first;
+
+    for (b = 0; b < 32; b++) {
+        first = num_pkts;
+        for (i = 0; i < NFD_IN_MAX_BATCH_SZ; i++)
+            add_pkt(0, 0, 0, 0, 64 + 8 * i);
+        add_batch(b * 100, b & 1, b & 3, first, NFD_IN_MAX_BATCH_SZ, 0);
+    }
+}
+
+static int
+check_unpaced(void)
+{
+    return check_delivery();
+}
+
+/* 4 flows on their own TX queue at 1 Gbps, host sends at twice the rate */
+static void
+build_paced(void)
+{
+    unsigned int b, flow, i, first;
+
+    for (b = 0; b < 16; b++) {
+        for (flow = 1; flow <= 4; flow++) {
+            first = num_pkts;
+            for (i = 0; i < NFD_IN_MAX_BATCH_SZ; i++)
+                add_pkt(flow, 12112, 0, 0, 1514);
+            add_batch(b * 4 * NS_TO_TICKS(12112), flow & 1, flow,
+                      first, NFD_IN_MAX_BATCH_SZ, 0);
+        }
+    }
+}
+
+static int
+check_paced(void)
+{
+    return check_delivery() & check_idt() & check_counters();
+}
+
+/* 64 KB TSO packets of one flow at 10 Gbps, host sends at twice the rate */
+static void
+build_lso(void)
+{
+    unsigned int b, i, first;
+
+    for (b = 0; b < 8; b++) {
+        first = num_pkts;
+        for (i = 0; i < 44; i++)
+            add_pkt(1, 1211, 0, 0, 1514);
+        add_batch(b * 22 * NS_TO_TICKS(1211), 0, 1, first, 44, 1);
+    }
+}
+
+static int
+check_lso(void)
+{
+    return check_delivery() & check_idt() & check_counters();
+}
+
+/* Unpaced EDT packets, each with its own delay */
+static void
+build_edt(void)
+{
+    unsigned int b, i, first;
+
+    for (b = 0; b < 8; b++) {
+        first = num_pkts;
+        for (i = 0; i < NFD_IN_MAX_BATCH_SZ; i++)
+            add_pkt(0, 0, 1, (b * 8 + i) * 5000, 1514);
+        add_batch(b * 200, 0, 0, first, NFD_IN_MAX_BATCH_SZ, 0);
+    }
+}
+
+static int
+check_edt_scenario(void)
+{
+    return check_delivery() & check_edt();
+}
+
+/* Paced flows as in build_paced(), draining the trace ring meanwhile */
+static void
+build_trace(void)
+{
+    trace_on = 1;
+    build_paced();
+}
+
+static int
+check_trace(void)
+{
+    return check_delivery() & check_trace_records() & check_trace_lap();
+}
+
+/* EDT packets as in build_edt(), up to 1.5 ms ahead, with the CTM
+ * threshold lowered to 2048 slots (1.31 ms) at runtime, so the latest of
+ * them go through the coarse wheel */
+static void
+build_config(void)
+{
+    unsigned int b, i, first;
+
+    config_on = 1;
+    config_tresh = 2048;
+    for (b = 0; b < 8; b++) {
+        first = num_pkts;
+        for (i = 0; i < NFD_IN_MAX_BATCH_SZ; i++)
+            add_pkt(0, 0, 1, (b * 8 + i) * 24000, 1514);
+        add_batch(b * 200, 0, 0, first, NFD_IN_MAX_BATCH_SZ, 0);
+    }
+}
+
+static int
+check_config(void)
+{
+    int taken = notify_emu_config_taken();
+
+    printf("    config: threshold %u slots %s\n", config_tresh,
+           taken ? "taken" : "NOT taken");
+    /* Packets for the coarse wheel take three EMEM commands to enqueue,
+       which the rest of their batch waits for */
+    return check_delivery() & check_edt_within(24 * SLOT_TICKS) & taken;
+}
+
+/* EDT packets 2.2-4.7 ms ahead, through the coarse wheel, with the CTM
+ * threshold at its maximum (2.5 ms) and lowered to its minimum (1.31 ms)
+ * while a coarse slot is cascaded, which must not send its packets back
+ * to the coarse wheel */
+static void
+build_reconfig(void)
+{
+    unsigned int b, i, first;
+
+    config_on = 1;
+    config_tresh = 3904;
+    reconfig_tresh = 2048;
+    for (b = 0; b < 8; b++) {
+        first = num_pkts;
+        for (i = 0; i < NFD_IN_MAX_BATCH_SZ; i++)
+            add_pkt(0, 0, 1, 2200000 + (b * 8 + i) * 40000, 1514);
+        add_batch(b * 200, 0, 0, first, NFD_IN_MAX_BATCH_SZ, 0);
+    }
+}
+
+static int
+check_reconfig(void)
+{
+    int taken = notify_emu_config_taken();
+
+    printf("    config: threshold %u slots %s during a cascade, %s\n",
+           reconfig_tresh, reconfig_done ? "written" : "NOT written",
+           taken ? "taken" : "NOT taken");
+    return check_delivery() & check_edt_within(24 * SLOT_TICKS) &
+           reconfig_done & taken;
+}
+
+/* EDT packets as in build_config(), with the threshold written before
+ * notify starts, but gen left odd for 200 us, as if the host was still
+ * writing the rest */
+static void
+build_torn(void)
+{
+    build_config();
+    config_on = 0;
+    torn_tresh = 2048;
+}
+
+static int
+check_torn(void)
+{
+    int taken = notify_emu_config_taken();
+
+    printf("    config: threshold %u slots %s while written, %s after\n",
+           torn_tresh, torn_taken ? "TAKEN" : "not taken",
+           taken ? "taken" : "NOT taken");
+    return check_delivery() & check_edt_within(24 * SLOT_TICKS) &
+           !torn_taken & taken;
+}
+
+/* 4 paced flows at 1 Gbps, sent by host at that rate, and as many unpaced
+ * packets through a port shaper at 1 Gbps, for 4.7 ms: the shaper holds
+ * head over 3 ms behind by the end, unless the host is held back */
+static void
+build_shape(void)
+{
+    unsigned int b, flow, i, first;
+
+    config_on = 1;
+    config_shape = 8 << 16;
+    for (b = 0; b < 48; b++) {
+        for (flow = 0; flow <= 4; flow++) {
+            first = num_pkts;
+            for (i = 0; i < NFD_IN_MAX_BATCH_SZ; i++)
+                add_pkt(flow, flow ? 12112 : 0, 0, 0, 1514);
+            add_batch(b * 8 * NS_TO_TICKS(12112), flow & 1, flow,
+                      first, NFD_IN_MAX_BATCH_SZ, 0);
+        }
+    }
+}
+
+static int
+check_shape(void)
+{
+    int taken = notify_emu_config_taken();
+    uint32_t squashed = notify_emu_counter(NOTIFY_EMU_CNT_SQUASHED);
+    uint32_t horizon = notify_emu_counter(NOTIFY_EMU_CNT_HORIZON);
+
+    printf("    config: shaper %s, %u squashed, %u at horizon\n",
+           taken ? "taken" : "NOT taken", squashed, horizon);
+    /* A burst of the bucket and the packet that emptied it. Head held by
+       the shaper must not push packets due meanwhile beyond the CTM
+       threshold */
+    return check_delivery() & check_shape_within(2 * 1514) & taken &
+           (squashed == 0) & (horizon == 0);
+}
+
+static const struct scenario scenarios[] = {
+    { "unpaced", "flow 0 packets, bypassing pacing queue",
+      build_unpaced, check_unpaced },
+    { "paced", "4 flows at 1 Gbps, sent by host at 2 Gbps",
+      build_paced, check_paced },
+    { "lso", "TSO packets of 44 segments at 10 Gbps, sent at 20 Gbps",
+      build_lso, check_lso },
+    { "edt", "EDT packets, delay 0-315 us",
+      build_edt, check_edt_scenario },
+    { "trace", "4 paced flows, trace ring drained while running",
+      build_trace, check_trace },
+    { "config", "EDT packets, delay 0-1.5 ms, CTM threshold set at runtime",
+      build_config, check_config },
+    { "shape", "4 flows at 1 Gbps and unpaced packets, port shaper at 1 Gbps",
+      build_shape, check_shape },
+    { "reconfig", "EDT packets 2.2-4.7 ms ahead, CTM threshold lowered "
+      "during a cascade", build_reconfig, check_reconfig },
+    { "torn", "EDT packets, delay 0-1.5 ms, CTM threshold still being "
+      "written while polled", build_torn, check_torn },
+};
+
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+
+static int
+run_scenario(const struct scenario *sc)
+{
+    int ok;
+
+    bufs = emu_buf_alloc(MAX_PKTS);
+    sc->build();
+
+    notify_emu_init();
+    if (config_on)
+        notify_emu_config(config_tresh, 0, 0, config_shape);
+    if (torn_tresh)
+        notify_emu_config_begin(torn_tresh, 0, 0, 0);
+    emu_set_workq_fn(workq_msg, NULL);
+    notify_emu_run(step, NULL);
+
+    printf("%s: %s\n", sc->name, sc->desc);
+    ok = sc->check();
+    printf("    %u/%u pkts out in %.1f us, %llu ctx swaps, "
+           "%llu mem cmds, %u spilled, %u sent early\n",
+           num_out, num_pkts,
+           TICKS_TO_US((done_time ? done_time : me_tsc_read()) - start_time),
+           (unsigned long long)emu_stats.ctx_swaps,
+           (unsigned long long)emu_stats.mem_cmds,
+           notify_emu_counter(NOTIFY_EMU_CNT_OVF_SPILL),
+           notify_emu_counter(NOTIFY_EMU_CNT_OVF_SEND_NOW));
+    printf("    %s\n", ok ? "PASS" : "FAIL");
+    return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned int i;
+    int a, status, failed = 0, found;
+    pid_t pid;
+
+    if (argc > 2 && !strcmp(argv[1], "-c")) {
+        emu_cost.alu_slice = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+
+    for (i = 0; i < NUM_SCENARIOS; i++) {
+        found = (argc < 2);
+        for (a = 1; a < argc; a++)
+            found |= !strcmp(argv[a], scenarios[i].name);
+        if (!found)
+            continue;
+
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0)
+            exit(run_scenario(&scenarios[i]) ? 0 : 1);
+
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    }
+
+    printf("%s\n", failed ? "FAILED" : "ALL PASSED");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * @file          modified-nfd-firmware/emu/slot_bench.c
+ * @brief         Cost of finding a free pacing queue slot, by occupancy
+ *
+ * Fills the 4096 slots of the pacing queue to 10, 50 and 90 % and times
+ * searches from random desired slots with:
+ *  - summary: pq_find_next_available_slot() of notify.c, a summary bit per
+ *    bitmask word and find first set
+ *  - linear: the search notify.c had before, checking up to 20 bitmask
+ *    words and the first one with a free slot bit by bit (copied here)
+ * Slots are occupied either at random, or as one run from head with the
+ * desired slots in it (as when many packets are due at once), where the
+ * free slot is at the end of the run.
+ *
+ * Reported per search: host cycles (TSC, ns on other hosts), bitmask words
+ * and bits the linear search steps through, and searches it gives up on
+ * (notify.c halted the ME then). Both searches run on the same bitmasks, so
+ * the cycles compare them, they are not ME cycles. ME instructions of the
+ * linear search are estimated as 5 per word and 3 per bit it steps
+ * through. The summary search takes a find first set per word it looks at,
+ * at most two bitmask words and PQ_SUMMARY_LENGTH + 1 summary words.
+ *
+ * usage: slot_bench [-n searches]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "notify_emu.h"
+
+#define WORDS                   (NOTIFY_EMU_SLOTS / 32)
+#define LINEAR_MAX_WORDS        20
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BENCH_UNIT              "cyc"
+static inline uint64_t
+bench_now(void)
+{
+    return __builtin_ia32_rdtsc();
+}
+#else
+#define BENCH_UNIT              "ns"
+static inline uint64_t
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+static uint32_t rand_state = 1;
+
+static uint32_t
+bench_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+/* Steps of the linear search, summed over a run */
+static uint64_t linear_words;
+static uint64_t linear_bits;
+
+/* pq_find_next_available_slot() before the summary bitmap, halt() replaced
+ * by returning NOTIFY_EMU_SLOT_NONE */
+static uint32_t
+linear_find(const uint32_t *bitmasks, uint32_t pq_d_index)
+{
+    uint32_t bitmask, i;
+    uint32_t bitmask_index = pq_d_index >> 5;
+    uint32_t index_in_bitmask = pq_d_index & 31;
+
+    for (i = 0; i < LINEAR_MAX_WORDS; i++) {
+        linear_words++;
+        bitmask = ~bitmasks[bitmask_index];
+        bitmask &= (~0u << index_in_bitmask);
+
+        if (bitmask) {
+            index_in_bitmask = 0;
+            while ((bitmask & 1u) == 0) {
+                /* Keep gcc from turning the loop into ctz, NFCC does not */
+                __asm__("" : "+r"(bitmask));
+                bitmask >>= 1;
+                index_in_bitmask++;
+                linear_bits++;
+            }
+            return (bitmask_index << 5) + index_in_bitmask;
+        }
+
+        index_in_bitmask = 0;
+        bitmask_index++;
+        if (bitmask_index >= WORDS)
+            bitmask_index = 0;
+    }
+    return NOTIFY_EMU_SLOT_NONE;
+}
+
+/* Occupy pct % of the slots, at random or as a run from head (slot 0).
+ * Returns how many slots desired ones are drawn from */
+static uint32_t
+fill(unsigned int pct, int run)
+{
+    uint32_t slot, num = NOTIFY_EMU_SLOTS * pct / 100;
+
+    notify_emu_slots_clear();
+    if (run) {
+        for (slot = 0; slot < num; slot++)
+            notify_emu_slot_mark(slot);
+        return num;
+    }
+
+    for (slot = 0; slot < NOTIFY_EMU_SLOTS; slot++) {
+        if (bench_rand() % 100 < pct)
+            notify_emu_slot_mark(slot);
+    }
+    return NOTIFY_EMU_SLOTS;
+}
+
+static void
+bench(unsigned int pct, int run, unsigned int searches)
+{
+    static uint32_t desired[1 << 20];
+    const uint32_t *bitmasks;
+    uint64_t t, summary_t, linear_t, words, bits;
+    uint32_t range, slot, sum = 0;
+    unsigned int i, none = 0, wrong = 0;
+
+    range = fill(pct, run);
+    bitmasks = notify_emu_slot_bitmasks();
+    for (i = 0; i < searches; i++)
+        desired[i] = bench_rand() % range;
+
+    t = bench_now();
+    for (i = 0; i < searches; i++)
+        sum += notify_emu_slot_find(desired[i]);
+    summary_t = bench_now() - t;
+
+    linear_words = linear_bits = 0;
+    t = bench_now();
+    for (i = 0; i < searches; i++)
+        sum += linear_find(bitmasks, desired[i]);
+    linear_t = bench_now() - t;
+    words = linear_words;
+    bits = linear_bits;
+
+    /* Both find the same slot, unless the linear one gives up or wraps
+       past head (which the summary search refuses) */
+    for (i = 0; i < searches; i++) {
+        slot = linear_find(bitmasks, desired[i]);
+        if (slot == NOTIFY_EMU_SLOT_NONE)
+            none++;
+        else if (slot >= desired[i] &&
+                 slot != notify_emu_slot_find(desired[i]))
+            wrong++;
+    }
+
+    printf("%-7s %3u %%  %8.1f  %8.1f  %7.2f  %7.2f  %7.1f  %6.2f %%%s\n",
+           run ? "run" : "random", pct,
+           (double)summary_t / searches, (double)linear_t / searches,
+           (double)words / searches, (double)bits / searches,
+           (5.0 * words + 3.0 * bits) / searches,
+           100.0 * none / searches, wrong ? "  MISMATCH" : "");
+    if (sum == 1)
+        printf("\n");   /* keep the searches */
+}
+
+int
+main(int argc, char **argv)
+{
+    static const unsigned int pcts[] = { 10, 50, 90 };
+    unsigned int searches = 100000, i;
+    int opt, run;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': searches = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: slot_bench [-n searches]\n");
+            return 2;
+        }
+    }
+    if (searches < 1 || searches > (1 << 20)) {
+        fprintf(stderr, "usage: slot_bench [-n searches]\n");
+        return 2;
+    }
+
+    printf("free slot search, per search (%s on the host)\n", BENCH_UNIT);
+    printf("slots   occ   summary    linear   linear   linear   linear"
+           "   linear\n");
+    printf("                 %4s      %4s    words     bits  ME ins."
+           "  gave up\n", BENCH_UNIT, BENCH_UNIT);
+    for (run = 0; run <= 1; run++)
+        for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+            bench(pcts[i], run, searches);
+    return 0;
+}
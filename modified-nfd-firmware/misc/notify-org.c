@@ -218,6 +218,18 @@ do {                                                                    \
 /* Add sequence numbers, using a LM to store */
 static __shared __lmem unsigned int seq_nums[NFD_IN_NUM_SEQRS];
 
+#ifdef NOTIFY_EMU
+/* The sequencer of the batch is looked up again instead of using *l$index3 */
+#define NFD_IN_ADD_SEQN_PREP                                            \
+do {                                                                    \
+} while (0)
+
+#define NFD_IN_ADD_SEQN_PROC                                            \
+do {                                                                    \
+    pkt_desc_tmp.seq_num =                                              \
+        seq_nums[NFD_IN_SEQR_NUM(batch_in.pkt0.__raw[0])]++;            \
+} while (0)
+#else
 #define NFD_IN_ADD_SEQN_PREP                                            \
 do {                                                                    \
     local_csr_write(                                                    \
@@ -230,6 +242,7 @@ do {                                                                    \
     __asm { ld_field[pkt_desc_tmp.__raw[0], 6, NFD_IN_SEQN_PTR, <<8] }  \
     __asm { alu[NFD_IN_SEQN_PTR, NFD_IN_SEQN_PTR, +, 1] }               \
 } while (0)
+#endif
 
 #endif /* (NFD_IN_NUM_SEQRS == 1) */
 
@@ -291,11 +304,13 @@ reflect_data(unsigned int dst_me, unsigned int dst_ctx,
 
     /* Currently just support reflect_write_sig_remote */
     /* XXX NFP_MECSR_PREV_ALU_OV_SIG_CTX_bit is next to SIG_NUM */
+#ifndef NOTIFY_EMU
     __asm {
         alu[--, --, b, 3, <<NFP_MECSR_PREV_ALU_OV_SIG_NUM_bit];
         ct[reflect_write_sig_remote, *src_xfer, addr, 0, \
            __ct_const_val(count)], indirect_ref;
     };
+#endif
 }
 
 
@@ -303,8 +318,12 @@ __intrinsic void
 copy_absolute_xfer(__shared __gpr unsigned int *dst, unsigned int src_xnum)
 {
     /* XXX assumes src_xnum already accounts for CTX */
+#ifdef NOTIFY_EMU
+    *dst = emu_xfer_read(src_xnum);
+#else
     local_csr_write(local_csr_t_index, MECSR_XFER_INDEX(src_xnum));
     __asm alu[*dst, --, B, *$index];
+#endif
 }
 
 
@@ -321,18 +340,25 @@ lso_ring_get(unsigned int rnum, mem_ring_addr_t raddr, unsigned int xnum,
     ctassert(__is_ct_const(sync));
     ctassert(sync == sig_done);
 
+#ifdef NOTIFY_EMU
+    emu_ring_get(rnum, xnum, size, sigpair);
+#else
     ind = NFP_MECSR_PREV_ALU_OVE_DATA(1);
     __asm {
         alu[--, ind, OR, xnum, <<(NFP_MECSR_PREV_ALU_DATA16_shift + 2)];
         mem[get, --, raddr, <<8, rnum, __ct_const_val(count)], indirect_ref, \
             sig_done[*sigpair];
     }
+#endif
 }
 
 
 __intrinsic void
 lso_msg_copy(__gpr struct nfd_in_lso_desc *lso_pkt, unsigned int xnum)
 {
+#ifdef NOTIFY_EMU
+    emu_xfer_copy(lso_pkt, xnum, sizeof(*lso_pkt));
+#else
     local_csr_write(local_csr_t_index, MECSR_XFER_INDEX(xnum));
     __asm {
         alu[*lso_pkt.desc.__raw[0], --, B, *$index++];
@@ -341,6 +367,7 @@ lso_msg_copy(__gpr struct nfd_in_lso_desc *lso_pkt, unsigned int xnum)
         alu[*lso_pkt.desc.__raw[3], --, B, *$index++];
         alu[*lso_pkt.jumbo_seq, --, B, *$index++];
     }
+#endif
 }
 
 
@@ -422,12 +449,12 @@ notify_setup(int side)
 #ifdef NFD_IN_NOTIFY_DBG_CHKS
 #define _NOTIFY_MU_CHK(_pkt)                                            \
 do {                                                                    \
-    if ((batch_in.pkt##_pkt##.__raw[1] & NFD_MU_PTR_DBG_MSK) == 0) {    \
+    if ((batch_in.pkt##_pkt.__raw[1] & NFD_MU_PTR_DBG_MSK) == 0) {    \
         /* Write the error we read to Mailboxes for debug purposes */   \
         local_csr_write(local_csr_mailbox_0,                            \
                         NFD_IN_NOTIFY_MU_PTR_INVALID);                  \
         local_csr_write(local_csr_mailbox_1,                            \
-                        batch_in.pkt##_pkt##.__raw[1]);                 \
+                        batch_in.pkt##_pkt.__raw[1]);                 \
                                                                         \
         halt();                                                         \
     }                                                                   \
@@ -443,25 +470,25 @@ do {                                                                         \
     NFD_IN_LSO_CNTR_INCR(nfd_in_lso_cntr_addr,                               \
                          NFD_IN_LSO_CNTR_T_NOTIFY_ALL_PKT_DESC);             \
     /* finished packet and no LSO */                                         \
-    if (batch_in.pkt##_pkt##.eop) {                                          \
+    if (batch_in.pkt##_pkt.eop) {                                          \
         NFD_IN_LSO_CNTR_INCR(nfd_in_lso_cntr_addr,                           \
                              NFD_IN_LSO_CNTR_T_NOTIFY_NON_LSO_PKT_DESC);     \
         __critical_path();                                                   \
         _NOTIFY_MU_CHK(_pkt);                                                \
-        pkt_desc_tmp.is_nfd = batch_in.pkt##_pkt##.eop;                      \
-        pkt_desc_tmp.offset = batch_in.pkt##_pkt##.offset;                   \
+        pkt_desc_tmp.is_nfd = batch_in.pkt##_pkt.eop;                      \
+        pkt_desc_tmp.offset = batch_in.pkt##_pkt.offset;                   \
         NFD_IN_ADD_SEQN_PROC;                                                \
-        batch_out.pkt##_pkt##.__raw[0] = pkt_desc_tmp.__raw[0];              \
-        batch_out.pkt##_pkt##.__raw[1] = (batch_in.pkt##_pkt##.__raw[1] |    \
+        batch_out.pkt##_pkt.__raw[0] = pkt_desc_tmp.__raw[0];              \
+        batch_out.pkt##_pkt.__raw[1] = (batch_in.pkt##_pkt.__raw[1] |    \
                                           notify_reset_state_gpr);           \
-        batch_out.pkt##_pkt##.__raw[2] = batch_in.pkt##_pkt##.__raw[2];      \
-        batch_out.pkt##_pkt##.__raw[3] = batch_in.pkt##_pkt##.__raw[3];      \
+        batch_out.pkt##_pkt.__raw[2] = batch_in.pkt##_pkt.__raw[2];      \
+        batch_out.pkt##_pkt.__raw[3] = batch_in.pkt##_pkt.__raw[3];      \
                                                                              \
         _SET_DST_Q(_pkt);                                                    \
         __mem_workq_add_work(dst_q, wq_raddr, &batch_out.pkt##_pkt,          \
                              out_msg_sz, out_msg_sz, sig_done,               \
                              &wq_sig##_pkt);                                 \
-    } else if (batch_in.pkt##_pkt##.lso != NFD_IN_ISSUED_DESC_LSO_NULL) {    \
+    } else if (batch_in.pkt##_pkt.lso != NFD_IN_ISSUED_DESC_LSO_NULL) {    \
         /* else LSO packets */                                               \
         __gpr struct nfd_in_lso_desc lso_pkt;                                \
         SIGNAL_PAIR lso_sig_pair;                                            \
@@ -536,11 +563,11 @@ do {                                                                         \
                 pkt_desc_tmp.is_nfd = lso_pkt.desc.eop;                      \
                 pkt_desc_tmp.offset = lso_pkt.desc.offset;                   \
                 NFD_IN_ADD_SEQN_PROC;                                        \
-                batch_out.pkt##_pkt##.__raw[0] = pkt_desc_tmp.__raw[0];      \
-                batch_out.pkt##_pkt##.__raw[1] = (lso_pkt.desc.__raw[1] |    \
+                batch_out.pkt##_pkt.__raw[0] = pkt_desc_tmp.__raw[0];      \
+                batch_out.pkt##_pkt.__raw[1] = (lso_pkt.desc.__raw[1] |    \
                                                   notify_reset_state_gpr);   \
-                batch_out.pkt##_pkt##.__raw[2] = lso_pkt.desc.__raw[2];      \
-                batch_out.pkt##_pkt##.__raw[3] = lso_pkt.desc.__raw[3];      \
+                batch_out.pkt##_pkt.__raw[2] = lso_pkt.desc.__raw[2];      \
+                batch_out.pkt##_pkt.__raw[3] = lso_pkt.desc.__raw[3];      \
                 _SET_DST_Q(_pkt);                                            \
                                                                              \
                 __mem_workq_add_work(dst_q, wq_raddr, &batch_out.pkt##_pkt,  \
@@ -642,11 +669,16 @@ _notify(__shared __gpr unsigned int *complete,
         ctm_ring_get(NOTIFY_RING_ISL, input_ring, &batch_in.pkt4,
                      (sizeof(struct nfd_in_issued_desc) * 4), &msg_sig1);
 
+#ifdef NOTIFY_EMU
+        *served += NFD_IN_MAX_BATCH_SZ;
+        wait_sig_mask(wait_msk);
+#else
         __asm {
             ctx_arb[--], defer[2];
             local_csr_wr[local_csr_active_ctx_wakeup_events, wait_msk];
             alu[*served, *served, +, NFD_IN_MAX_BATCH_SZ];
         }
+#endif
 
         wait_msk = __signals(&wq_sig0, &wq_sig1, &wq_sig2, &wq_sig3,
                              &wq_sig4, &wq_sig5, &wq_sig6, &wq_sig7,
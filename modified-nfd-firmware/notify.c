@@ -199,6 +199,27 @@ static __shared __gpr unsigned int dst_q_seqn = 0;
 static __shared __lmem unsigned int seq_nums[NFD_IN_NUM_SEQRS];
 #endif /* (NFD_IN_NUM_SEQRS == 1) */
 
+/* Set seqn of packet (bits 8-23 of raw0) from its sequencer, then increase */
+#ifdef NOTIFY_EMU
+#define _PQ_SET_SEQN(_raw0)                                             \
+do {                                                                    \
+    unsigned int *__seqn = &seq_nums[NFD_IN_SEQR_NUM(_raw0)];           \
+                                                                        \
+    _raw0 = (_raw0 & ~0x00FFFF00) | ((*__seqn << 8) & 0x00FFFF00);      \
+    (*__seqn)++;                                                        \
+} while (0)
+#else
+#define _PQ_SET_SEQN(_raw0)                                             \
+do {                                                                    \
+    /* Point csr addr 3 (seqn_ptr) to correct queue */                  \
+    local_csr_write(local_csr_active_lm_addr_3,                         \
+        (uint32_t) &seq_nums[NFD_IN_SEQR_NUM(_raw0)]);                  \
+                                                                        \
+    __asm { ld_field[_raw0, 6, NFD_IN_SEQN_PTR, <<8] }                  \
+    __asm { alu[NFD_IN_SEQN_PTR, NFD_IN_SEQN_PTR, +, 1] }               \
+} while (0)
+#endif
+
 #else /* NFD_IN_ADD_SEQN */
 #endif /* NFD_IN_ADD_SEQN */
 
@@ -279,21 +300,226 @@ __shared __gpr uint32_t debug_index = 0;
 #define PQ_BITMASKS_LENGTH 128
 #define LM_BITMASKS_LENGTH 6
 
+/* One summary bit per bitmask, so 128 bitmasks -> 4 summary words */
+#define PQ_SUMMARY_LENGTH (PQ_BITMASKS_LENGTH >> INDEX_TO_BITMASK_SHIFT)
+#define PQ_SUMMARY_MASK (PQ_SUMMARY_LENGTH - 1u)
+
 /* each bitmask 32 bits, so need to remove 5 first bits to get bitmask index */
 #define INDEX_TO_BITMASK_SHIFT 5u           
 /* ... and only keep first 5 to get index inside bitmask */
 #define INDEX_IN_BITMASK_MASK 0x0000001F    
 
+/* Packets further ahead of head than this go to the coarse wheel (default
+   of pq_tresh_future_slots, see pq_config). A coarse slot is cascaded once
+   it fits below it, so it must cover two coarse slots for a coarse slot to
+   be cascaded before it is due. It must stay clear of the LM window */
 #define PQ_TRESH_FUTURE_SLOTS 3072
+#define PQ_TRESH_FUTURE_SLOTS_MIN                                        \
+    (2 * (PQ_CW_SLOT_TICKS >> PQ_TICKS_TO_SLOT_SHIFT))
+#define PQ_TRESH_FUTURE_SLOTS_MAX (PQ_CTM_LENGTH - PQ_LM_LENGTH)
+
+/* Let dequeue jump over runs of empty slots (up to a bitmask) per iteration,
+   instead of checking one slot per iteration */
+#define PQ_DEQUEUE_SKIP_EMPTY
+
+/* Send unpaced packets (flow 0, no EDT) from notify straight to the work
+   queue, instead of through the pacing queue (set 0 to compare latency,
+   emu/README.md has the numbers). Not while the port shaper is on, which
+   only sees the pacing queue */
+#ifndef PQ_BYPASS_UNPACED
+#define PQ_BYPASS_UNPACED 1
+#endif
 
+/* Port shaper (see pq_shape_take()): packets at head may leave this far
+   ahead of the shaper rate, so several can leave in one slot at high rates */
+#define PQ_SHAPE_BURST_TICKS (4 * PQ_SLOT_TICKS)
+
+/* While the port shaper holds head, packets due meanwhile are placed as far
+   behind head as it lags now, and beyond pq_tresh_future_slots they would
+   go to the coarse wheel or be squashed. So the host is held back while the
+   packets taken by notify take the shaper longer than the high mark to
+   send, until they take less than the low one (backpressure as for
+   occupancy), which keeps the lag of head below the high mark */
+#define PQ_SHAPE_BACKLOG_HIGH_TICKS (512 * PQ_SLOT_TICKS)
+#define PQ_SHAPE_BACKLOG_LOW_TICKS (256 * PQ_SLOT_TICKS)
+
+/* Overflow policy, for packets without a free slot between their desired
+   slot and the end of the horizon:
+    PQ_OVERFLOW_SEND_NOW: send packet to work queue right away (unpaced)
+    PQ_OVERFLOW_SPILL:    keep packet in EMEM overflow ring, re-enqueued by
+                          dequeue contexts once the queue drains (send right
+                          away if ring is full too) */
+#define PQ_OVERFLOW_SEND_NOW 0
+#define PQ_OVERFLOW_SPILL 1
+#define PQ_OVERFLOW_POLICY PQ_OVERFLOW_SPILL
+
+/* Backpressure host by holding back TX_R updates while the pacing queue is
+   above high watermark, until it drains below low watermark (0 = off).
+   Watermarks are defaults of pq_occupancy_high/low, see pq_config */
+#define PQ_OVERFLOW_BACKPRESSURE 1
+#define PQ_OCCUPANCY_HIGH (PQ_CTM_LENGTH * 3 / 4)
+#define PQ_OCCUPANCY_LOW (PQ_CTM_LENGTH / 2)
+
+/* Returned by pq_find_next_available_slot() when no slot is free */
+#define PQ_SLOT_NONE 0xFFFFFFFF
+
+
+/* Coarse wheel (CW) in EMEM, extends horizon beyond ctm_pacing_queue
+   Each coarse slot covers 1024 fine slots, 128 slots -> ~84 ms horizon */
+#define PQ_CW_LENGTH 128
+#define PQ_CW_MASK (PQ_CW_LENGTH - 1u)
+#define PQ_CW_BUCKET_SZ 32
+
+#define PQ_CW_SLOT_SHIFT 15u
+#define PQ_CW_SLOT_TICKS (1u << PQ_CW_SLOT_SHIFT)
+
+/* Furthest a packet can be enqueued from head (last coarse slot is kept
+   free, as the coarse head may lag one slot behind when cascading) */
+#define PQ_MAX_FUTURE_TICKS                                              \
+    ((uint64_t)(PQ_CW_LENGTH - 1) << PQ_CW_SLOT_SHIFT)
 
 #define PQ_CTM_RING_DIFF(_to, _from) (((_to) - (_from)) & PQ_CTM_MASK)
 
-#define PQ_DEP_TIME_DIFF_TRESHOLD(_delta_slots)                          \
-    ((_delta_slots -  PQ_TRESH_FUTURE_SLOTS) << PQ_TICKS_TO_SLOT_SHIFT)
+/* Flow state table in EMEM, with a direct mapped cache of it in LM */
+#define PQ_FLOW_TABLE_LENGTH 4096
+#define PQ_FLOW_TABLE_MASK (PQ_FLOW_TABLE_LENGTH - 1u)
+#define PQ_FLOW_CACHE_LENGTH 16
+#define PQ_FLOW_CACHE_MASK (PQ_FLOW_CACHE_LENGTH - 1u)
+
+/* Set in cache tag while the line is being filled from EMEM */
+#define PQ_FLOW_LOADING 0x80000000
+
+/* Fraction of prev_dep_time (see PQ_TICK_FRAC), kept above the flow ID */
+#define PQ_FLOW_FRAC_SHIFT 12
+#define PQ_FLOW_FRAC_MASK (0xFFFF << PQ_FLOW_FRAC_SHIFT)
+#define PQ_FLOW_TAG_MASK (~PQ_FLOW_FRAC_MASK)
+
+/* Overflow ring in EMEM, for packets the pacing queue has no slot for */
+#define PQ_OVF_LENGTH 1024
+#define PQ_OVF_MASK (PQ_OVF_LENGTH - 1u)
+
+/* Pacing queue counters (index into pq_counters) */
+#define PQ_CNT_OVF_SEND_NOW 0   /* no slot, sent right away */
+#define PQ_CNT_OVF_SPILL 1      /* no slot, kept in overflow ring */
+#define PQ_CNT_OVF_RING_FULL 2  /* no slot nor room in overflow ring */
+#define PQ_CNT_BACKPRESSURE 3   /* TX_R updates held back */
+#define PQ_CNT_DEQ_SIG_BUSY 4   /* dequeue found its xfer still in use */
+#define PQ_CNT_SLOT_COLLISION 5 /* desired slot taken, placed in a later one
+                                   (batched) */
+#define PQ_CNT_TRACE_DROP 6     /* trace record dropped, xfer still in use */
+#define PQ_CNT_PACED 7          /* packets enqueued to pacing queue (batched) */
+#define PQ_CNT_LATE 8           /* dequeued PQ_LATE_TICKS or more after slot
+                                   (batched, from lateness histogram) */
+#define PQ_CNT_HORIZON 9        /* departure clamped to PQ_MAX_FUTURE_TICKS
+                                   (batched) */
+#define PQ_CNT_SQUASHED 10      /* beyond pq_tresh_future_slots, coarse wheel
+                                   full, so enqueued at the CTM threshold
+                                   (batched) */
+#define PQ_CNT_SHAPED 11        /* held at head by the port shaper */
+#define PQ_CNT_NUM 16
+
+/* Counts of every packet, and of what may happen to every packet under
+   load, are kept in shared GPRs and LM, and added to EMEM once
+   PQ_CNT_BATCH packets add up, or the pacing queue is empty (so the host
+   sees them once traffic stops) */
+#define PQ_CNT_BATCH 256
+
+/* Histogram of how far behind the start of its slot each packet is
+   dequeued, bucket b counts [2^(b-1), 2^b) ticks (0: 0 ticks), the last
+   one anything later (from 328 us). Packets are dequeued once their slot
+   has passed, so on time is bucket 6 or 7 */
+#define PQ_LATE_HIST_LENGTH 16
+
+/* Packets dequeued this far behind their slot count as late, the first
+   tick of bucket PQ_LATE_BUCKET */
+#define PQ_LATE_TICKS (8 * PQ_SLOT_TICKS)
+#define PQ_LATE_BUCKET 9
+
+/* Trace ring in EMEM, a record for each packet dequeued from the pacing
+   queue, drained by the host with trace/pq_trace_drain (set 0 to leave out).
+   The host checks seq of a record to see if it is written, see
+   trace/pq_trace.h, so there is no producer index to update */
+#ifndef PQ_TRACE
+#define PQ_TRACE 1
+#endif
+#define PQ_TRACE_LENGTH 65536
+#define PQ_TRACE_MASK (PQ_TRACE_LENGTH - 1u)
+
+/* Until dequeue sets the seqn of a packet (bits 8-23 of raw0), they carry
+   the flow ID of the packet for its trace record */
+#define PQ_TRACE_FLOW_SET(_raw0, _flow_id)                               \
+    ((_raw0) = ((_raw0) & ~0x00FFFF00) | (((_flow_id) << 8) & 0x00FFFF00))
+#define PQ_TRACE_FLOW_GET(_raw0) (((_raw0) >> 8) & 0xFFFF)
+
+/* Pacing info from host in TX metadata prepend, first field after meta ID
+   see nfp_net_prep_tx_meta() in driver
+    PACING:     be32 flow ID, be32 IDT
+    PACING_EDT: be32 flow ID, be32 IDT, be32 delay in ns
+   With RATE flag in flow ID, IDT word is the new rate of the flow instead
+   (ns per byte, 16 bit fraction) */
+#define PQ_META_FIELD_SIZE 4
+#define PQ_META_FIELD_MASK ((1 << PQ_META_FIELD_SIZE) - 1)
+#define PQ_META_PACING 14
+#define PQ_META_PACING_LEN 8
+#define PQ_META_PACING_EDT 15
+#define PQ_META_PACING_EDT_LEN 12
+#define PQ_META_PACING_RATE 0x80000000
+
+/* BEGIN idt (also built on the host, see driver bench/build.sh) */
+
+/* IDTs are kept in 20ns ticks with a 16 bit fraction, and flows carry the
+   fraction of their last departure time, so gaps are not rounded down to
+   whole ticks */
+#define PQ_TICK_FRAC 16
+#define PQ_TICK_FRAC_MASK ((1 << PQ_TICK_FRAC) - 1)
+
+/* ns with _frac fraction bits -> ticks with PQ_TICK_FRAC fraction bits,
+   1/20 is 52429/2^20 (4e-6 too large) */
+#define PQ_NS_TO_TICKS_FRAC(_ns, _frac)                                  \
+    (((uint64_t)(_ns) * 52429) >> (20 + (_frac) - PQ_TICK_FRAC))
+
+/* IDT word: mantissa (low 28 bits) << exponent (high 4 bits) in 1/256 ns,
+   see nfp_net_tx_idt_encode() in driver. Exact to 1/256 ns below 1 ms,
+   relative error below 2^-28 above */
+#define PQ_IDT_FRAC 8
+#define PQ_IDT_MANT_BITS 28
+#define PQ_IDT_MANT_MASK ((1 << PQ_IDT_MANT_BITS) - 1)
+
+/**
+ * Convert IDT word of TX metadata to ticks, with PQ_TICK_FRAC fraction bits.
+ * At most 2^43 / 256 ns (9 hours), not clamped to the horizon.
+ */
+__intrinsic uint64_t
+pq_idt_ticks(uint32_t idt_word)
+{
+    uint64_t idt;
+
+    idt = (uint64_t)(idt_word & PQ_IDT_MANT_MASK)
+              << (idt_word >> PQ_IDT_MANT_BITS);
+
+    return PQ_NS_TO_TICKS_FRAC(idt, PQ_IDT_FRAC);
+}
+
+/* END idt */
+
+/* Longer IDTs are beyond the horizon anyway */
+#define PQ_MAX_IDT_TICKS_FRAC (PQ_MAX_FUTURE_TICKS << PQ_TICK_FRAC)
 
 /* Data structures and pointers */
 
+/* Pacing info of packet, from TX metadata */
+struct pq_pace {
+    uint32_t flow_id;           /* 0 = no flow state, send asap */
+    uint32_t idt_ticks;         /* gap to previous packet of flow */
+    uint32_t idt_frac;          /* and its fraction (PQ_TICK_FRAC) */
+    uint32_t edt;               /* depart delay_ticks after notify instead */
+    uint32_t delay_ticks;
+    uint32_t rate_update;       /* set rate of flow, gap from length */
+    uint32_t rate;
+    uint32_t len;               /* length of packet (no metadata) */
+    uint32_t frac;              /* fraction of departure time (PQ_TICK_FRAC) */
+};
+
 __export __ctm40 struct nfd_in_pkt_desc ctm_pacing_queue[PQ_CTM_LENGTH];
 
 __shared __lmem struct nfd_in_pkt_desc lm_pacing_queue[PQ_LM_LENGTH];
@@ -309,10 +535,117 @@ __shared __gpr uint32_t pq_lm_sync_end = PQ_LM_SYNC_LENGTH;
 __shared __lmem uint32_t bitmasks[PQ_BITMASKS_LENGTH];
 __shared __lmem uint32_t lm_bitmasks[LM_BITMASKS_LENGTH];
 
+/* Summary of bitmasks, bit i is set when bitmasks[i] is full (all occupied) */
+__shared __lmem uint32_t full_bitmasks[PQ_SUMMARY_LENGTH];
+
 __gpr uint32_t next_batch_out = 0;
 
-/* FlowID mapping to previous departure time */
-__shared __lmem uint64_t flows_prev_dep_time[32];
+/* Coarse wheel, a bucket of packets (and count) for each coarse slot */
+struct pq_cw_entry {
+    struct nfd_in_pkt_desc pkt;
+    uint32_t offset;            /* dep_time from start of coarse slot */
+    uint32_t __pad[3];
+};
+
+__export __emem struct pq_cw_entry emem_pacing_wheel[PQ_CW_LENGTH]
+                                                    [PQ_CW_BUCKET_SZ];
+__export __emem uint32_t emem_pacing_wheel_cnt[PQ_CW_LENGTH];
+
+__shared __gpr uint32_t pq_cw_head = 0;
+__shared __gpr uint64_t pq_cw_head_time = 0;
+
+/* Held by the context accessing a bucket (accesses swap context),
+   starts locked until buckets are zeroed in notify_setup_shared() */
+__shared __gpr uint32_t pq_cw_lock = 1;
+
+/* Overflow ring, filled at tail and drained at head */
+struct pq_ovf_entry {
+    struct nfd_in_pkt_desc pkt;
+    uint64_t dep_time;
+    uint32_t __pad[2];
+};
+
+__export __emem struct pq_ovf_entry emem_pacing_overflow[PQ_OVF_LENGTH];
+
+__shared __gpr uint32_t pq_ovf_head = 0;
+__shared __gpr uint32_t pq_ovf_tail = 0;
+__shared __gpr uint32_t pq_ovf_lock = 0;
+
+/* Number of packets in CTM/LM pacing queue */
+__shared __gpr uint32_t pq_occupancy = 0;
+
+__export __emem uint32_t pq_counters[PQ_CNT_NUM];
+
+/* Runtime configuration, written by the host over CPP as a seqlock: gen
+   made odd, then the values, then gen incremented to even. Dequeue
+   contexts read it every PQ_CONFIG_POLL_TICKS, and take the values into
+   GPRs when gen changed to an even one that is still the same read again
+   after them (0 = default, a config out of range is ignored). Applies to
+   packets enqueued from then on, the shaper rate to the packet at head */
+struct pq_config {
+    uint32_t gen;
+    uint32_t tresh_future_slots;    /* PQ_TRESH_FUTURE_SLOTS */
+    uint32_t occupancy_high;        /* PQ_OCCUPANCY_HIGH */
+    uint32_t occupancy_low;         /* PQ_OCCUPANCY_LOW */
+    uint32_t shape_rate;            /* port shaper, 0 = off */
+};
+
+#define PQ_CONFIG_POLL_TICKS 50000  /* 1 ms */
+
+__export __emem struct pq_config pq_config;
+
+__shared __gpr uint32_t pq_config_gen = 0;
+__shared __gpr uint32_t pq_config_polled = 0;   /* time, low 32 bits */
+__shared __gpr uint32_t pq_tresh_future_slots = PQ_TRESH_FUTURE_SLOTS;
+__shared __gpr uint32_t pq_occupancy_high = PQ_OCCUPANCY_HIGH;
+__shared __gpr uint32_t pq_occupancy_low = PQ_OCCUPANCY_LOW;
+
+/* Port shaper over all packets leaving the pacing queue, rate in ns per
+   byte with 16 bit fraction as flow rates (0 = off). Next packet conforms
+   from pq_shape_time (and its fraction, PQ_TICK_FRAC) on */
+__shared __gpr uint32_t pq_shape_rate = 0;
+__shared __gpr uint64_t pq_shape_time = 0;
+__shared __gpr uint32_t pq_shape_frac = 0;
+__shared __gpr uint32_t pq_shape_held = 0;     /* packet at head was held */
+/* Time the shaper is done with the packets notify took so far */
+__shared __gpr uint64_t pq_shape_backlog = 0;
+
+/* Lateness histogram (see PQ_LATE_HIST_LENGTH), read by the host */
+__export __emem uint32_t pq_late_hist[PQ_LATE_HIST_LENGTH];
+
+/* Not yet added to pq_counters (PQ_CNT_PACED, PQ_CNT_SLOT_COLLISION,
+   PQ_CNT_HORIZON and PQ_CNT_SQUASHED) and pq_late_hist, and how many
+   packets were added to lm_late_hist since */
+__shared __gpr uint32_t pq_cnt_paced = 0;
+__shared __gpr uint32_t pq_cnt_collision = 0;
+__shared __gpr uint32_t pq_cnt_horizon = 0;
+__shared __gpr uint32_t pq_cnt_squashed = 0;
+__shared __gpr uint32_t pq_cnt_dequeued = 0;
+__shared __lmem uint32_t lm_late_hist[PQ_LATE_HIST_LENGTH];
+
+/* Trace record, written with one command */
+struct pq_trace_rec {
+    uint32_t seq;               /* number of record, from 1 */
+    uint32_t flow_occ;          /* flow ID << 16 | pq_occupancy */
+    uint32_t slot_time;         /* time of slot at head (low 32 bits) */
+    uint32_t deq_time;          /* time of dequeue (low 32 bits) */
+};
+
+#if PQ_TRACE
+__export __emem struct pq_trace_rec pq_trace[PQ_TRACE_LENGTH];
+__shared __gpr uint32_t pq_trace_seq = 0;
+#endif
+
+/* FlowID mapping to previous departure time (and rate) */
+struct pq_flow_state {
+    uint64_t prev_dep_time;
+    uint32_t flow_id;           /* tag in LM cache, 0 = line not in use,
+                                   and fraction of prev_dep_time */
+    uint32_t rate;              /* ns per byte << 16, 0 = use IDT of pkt */
+};
+
+__export __emem struct pq_flow_state emem_flow_table[PQ_FLOW_TABLE_LENGTH];
+__shared __lmem struct pq_flow_state lm_flow_cache[PQ_FLOW_CACHE_LENGTH];
 
 
 /* --------------------- k_pace utilies ------------------------------------ */
@@ -334,6 +667,332 @@ raise_signal(SIGNAL *sig)
     __implicit_write(sig);
 }
 
+#if PQ_TRACE
+/**
+ * Add record of packet leaving the slot at head to trace ring, written from
+ * rec_out of the calling context (pending while rec_sig is outstanding).
+ * Never swaps context: if the previous record of the context is still
+ * being written, the record is dropped.
+ */
+__intrinsic void
+pq_trace_add(__xwrite struct pq_trace_rec *rec_out, SIGNAL *rec_sig,
+             __gpr uint32_t *pending, uint32_t flow_id, uint64_t now)
+{
+    uint32_t seq;
+
+    if (*pending && !signal_test(rec_sig)) {
+        mem_incr32(&pq_counters[PQ_CNT_TRACE_DROP]);
+        return;
+    }
+
+    seq = ++pq_trace_seq;
+    rec_out->seq = seq;
+    rec_out->flow_occ = (flow_id << 16) | (pq_occupancy & 0xFFFF);
+    rec_out->slot_time = (uint32_t)pq_head_time;
+    rec_out->deq_time = (uint32_t)now;
+    __mem_write32(rec_out, &pq_trace[seq & PQ_TRACE_MASK],
+                  sizeof(*rec_out), sizeof(*rec_out), sig_done, rec_sig);
+    *pending = 1;
+}
+#endif
+
+/**
+ * Mark CTM slot as occupied, and set summary bit if its bitmask became full
+ *
+ */
+__intrinsic void
+pq_mark_slot(uint32_t pq_index)
+{
+    uint32_t bitmask;
+    uint32_t bitmask_index = pq_index >> INDEX_TO_BITMASK_SHIFT;
+
+    bitmask = bitmasks[bitmask_index] |
+                    (1u << (pq_index & INDEX_IN_BITMASK_MASK));
+    bitmasks[bitmask_index] = bitmask;
+    pq_occupancy++;
+
+    if (bitmask == 0xFFFFFFFF) {
+        full_bitmasks[bitmask_index >> INDEX_TO_BITMASK_SHIFT] |=
+                        (1u << (bitmask_index & INDEX_IN_BITMASK_MASK));
+    }
+}
+
+/**
+ * Mark CTM slot as free, its bitmask can then no longer be full
+ *
+ */
+__intrinsic void
+pq_clear_slot(uint32_t pq_index)
+{
+    uint32_t bitmask_index = pq_index >> INDEX_TO_BITMASK_SHIFT;
+
+    bitmasks[bitmask_index] &= ~(1u << (pq_index & INDEX_IN_BITMASK_MASK));
+    full_bitmasks[bitmask_index >> INDEX_TO_BITMASK_SHIFT] &=
+                        ~(1u << (bitmask_index & INDEX_IN_BITMASK_MASK));
+    pq_occupancy--;
+}
+
+/**
+ * Set IDT of packet, from ticks with PQ_TICK_FRAC fraction bits.
+ */
+__intrinsic void
+pq_pace_set_idt(__gpr struct pq_pace *pace, uint64_t idt)
+{
+    if (idt > PQ_MAX_IDT_TICKS_FRAC) idt = PQ_MAX_IDT_TICKS_FRAC;
+
+    pace->idt_ticks = (uint32_t)(idt >> PQ_TICK_FRAC);
+    pace->idt_frac = (uint32_t)idt & PQ_TICK_FRAC_MASK;
+}
+
+/**
+ * Read pacing info from TX metadata of packet, and strip it from the
+ * metadata so the app only sees the fields it knows.
+ * Packets without pacing info get flow ID 0 (not paced).
+ */
+__intrinsic void
+pq_meta_pacing(__gpr struct nfd_in_pkt_desc *pkt, __gpr struct pq_pace *pace)
+{
+    __xread uint32_t meta_in[4];
+    __xwrite uint32_t meta_id_out;
+    uint64_t meta_addr;
+    uint32_t meta_id, meta_type, strip_len;
+
+    pace->flow_id = 0;
+    pace->edt = 0;
+    if (pkt->offset < sizeof(meta_id) + PQ_META_PACING_LEN) return;
+
+    /* Metadata is placed right in front of packet data in MU buffer */
+    /* Reading past a short prepend only reads packet data, never used */
+    meta_addr = ((uint64_t)pkt->buf_addr << 11)
+                    + NFD_IN_DATA_OFFSET - pkt->offset;
+    mem_read32(meta_in, (__mem40 void *)meta_addr, sizeof(meta_in));
+
+    meta_id = meta_in[0];
+    meta_type = meta_id & PQ_META_FIELD_MASK;
+    if (meta_type == PQ_META_PACING) {
+        strip_len = PQ_META_PACING_LEN;
+    } else if (meta_type == PQ_META_PACING_EDT) {
+        strip_len = PQ_META_PACING_EDT_LEN;
+        pace->edt = 1;
+        /* Converted as IDTs are, in whole ticks (up to 16 ticks long at
+           the horizon, within a slot) */
+        pace->delay_ticks =
+            (uint32_t)(PQ_NS_TO_TICKS_FRAC(meta_in[3], 0) >> PQ_TICK_FRAC);
+    } else {
+        return;
+    }
+
+    /* Drop pacing field, and the meta ID word if nothing else is left */
+    meta_id >>= PQ_META_FIELD_SIZE;
+    if (meta_id) {
+        meta_id_out = meta_id;
+        mem_write32(&meta_id_out, (__mem40 void *)(meta_addr + strip_len),
+                    sizeof(meta_id_out));
+    } else {
+        strip_len += sizeof(meta_id);
+    }
+    pkt->offset -= strip_len;
+    pkt->data_len -= strip_len;
+
+    pace->len = pkt->data_len - pkt->offset;
+    pace->flow_id = meta_in[1] & ~PQ_META_PACING_RATE;
+    pace->rate_update = 0;
+    pace->idt_ticks = 0;
+    pace->idt_frac = 0;
+    if (meta_in[1] & PQ_META_PACING_RATE) {
+        pace->rate_update = 1;
+        pace->rate = meta_in[2];
+    } else {
+        pq_pace_set_idt(pace, pq_idt_ticks(meta_in[2]));
+    }
+}
+
+/**
+ * Get LM cache line holding state of flow (flow_id != 0).
+ *
+ * On a miss the previous flow of the line is written back to EMEM and the
+ * flow is read in, swapping context once. Other contexts wanting the line
+ * meanwhile wait for the fill to finish.
+ */
+__intrinsic uint32_t
+pq_flow_lookup(uint32_t flow_id)
+{
+    __xwrite struct pq_flow_state state_out;
+    __xread struct pq_flow_state state_in;
+    SIGNAL flow_sig0, flow_sig1;
+    uint32_t line, word, tag;
+
+    flow_id &= PQ_FLOW_TABLE_MASK;
+    line = flow_id & PQ_FLOW_CACHE_MASK;
+
+    for (;;) {
+        word = lm_flow_cache[line].flow_id;
+        tag = word & PQ_FLOW_TAG_MASK;
+        if (tag == flow_id) {
+            __critical_path();
+            return line;
+        }
+        if (!(tag & PQ_FLOW_LOADING)) break;
+
+        /* Another context is filling this line */
+        ctx_swap();
+    }
+
+    /* Claim line, so no other context uses or evicts it while we swap */
+    lm_flow_cache[line].flow_id = flow_id | PQ_FLOW_LOADING;
+
+    if (tag != 0) {
+        state_out.prev_dep_time = lm_flow_cache[line].prev_dep_time;
+        state_out.flow_id = word;
+        state_out.rate = lm_flow_cache[line].rate;
+        __mem_write32(&state_out, &emem_flow_table[tag],
+                      sizeof(state_out), sizeof(state_out),
+                      sig_done, &flow_sig0);
+    } else {
+        signal_raise(&flow_sig0);
+    }
+    __mem_read32(&state_in, &emem_flow_table[flow_id],
+                 sizeof(state_in), sizeof(state_in),
+                 sig_done, &flow_sig1);
+    wait_for_all(&flow_sig0, &flow_sig1);
+
+    lm_flow_cache[line].prev_dep_time = state_in.prev_dep_time;
+    lm_flow_cache[line].rate = state_in.rate;
+    lm_flow_cache[line].flow_id = flow_id |
+                                  (state_in.flow_id & PQ_FLOW_FRAC_MASK);
+
+    return line;
+}
+
+/**
+ * Store departure time of the last packet of a flow, and its fraction.
+ */
+__intrinsic void
+pq_flow_store(uint32_t flow_line, uint64_t dep_time, uint32_t frac)
+{
+    lm_flow_cache[flow_line].prev_dep_time = dep_time;
+    lm_flow_cache[flow_line].flow_id =
+        (lm_flow_cache[flow_line].flow_id & PQ_FLOW_TAG_MASK)
+            | (frac << PQ_FLOW_FRAC_SHIFT);
+}
+
+/**
+ * Calculate departure time of packet, and update the one of its flow.
+ *
+ * EDT packets depart after the delay given by the host, other packets one
+ * IDT after the previous packet of the flow (flow 0: as soon as possible).
+ * Flows with a rate in firmware get IDT from rate and packet length.
+ * Never earlier than now or min_time, and never beyond the horizon.
+ */
+__intrinsic uint64_t
+pq_departure_time(__gpr struct pq_pace *pace, uint64_t min_time)
+{
+    uint64_t dep_time, curtime;
+    uint32_t flow_line, rate, frac;
+
+    if (pace->flow_id) {
+        flow_line = pq_flow_lookup(pace->flow_id);
+
+        if (pace->rate_update)
+            lm_flow_cache[flow_line].rate = pace->rate;
+        rate = lm_flow_cache[flow_line].rate;
+        pace->rate = rate;
+        if (rate)
+            pq_pace_set_idt(pace, PQ_NS_TO_TICKS_FRAC(
+                                      (uint64_t)pace->len * rate, 16));
+    }
+
+    /* If dep time has elapsed, we send packet as soon as possible */
+    curtime = get_current_time();
+    if (min_time < curtime) min_time = curtime;
+
+    frac = 0;
+    if (pace->edt) {
+        dep_time = curtime + pace->delay_ticks;
+    } else if (pace->flow_id) {
+        /* Add up the fractions of previous departure and IDT */
+        frac = (lm_flow_cache[flow_line].flow_id & PQ_FLOW_FRAC_MASK)
+                   >> PQ_FLOW_FRAC_SHIFT;
+        frac += pace->idt_frac;
+        dep_time = lm_flow_cache[flow_line].prev_dep_time + pace->idt_ticks
+                       + (frac >> PQ_TICK_FRAC);
+        frac &= PQ_TICK_FRAC_MASK;
+    } else {
+        dep_time = curtime;
+    }
+
+    if (dep_time < min_time) {
+        dep_time = min_time;
+        frac = 0;
+    }
+
+    /* Ensure packet is not enqueued to far in future */
+    if (dep_time > pq_head_time + PQ_MAX_FUTURE_TICKS) {
+        dep_time = pq_head_time + PQ_MAX_FUTURE_TICKS;
+        frac = 0;
+        pq_cnt_horizon++;
+    }
+
+    if (pace->flow_id)
+        pq_flow_store(flow_line, dep_time, frac);
+    pace->frac = frac;
+
+    return dep_time;
+}
+
+/**
+ * Calculate departure time of a TSO segment after the first, one IDT after
+ * the previous segment (dep_time and pace->frac, as left by
+ * pq_departure_time() or this function).
+ *
+ * The flow state is not read or written, and neither is the timestamp:
+ * segments that fell behind catch up to the queue head instead of now.
+ * Once all segments are enqueued, pq_flow_commit() stores the last one.
+ */
+__intrinsic uint64_t
+pq_departure_next(__gpr struct pq_pace *pace, uint64_t dep_time)
+{
+    uint32_t frac;
+
+    frac = 0;
+    if (pace->flow_id) {
+        /* pq_departure_time() left the rate of the flow in pace */
+        if (pace->rate)
+            pq_pace_set_idt(pace, PQ_NS_TO_TICKS_FRAC(
+                                      (uint64_t)pace->len * pace->rate, 16));
+
+        frac = pace->frac + pace->idt_frac;
+        dep_time += pace->idt_ticks + (frac >> PQ_TICK_FRAC);
+        frac &= PQ_TICK_FRAC_MASK;
+    }
+
+    if (dep_time < pq_head_time) {
+        dep_time = pq_head_time;
+        frac = 0;
+    }
+
+    if (dep_time > pq_head_time + PQ_MAX_FUTURE_TICKS) {
+        dep_time = pq_head_time + PQ_MAX_FUTURE_TICKS;
+        frac = 0;
+        pq_cnt_horizon++;
+    }
+
+    pace->frac = frac;
+
+    return dep_time;
+}
+
+/**
+ * Update flow with departure time of its last TSO segment, from
+ * pq_departure_next(). The line may have been evicted while the segments
+ * were read, so it is looked up again.
+ */
+__intrinsic void
+pq_flow_commit(__gpr struct pq_pace *pace, uint64_t dep_time)
+{
+    pq_flow_store(pq_flow_lookup(pace->flow_id), dep_time, pace->frac);
+}
+
 #define _BATCH_IN_TO_LM(_pkt)                                                   \
 do {                                                                            \
     lm_index = old_pq_lm_sync_end+_pkt;                                         \
@@ -343,7 +1002,7 @@ do {
     /*       however this would be less effient at high loads                */ \
     /* (adds an extra condtional which often evaluates to true at high loads)*/ \
     if (!( (bitmask >> (lm_index & INDEX_IN_BITMASK_MASK)) & 1u )) {            \
-        lm_pacing_queue[lm_index] = batch_in.pkt##_pkt##;                       \
+        lm_pacing_queue[lm_index] = batch_in.pkt##_pkt;                         \
     }                                                                           \
                                                                                 \
 } while (0)
@@ -373,6 +1032,13 @@ sync_ctm_lm() {
     addr_lo = ((unsigned long long)ctm_ptr & 0xffffffff);
 
     /* Each mem[read...] reads 8 * 64 bit (equal to 4 desc. / 64B) */
+#ifdef NOTIFY_EMU
+    __mem_read64(&batch_in.pkt0, ctm_ptr, 4u * sizeof(struct nfd_in_pkt_desc),
+                 4u * sizeof(struct nfd_in_pkt_desc), sig_done, &msg_sig0);
+    __mem_read64(&batch_in.pkt4, &ctm_pacing_queue[pq_ctm_sync_end + 4],
+                 4u * sizeof(struct nfd_in_pkt_desc),
+                 4u * sizeof(struct nfd_in_pkt_desc), sig_done, &msg_sig1);
+#else
     __asm {
         mem[read, batch_in.pkt0, addr_hi, <<8, addr_lo, __ct_const_val(8)], \
                         sig_done[*msg_sig0];
@@ -382,6 +1048,7 @@ sync_ctm_lm() {
         mem[read, batch_in.pkt4, addr_hi, <<8, addr_lo, __ct_const_val(8)], \
                         sig_done[*msg_sig1];
     }
+#endif
 
     /* Update pointers to "reserve" these 8 slots for us 
         So after we yield no other thread will sync this */
@@ -408,24 +1075,50 @@ sync_ctm_lm() {
 }
 
 
+/**
+ * Bucket of lateness histogram for a packet dequeued late ticks after the
+ * start of its slot, the position of the highest bit set in four compares
+ *
+ */
+__intrinsic uint32_t
+pq_late_bucket(uint64_t late)
+{
+    uint32_t bucket, val;
+
+    if (late >= (1u << (PQ_LATE_HIST_LENGTH - 2)))
+        return PQ_LATE_HIST_LENGTH - 1;
+
+    val = (uint32_t)late;
+    bucket = 0;
+    if (val >> 8) { bucket += 8; val >>= 8; }
+    if (val >> 4) { bucket += 4; val >>= 4; }
+    if (val >> 2) { bucket += 2; val >>= 2; }
+    if (val >> 1) { bucket += 1; val >>= 1; }
+
+    return bucket + val;
+}
+
 #define _DEQUEUE_PROC(_pkt)                                                 \
 do {                                                                        \
     /* Clear signal (it is implied raised if this macro is called )*/       \
-    /* (halt if not raised, as this indicates come corruption) */           \
-    if (!signal_test(&wq_sig##_pkt)) { halt(); }                            \
+    /* (if not raised the xfer is still in use, count it and wait) */       \
+    if (!signal_test(&wq_sig##_pkt)) {                                      \
+        mem_incr32(&pq_counters[PQ_CNT_DEQ_SIG_BUSY]);                      \
+        wait_for_all(&wq_sig##_pkt);                                        \
+    }                                                                       \
                                                                             \
     raw0_buff = lm_pacing_queue[pq_lm_head].__raw[0];                       \
                                                                             \
-    /* Point csr addr 3 (seqn_ptr) to correct queue */                      \
-    local_csr_write(local_csr_active_lm_addr_3,                             \
-        (uint32_t) &seq_nums[NFD_IN_SEQR_NUM(raw0_buff)]);                  \
+    _PQ_TRACE_ADD(raw0_buff);                                               \
+                                                                            \
+    lm_late_hist[pq_late_bucket(now - pq_head_time)]++;                     \
+    pq_cnt_dequeued++;                                                      \
                                                                             \
     /* Set seqn of packet, then increase counter */                         \
-    __asm { ld_field[raw0_buff, 6, NFD_IN_SEQN_PTR, <<8] }                  \
-    __asm { alu[NFD_IN_SEQN_PTR, NFD_IN_SEQN_PTR, +, 1] }                   \
+    _PQ_SET_SEQN(raw0_buff);                                                \
                                                                             \
-    batch_out.pkt##_pkt## = lm_pacing_queue[pq_lm_head];                    \
-    batch_out.pkt##_pkt##.__raw[0] = raw0_buff;                             \
+    batch_out.pkt##_pkt = lm_pacing_queue[pq_lm_head];                      \
+    batch_out.pkt##_pkt.__raw[0] = raw0_buff;                               \
                                                                             \
     __mem_workq_add_work(dst_q, wq_raddr, &batch_out.pkt##_pkt,             \
                             out_msg_sz_2, out_msg_sz_2, sig_done,           \
@@ -433,6 +1126,69 @@ do {                                                                        \
                                                                             \
 } while (0)
 
+#if PQ_TRACE
+#define _PQ_TRACE_ADD(_raw0)                                                \
+    pq_trace_add(&trace_out, &trace_sig, &trace_pending,                    \
+                 PQ_TRACE_FLOW_GET(_raw0), now)
+#else
+#define _PQ_TRACE_ADD(_raw0)
+#endif
+
+/**
+ * Take the length of a packet leaving from the bucket of the port shaper,
+ * also if the bucket is empty (packets sent right away without a slot)
+ */
+__intrinsic void
+pq_shape_charge(uint64_t now, uint32_t len)
+{
+    uint64_t cost;
+
+    /* An idle bucket fills up to the burst, not beyond */
+    if (pq_shape_time < now) {
+        pq_shape_time = now;
+        pq_shape_frac = 0;
+    }
+    cost = PQ_NS_TO_TICKS_FRAC((uint64_t)len * pq_shape_rate, 16)
+               + pq_shape_frac;
+    pq_shape_time += cost >> PQ_TICK_FRAC;
+    pq_shape_frac = (uint32_t)cost & PQ_TICK_FRAC_MASK;
+}
+
+/**
+ * Port shaper, a token bucket of PQ_SHAPE_BURST_TICKS over all packets
+ * leaving the pacing queue (kept as the time the next one conforms).
+ * Returns 0 if the packet at head has to wait, else takes its length from
+ * the bucket.
+ */
+__intrinsic uint32_t
+pq_shape_take(uint64_t now, uint32_t len)
+{
+    if (pq_shape_time > now + PQ_SHAPE_BURST_TICKS) {
+        pq_shape_held = 1;
+        return 0;
+    }
+    if (pq_shape_held) {
+        mem_incr32(&pq_counters[PQ_CNT_SHAPED]);
+        pq_shape_held = 0;
+    }
+
+    pq_shape_charge(now, len);
+    return 1;
+}
+
+/**
+ * Add a packet taken by notify to the backlog of the port shaper
+ */
+__intrinsic void
+pq_shape_queue(uint32_t len)
+{
+    uint64_t now = get_current_time();
+
+    if (pq_shape_backlog < now) pq_shape_backlog = now;
+    pq_shape_backlog += PQ_NS_TO_TICKS_FRAC((uint64_t)len * pq_shape_rate,
+                                            16) >> PQ_TICK_FRAC;
+}
+
 /**
  * Dequeue up to batch of packets and send to work queue
  *
@@ -440,9 +1196,17 @@ do {                                                                        \
 __intrinsic void
 dequeue_pacing_queue() {
     __gpr uint32_t raw0_buff;
+#if PQ_TRACE
+    __xwrite struct pq_trace_rec trace_out;
+    SIGNAL trace_sig;
+    __gpr uint32_t trace_pending = 0;
+#endif
     uint64_t now;
     uint32_t index_in_bitmask, bitmask_index, slots_to_send;
     uint32_t out_msg_sz_2 = sizeof(struct nfd_in_pkt_desc);
+#ifdef PQ_DEQUEUE_SKIP_EMPTY
+    uint32_t occupied, skip;
+#endif
 
     /* We are not done until we reach current time (slots_to_send == 0) */
     for (;;) {
@@ -453,6 +1217,39 @@ dequeue_pacing_queue() {
         slots_to_send = (uint32_t)((now-pq_head_time) >> PQ_TICKS_TO_SLOT_SHIFT);
         if (slots_to_send == 0) break;
 
+#ifdef PQ_DEQUEUE_SKIP_EMPTY
+        /* Head must stay inside the synced LM window, let sync catch up */
+        if (pq_lm_dequeue_cnt >= PQ_LM_SYNC_LENGTH) break;
+
+        /* If head slot is empty, move head to the next occupied slot in its
+           bitmask (or the end of the bitmask), without waiting for batch_out.
+           Bounded by now (slots_to_send) and the synced LM window */
+        occupied = bitmasks[pq_ctm_head >> INDEX_TO_BITMASK_SHIFT] >>
+                                    (pq_ctm_head & INDEX_IN_BITMASK_MASK);
+        if ((occupied & 1u) == 0) {
+            if (occupied)
+                skip = ffs(occupied);
+            else
+                skip = 32 - (pq_ctm_head & INDEX_IN_BITMASK_MASK);
+
+            if (skip > slots_to_send)
+                skip = slots_to_send;
+            if (skip > PQ_LM_SYNC_LENGTH - pq_lm_dequeue_cnt)
+                skip = PQ_LM_SYNC_LENGTH - pq_lm_dequeue_cnt;
+
+            /* Skipped slots are empty in both CTM and LM, so only move head.
+               Skip never crosses a bitmask, so CTM head wraps at most to 0 */
+            pq_ctm_head += skip;
+            if (pq_ctm_head >= PQ_CTM_LENGTH) pq_ctm_head = 0;
+            pq_lm_head += skip;
+            if (pq_lm_head >= PQ_LM_LENGTH) pq_lm_head -= PQ_LM_LENGTH;
+            pq_head_time += (uint64_t)skip << PQ_TICKS_TO_SLOT_SHIFT;
+
+            pq_lm_dequeue_cnt += skip;
+            continue;
+        }
+#endif
+
         /* Wait until the least recently used batch_out._pkt is available to write
            (this will check if signal raised, but not clear it) */
         switch (next_batch_out) {
@@ -472,6 +1269,9 @@ dequeue_pacing_queue() {
         if (now <= pq_head_time) break;
         slots_to_send = (uint32_t)((now-pq_head_time) >> PQ_TICKS_TO_SLOT_SHIFT);
         if (slots_to_send == 0) break;
+#ifdef PQ_DEQUEUE_SKIP_EMPTY
+        if (pq_lm_dequeue_cnt >= PQ_LM_SYNC_LENGTH) break;
+#endif
 
         /* --- We are now checking slot pq_head points to */
 
@@ -481,6 +1281,13 @@ dequeue_pacing_queue() {
 
         /* If slot/head contains packet we dequeue it using LRU batch_out._pkt */
         if((bitmasks[bitmask_index] >> index_in_bitmask) & 1u) {
+            /* Until the port shaper lets it go, head (and the whole queue
+               behind it) waits, and backpressure holds the host back */
+            if (pq_shape_rate &&
+                !pq_shape_take(now, lm_pacing_queue[pq_lm_head].data_len
+                                        - lm_pacing_queue[pq_lm_head].offset))
+                break;
+
             switch (next_batch_out) {
                 case 0: _DEQUEUE_PROC(0); break;
                 case 1: _DEQUEUE_PROC(1); break;
@@ -496,7 +1303,7 @@ dequeue_pacing_queue() {
             next_batch_out &= 7;
 
             /* Zero bitmask for this slot (ctm and lm) */
-            bitmasks[bitmask_index] &= ~(1u << index_in_bitmask);
+            pq_clear_slot(pq_ctm_head);
 
             lm_bitmasks[pq_lm_head >> INDEX_TO_BITMASK_SHIFT] &= 
                         ~(1u << (pq_lm_head & INDEX_IN_BITMASK_MASK) );
@@ -512,47 +1319,438 @@ dequeue_pacing_queue() {
 
         pq_lm_dequeue_cnt++;
     }
+
+#if PQ_TRACE
+    /* trace_out is not kept across calls */
+    if (trace_pending)
+        wait_for_all(&trace_sig);
+#endif
 }
 
 /**
- * Use the bitmask to find the next available index for a given slot.
- * 
+ * Use the bitmasks to find the next available index for a given slot.
+ *
+ * First check the desired bitmask from the desired index, then use the
+ * summary (full_bitmasks) to jump directly to the next bitmask which is not
+ * full. Searches the whole ring using at most PQ_SUMMARY_LENGTH + 1 summary
+ * words and two find-first-set, independent of queue occupancy.
+ * Returns PQ_SLOT_NONE if the queue is full from desired slot to horizon.
  */
 __intrinsic uint32_t
 pq_find_next_available_slot(uint32_t pq_d_index)
 {
-    uint32_t bitmask, i;
+    uint32_t available, summary_index, pq_index, i;
     uint32_t bitmask_index = pq_d_index >> INDEX_TO_BITMASK_SHIFT;
-    uint32_t index_in_bitmask = pq_d_index & INDEX_IN_BITMASK_MASK;
 
-    for (i = 0; i < 20; i++) {
-        bitmask = ~bitmasks[bitmask_index];       /* 1 = available */
+    /* Free slots in desired bitmask, from desired index (1 = available) */
+    available = ~bitmasks[bitmask_index] &
+                    (~0u << (pq_d_index & INDEX_IN_BITMASK_MASK));
+    if (available) {
+        __critical_path();
+        return (bitmask_index << INDEX_TO_BITMASK_SHIFT) + ffs(available);
+    }
 
-        /* Ignore bits below start index for first bitmask */
-        bitmask &= (~0u << index_in_bitmask); 
+    /* Look for the next bitmask which is not full, starting after desired */
+    bitmask_index++;
+    if (bitmask_index >= PQ_BITMASKS_LENGTH)
+        bitmask_index = 0;
+
+    summary_index = bitmask_index >> INDEX_TO_BITMASK_SHIFT;
+    available = ~full_bitmasks[summary_index] &
+                    (~0u << (bitmask_index & INDEX_IN_BITMASK_MASK));
+
+    /* Last iteration checks bitmasks before the start in first summary word */
+    for (i = 0; i <= PQ_SUMMARY_LENGTH; i++) {
+        if (available) {
+            bitmask_index = (summary_index << INDEX_TO_BITMASK_SHIFT) +
+                                                        ffs(available);
+            pq_index = (bitmask_index << INDEX_TO_BITMASK_SHIFT) +
+                                                ffs(~bitmasks[bitmask_index]);
+
+            /* Only accept slot if we did not wrap past head (horizon) */
+            if (PQ_CTM_RING_DIFF(pq_index, pq_ctm_head) >=
+                                PQ_CTM_RING_DIFF(pq_d_index, pq_ctm_head))
+                return pq_index;
+            break;
+        }
 
-        /* There is atleast one available space this bitmask */
-        /* Go through bitmask until we find the slot */
-        if (bitmask) {
-            index_in_bitmask = 0;
-            while ((bitmask & 1u) == 0) {
-                bitmask >>= 1;
-                index_in_bitmask++;
-            }
-            return (bitmask_index << INDEX_TO_BITMASK_SHIFT) + index_in_bitmask;
+        summary_index = (summary_index + 1) & PQ_SUMMARY_MASK;
+        available = ~full_bitmasks[summary_index];
+    }
+
+    /* Every slot between desired slot and the end of the horizon is occupied */
+    /* Caller handles packet by overflow policy */
+    return PQ_SLOT_NONE;
+}
+
+#define _SEND_PACKET_TO_WQ(_out)                                        \
+do {                                                                    \
+    wait_for_all(&wq_sig##_out);                                        \
+                                                                        \
+    raw0_buff = pkt->__raw[0];                                          \
+                                                                        \
+    /* Set seqn of packet, then increase counter */                     \
+    _PQ_SET_SEQN(raw0_buff);                                            \
+                                                                        \
+    batch_out.pkt##_out.__raw[0] = raw0_buff;                         \
+    batch_out.pkt##_out.__raw[1] = pkt->__raw[1];                     \
+    batch_out.pkt##_out.__raw[2] = pkt->__raw[2];                     \
+    batch_out.pkt##_out.__raw[3] = pkt->__raw[3];                     \
+                                                                        \
+    __mem_workq_add_work(dst_q, wq_raddr, &batch_out.pkt##_out,         \
+                         out_msg_sz, out_msg_sz, sig_done,              \
+                         &wq_sig##_out);                                \
+} while (0)
+
+/**
+ * Send unpaced packet straight to the work queue, skipping pacing queue
+ * Its sequence number is taken here instead of at dequeue (from the same
+ * counters), so packets of a TX queue stay in order
+ *
+ */
+__intrinsic void
+pq_bypass(__gpr struct nfd_in_pkt_desc *pkt)
+{
+    __gpr uint32_t raw0_buff;
+    uint32_t out_msg_sz = sizeof(struct nfd_in_pkt_desc);
+
+    /* Use next_batch_out to ensure we use all xwrite registers */
+    switch (next_batch_out) {
+        case 0: _SEND_PACKET_TO_WQ(0); break;
+        case 1: _SEND_PACKET_TO_WQ(1); break;
+        case 2: _SEND_PACKET_TO_WQ(2); break;
+        case 3: _SEND_PACKET_TO_WQ(3); break;
+        case 4: _SEND_PACKET_TO_WQ(4); break;
+        case 5: _SEND_PACKET_TO_WQ(5); break;
+        case 6: _SEND_PACKET_TO_WQ(6); break;
+        case 7: _SEND_PACKET_TO_WQ(7); break;
+    }
+    next_batch_out++;
+    next_batch_out &= 7;
+}
+
+/**
+ * Try to keep packet in overflow ring, returns 0 if ring is full
+ *
+ */
+__intrinsic uint32_t
+pq_ovf_spill(uint64_t dep_time, __gpr struct nfd_in_pkt_desc *pkt)
+{
+    __xwrite struct pq_ovf_entry entry_out;
+
+    while (pq_ovf_lock)
+        ctx_swap();
+
+    if (pq_ovf_tail - pq_ovf_head >= PQ_OVF_LENGTH)
+        return 0;
+    pq_ovf_lock = 1;
+
+    entry_out.pkt.__raw[0] = pkt->__raw[0];
+    entry_out.pkt.__raw[1] = pkt->__raw[1];
+    entry_out.pkt.__raw[2] = pkt->__raw[2];
+    entry_out.pkt.__raw[3] = pkt->__raw[3];
+    entry_out.dep_time = dep_time;
+    mem_write32(&entry_out, &emem_pacing_overflow[pq_ovf_tail & PQ_OVF_MASK],
+                sizeof(struct nfd_in_pkt_desc) + sizeof(uint64_t));
+    pq_ovf_tail++;
+
+    pq_ovf_lock = 0;
+    return 1;
+}
+
+/**
+ * Handle packet the pacing queue has no slot for (PQ_OVERFLOW_POLICY)
+ *
+ */
+__intrinsic void
+pq_overflow(uint64_t dep_time, __gpr struct nfd_in_pkt_desc *pkt)
+{
+    if (PQ_OVERFLOW_POLICY == PQ_OVERFLOW_SPILL) {
+        if (pq_ovf_spill(dep_time, pkt)) {
+            mem_incr32(&pq_counters[PQ_CNT_OVF_SPILL]);
+            return;
         }
+        mem_incr32(&pq_counters[PQ_CNT_OVF_RING_FULL]);
+    }
+
+    /* Can't wait for the shaper, but packets behind wait for it instead */
+    mem_incr32(&pq_counters[PQ_CNT_OVF_SEND_NOW]);
+    if (pq_shape_rate)
+        pq_shape_charge(get_current_time(), pkt->data_len - pkt->offset);
+    pq_bypass(pkt);
+}
 
-        /* No available spot in bitmask, so try next one */
-        index_in_bitmask = 0;
-        bitmask_index++;
-        if (bitmask_index >= PQ_BITMASKS_LENGTH)
-            bitmask_index = 0;
+#ifdef NOTIFY_EMU
+#define _PQ_CTM_WRITE(_out)                                             \
+    __mem_write64(&batch_out.pkt##_out, ctm_ptr,                        \
+                  sizeof(struct nfd_in_pkt_desc),                       \
+                  sizeof(struct nfd_in_pkt_desc), sig_done, &wq_sig##_out)
+#else
+#define _PQ_CTM_WRITE(_out)                                             \
+do {                                                                    \
+    addr_hi = ((unsigned long long)ctm_ptr >> 8) & 0xff000000;          \
+    addr_lo = ((unsigned long long)ctm_ptr & 0xffffffff);               \
+    __asm {                                                             \
+        mem[write, batch_out.pkt##_out, addr_hi, <<8, addr_lo,          \
+                        __ct_const_val(2)], sig_done[*wq_sig##_out]     \
+    }                                                                   \
+} while (0)
+#endif
+
+#define _SEND_PACKET_TO_CTM(_out)                                       \
+do {                                                                    \
+    wait_for_all(&wq_sig##_out);                                        \
+                                                                        \
+    batch_out.pkt##_out.__raw[0] = pkt->__raw[0];                     \
+    batch_out.pkt##_out.__raw[1] = pkt->__raw[1];                     \
+    batch_out.pkt##_out.__raw[2] = pkt->__raw[2];                     \
+    batch_out.pkt##_out.__raw[3] = pkt->__raw[3];                     \
+                                                                        \
+    /* Write packet to CTM */                                           \
+    ctm_ptr = &ctm_pacing_queue[pq_index];                              \
+    _PQ_CTM_WRITE(_out);                                                \
+} while (0)
+
+/**
+ * Try to place packet in coarse wheel, returns 0 if not possible
+ * (dep_time not covered by coarse wheel or bucket full)
+ *
+ */
+__intrinsic uint32_t
+pq_cw_enqueue(uint64_t dep_time, __gpr struct nfd_in_pkt_desc *pkt)
+{
+    __xread uint32_t cnt_in;
+    __xwrite uint32_t cnt_out;
+    __xwrite struct pq_cw_entry entry_out;
+    uint32_t cw_index, cnt;
+    uint64_t offset;
+
+    /* Take lock before looking at coarse head, as cascade may move it */
+    while (pq_cw_lock)
+        ctx_swap();
+    pq_cw_lock = 1;
+
+    /* Coarse slot of dep_time has already been cascaded (or is too far) */
+    if (dep_time < pq_cw_head_time) {
+        pq_cw_lock = 0;
+        return 0;
     }
+    offset = dep_time - pq_cw_head_time;
+    if (offset >= ((uint64_t)PQ_CW_LENGTH << PQ_CW_SLOT_SHIFT)) {
+        pq_cw_lock = 0;
+        return 0;
+    }
+
+    cw_index = (pq_cw_head + (uint32_t)(offset >> PQ_CW_SLOT_SHIFT)) &
+                                                                PQ_CW_MASK;
+
+    mem_read32(&cnt_in, &emem_pacing_wheel_cnt[cw_index], sizeof(cnt_in));
+    cnt = cnt_in;
+    if (cnt >= PQ_CW_BUCKET_SZ) {
+        pq_cw_lock = 0;
+        return 0;
+    }
+
+    entry_out.pkt.__raw[0] = pkt->__raw[0];
+    entry_out.pkt.__raw[1] = pkt->__raw[1];
+    entry_out.pkt.__raw[2] = pkt->__raw[2];
+    entry_out.pkt.__raw[3] = pkt->__raw[3];
+    entry_out.offset = (uint32_t)offset & (PQ_CW_SLOT_TICKS - 1);
+    mem_write32(&entry_out, &emem_pacing_wheel[cw_index][cnt],
+                sizeof(struct nfd_in_pkt_desc) + sizeof(uint32_t));
+
+    cnt_out = cnt + 1;
+    mem_write32(&cnt_out, &emem_pacing_wheel_cnt[cw_index], sizeof(cnt_out));
 
-    /* No slot found within 620-660 slots of initial */
-    /* Should never happen, indicates corruption/invalid state */
-    halt();
-    return 0;
+    pq_cw_lock = 0;
+    return 1;
+}
+
+/**
+ * Enqueue packet desc to pacing queue at its departure time.
+ * Close packets are placed in LM, others in CTM, and packets beyond
+ * the CTM horizon in the coarse wheel.
+ *
+ */
+__intrinsic void
+pq_enqueue(uint64_t dep_time, __gpr struct nfd_in_pkt_desc *pkt)
+{
+    uint32_t pq_index, pq_d_index, delta_slots;
+
+    /* -------------- Get index ------------- */
+    delta_slots = 0;
+
+    /* Calculate packet slot based on how long in future from head */
+    if (dep_time > pq_head_time)
+        delta_slots = (uint32_t)((dep_time - pq_head_time) >>
+                                                PQ_TICKS_TO_SLOT_SHIFT);
+
+    /* Packets beyond CTM threshold are kept in coarse wheel until cascaded.
+       If not possible, squash into the CTM queue */
+    if (delta_slots > pq_tresh_future_slots) {
+        if (pq_cw_enqueue(dep_time, pkt))
+            return;
+        pq_cnt_squashed++;
+        delta_slots = pq_tresh_future_slots;
+    }
+
+    /* Find desired (CTM) slot to enqueue in relation to head */
+    pq_d_index = pq_ctm_head + delta_slots;
+    if (pq_d_index >= PQ_CTM_LENGTH) pq_d_index -= PQ_CTM_LENGTH;
+
+    pq_index = pq_find_next_available_slot(pq_d_index);
+    if (pq_index == PQ_SLOT_NONE) {
+        pq_overflow(dep_time, pkt);
+        return;
+    }
+
+    /* Update delta_slots to reflect found slot */
+    if (pq_index != pq_d_index) {
+        pq_cnt_collision++;
+        delta_slots += PQ_CTM_RING_DIFF(pq_index, pq_d_index);
+    }
+
+    /* --------- Place packet in queue -------------- */
+
+    /* Reflect that packet is enqueued by updating bitmask */
+    pq_mark_slot(pq_index);
+
+    /* Place packet directly in lmem if close departure time */
+    if (delta_slots < (PQ_LM_LENGTH)) {
+        /* convert index to lmem */
+        pq_index = (pq_lm_head + delta_slots);
+        if (pq_index >= PQ_LM_LENGTH) pq_index -= PQ_LM_LENGTH;
+
+        lm_pacing_queue[pq_index].__raw[0] = pkt->__raw[0];
+        lm_pacing_queue[pq_index].__raw[1] = pkt->__raw[1];
+        lm_pacing_queue[pq_index].__raw[2] = pkt->__raw[2];
+        lm_pacing_queue[pq_index].__raw[3] = pkt->__raw[3];
+
+        /* mark lmem slot as occupied to prevent sync from overwriting */
+        lm_bitmasks[pq_index >> INDEX_TO_BITMASK_SHIFT] |=
+                            (1u <<  (pq_index & INDEX_IN_BITMASK_MASK));
+    } else {
+        /* ------------------ Send packet to CTM ------------------ */
+        /* Use next_batch_out to ensure we use all xwrite registers */
+        __ctm40 void *ctm_ptr;
+        unsigned int addr_hi, addr_lo;
+
+        switch (next_batch_out) {
+            case 0: _SEND_PACKET_TO_CTM(0); break;
+            case 1: _SEND_PACKET_TO_CTM(1); break;
+            case 2: _SEND_PACKET_TO_CTM(2); break;
+            case 3: _SEND_PACKET_TO_CTM(3); break;
+            case 4: _SEND_PACKET_TO_CTM(4); break;
+            case 5: _SEND_PACKET_TO_CTM(5); break;
+            case 6: _SEND_PACKET_TO_CTM(6); break;
+            case 7: _SEND_PACKET_TO_CTM(7); break;
+        }
+        next_batch_out++;
+        next_batch_out &= 7;
+    }
+}
+
+/**
+ * Move packets of the coarse head slot into the CTM/LM pacing queue,
+ * once the whole coarse slot is within the CTM threshold
+ *
+ */
+__intrinsic void
+pq_cw_cascade()
+{
+    __xread uint32_t cnt_in;
+    __xwrite uint32_t cnt_out;
+    __xread struct pq_cw_entry entry_in;
+    __gpr struct nfd_in_pkt_desc pkt;
+    uint32_t i, cnt;
+
+    /* Only cascade once all of coarse slot fits within CTM threshold
+       (pq_enqueue() then never sends it back to coarse wheel) */
+    if (pq_cw_lock) return;
+    if (pq_cw_head_time + PQ_CW_SLOT_TICKS > pq_head_time +
+            ((uint64_t)pq_tresh_future_slots << PQ_TICKS_TO_SLOT_SHIFT))
+        return;
+    pq_cw_lock = 1;
+
+    mem_read32(&cnt_in, &emem_pacing_wheel_cnt[pq_cw_head], sizeof(cnt_in));
+    cnt = cnt_in;
+
+    for (i = 0; i < cnt; i++) {
+        mem_read32(&entry_in, &emem_pacing_wheel[pq_cw_head][i],
+                   sizeof(struct nfd_in_pkt_desc) + sizeof(uint32_t));
+        pkt.__raw[0] = entry_in.pkt.__raw[0];
+        pkt.__raw[1] = entry_in.pkt.__raw[1];
+        pkt.__raw[2] = entry_in.pkt.__raw[2];
+        pkt.__raw[3] = entry_in.pkt.__raw[3];
+
+        pq_enqueue(pq_cw_head_time + entry_in.offset, &pkt);
+    }
+
+    if (cnt) {
+        cnt_out = 0;
+        mem_write32(&cnt_out, &emem_pacing_wheel_cnt[pq_cw_head],
+                    sizeof(cnt_out));
+    }
+
+    pq_cw_head = (pq_cw_head + 1) & PQ_CW_MASK;
+    pq_cw_head_time += PQ_CW_SLOT_TICKS;
+
+    pq_cw_lock = 0;
+}
+
+/**
+ * Re-enqueue a packet from the overflow ring, once the pacing queue has
+ * drained below the low watermark
+ *
+ */
+__intrinsic void
+pq_ovf_drain()
+{
+    __xread struct pq_ovf_entry entry_in;
+    __gpr struct nfd_in_pkt_desc pkt;
+
+    if (pq_ovf_lock || pq_ovf_head == pq_ovf_tail) return;
+    if (pq_occupancy >= pq_occupancy_low) return;
+    pq_ovf_lock = 1;
+
+    mem_read32(&entry_in, &emem_pacing_overflow[pq_ovf_head & PQ_OVF_MASK],
+               sizeof(struct nfd_in_pkt_desc) + sizeof(uint64_t));
+    pq_ovf_head++;
+    pq_ovf_lock = 0;
+
+    pkt.__raw[0] = entry_in.pkt.__raw[0];
+    pkt.__raw[1] = entry_in.pkt.__raw[1];
+    pkt.__raw[2] = entry_in.pkt.__raw[2];
+    pkt.__raw[3] = entry_in.pkt.__raw[3];
+
+    /* Departure time may have passed meanwhile, then sent asap */
+    pq_enqueue(entry_in.dep_time, &pkt);
+}
+
+/**
+ * Hold back notify (and so the TX_R update to host) while the pacing
+ * queue is above high watermark, until dequeue drains it below low, or
+ * while the port shaper is too far behind the packets taken (see
+ * PQ_SHAPE_BACKLOG_HIGH_TICKS)
+ *
+ */
+__intrinsic void
+pq_backpressure()
+{
+    if (!PQ_OVERFLOW_BACKPRESSURE)
+        return;
+
+    if (pq_occupancy >= pq_occupancy_high) {
+        mem_incr32(&pq_counters[PQ_CNT_BACKPRESSURE]);
+        while (pq_occupancy >= pq_occupancy_low)
+            ctx_swap();
+    } else if (pq_shape_rate && pq_shape_backlog > get_current_time() +
+                                        PQ_SHAPE_BACKLOG_HIGH_TICKS) {
+        mem_incr32(&pq_counters[PQ_CNT_BACKPRESSURE]);
+        while (pq_shape_rate && pq_shape_backlog > get_current_time() +
+                                        PQ_SHAPE_BACKLOG_LOW_TICKS)
+            ctx_swap();
+    }
 }
 
 /* --------------------------------------------------- */
@@ -579,19 +1777,25 @@ reflect_data(unsigned int dst_me, unsigned int dst_ctx,
     local_csr_write(local_csr_cmd_indirect_ref_0, indirect.__raw);
 
     /* Currently just support reflect_write_sig_remote */
+#ifndef NOTIFY_EMU
     __asm {
         alu[--, --, b, 3, <<NFP_MECSR_PREV_ALU_OV_SIG_NUM_bit];
         ct[reflect_write_sig_remote, *src_xfer, addr, 0, \
            __ct_const_val(count)], indirect_ref;
     };
+#endif
 }
 
 
 __intrinsic void
 copy_absolute_xfer(__shared __gpr unsigned int *dst, unsigned int src_xnum)
 {
+#ifdef NOTIFY_EMU
+    *dst = emu_xfer_read(src_xnum);
+#else
     local_csr_write(local_csr_t_index, MECSR_XFER_INDEX(src_xnum));
     __asm alu[*dst, --, B, *$index];
+#endif
 }
 
 
@@ -608,18 +1812,25 @@ lso_ring_get(unsigned int rnum, mem_ring_addr_t raddr, unsigned int xnum,
     ctassert(__is_ct_const(sync));
     ctassert(sync == sig_done);
 
+#ifdef NOTIFY_EMU
+    emu_ring_get(rnum, xnum, size, sigpair);
+#else
     ind = NFP_MECSR_PREV_ALU_OVE_DATA(1);
     __asm {
         alu[--, ind, OR, xnum, <<(NFP_MECSR_PREV_ALU_DATA16_shift + 2)];
         mem[get, --, raddr, <<8, rnum, __ct_const_val(count)], indirect_ref, \
             sig_done[*sigpair];
     }
+#endif
 }
 
 
 __intrinsic void
 lso_msg_copy(__gpr struct nfd_in_lso_desc *lso_pkt, unsigned int xnum)
 {
+#ifdef NOTIFY_EMU
+    emu_xfer_copy(lso_pkt, xnum, sizeof(*lso_pkt));
+#else
     local_csr_write(local_csr_t_index, MECSR_XFER_INDEX(xnum));
     __asm {
         alu[*lso_pkt.desc.__raw[0], --, B, *$index++];
@@ -628,6 +1839,7 @@ lso_msg_copy(__gpr struct nfd_in_lso_desc *lso_pkt, unsigned int xnum)
         alu[*lso_pkt.desc.__raw[3], --, B, *$index++];
         alu[*lso_pkt.jumbo_seq, --, B, *$index++];
     }
+#endif
 }
 
 
@@ -656,6 +1868,10 @@ notify_setup_visible(void)
 void
 notify_setup_shared()
 {
+    __xwrite uint32_t cnt_out;
+    __xwrite uint32_t zero_out[8];
+    unsigned int i;
+
 #ifdef NFD_IN_WQ_SHARED
     wq_num_base = NFD_RING_LINK(0, nfd_in, 0);
     wq_raddr = (unsigned long long) NFD_EMEM_SHARED(NFD_IN_WQ_SHARED) >> 8;
@@ -666,6 +1882,25 @@ notify_setup_shared()
 
     /* Initialize head timer, and align it to slots */
     pq_head_time = get_current_time() & ~((uint64_t)PQ_SLOT_TICKS - 1ull);
+
+    /* Take any configuration the host wrote before start in the first loop */
+    pq_config_polled = (uint32_t)pq_head_time - PQ_CONFIG_POLL_TICKS;
+
+    /* Coarse wheel starts at head, and empty buckets */
+    pq_cw_head_time = pq_head_time;
+    for (i = 0; i < PQ_CW_LENGTH; i++) {
+        cnt_out = 0;
+        mem_write32(&cnt_out, &emem_pacing_wheel_cnt[i], sizeof(cnt_out));
+    }
+
+    /* Coarse wheel is locked until initialized */
+    pq_cw_lock = 0;
+
+    /* No previous departure times for any flow (2 entries per write) */
+    for (i = 0; i < 8; i++)
+        zero_out[i] = 0;
+    for (i = 0; i < PQ_FLOW_TABLE_LENGTH; i += 2)
+        mem_write32(&zero_out, &emem_flow_table[i], sizeof(zero_out));
 }
 
 
@@ -707,61 +1942,10 @@ notify_setup(int side)
 }
 
 
-#define _SEND_PACKET_TO_CTM(_out)                                       \
-do {                                                                    \
-    wait_for_all(&wq_sig##_out);                                        \
-                                                                        \
-    /* Place desc in batch out, zero vlan field */                      \
-    batch_out.pkt##_out##.__raw[0] = pkt_desc_tmp.__raw[0];             \
-    batch_out.pkt##_out##.__raw[1] = (lm_batch_in.__raw[1]              \
-                                            | notify_reset_state_gpr);  \
-    batch_out.pkt##_out##.__raw[2] = lm_batch_in.__raw[2];              \
-    batch_out.pkt##_out##.__raw[3] = lm_batch_in.__raw[3]               \
-                                            &  0xFFFF0000;              \
-                                                                        \
-    /* Write packet to CTM */                                           \
-    ctm_ptr = &ctm_pacing_queue[pq_index];                              \
-    addr_hi = ((unsigned long long)ctm_ptr >> 8) & 0xff000000;          \
-    addr_lo = ((unsigned long long)ctm_ptr & 0xffffffff);               \
-    __asm {                                                             \
-        mem[write, batch_out.pkt##_out##, addr_hi, <<8, addr_lo,        \
-                        __ct_const_val(2)], sig_done[*wq_sig##_out]     \
-    }                                                                   \
-} while (0)
-
-#define _SEND_PACKET_LSO_TO_CTM(_out)                                   \
-do {                                                                    \
-    wait_for_all(&wq_sig##_out);                                        \
-                                                                        \
-    /* Place desc in batch out, zero vlan field */                      \
-    batch_out.pkt##_out##.__raw[0] = pkt_desc_tmp.__raw[0];             \
-    batch_out.pkt##_out##.__raw[1] = (lso_pkt.desc.__raw[1]             \
-                                        |  notify_reset_state_gpr);     \
-    batch_out.pkt##_out##.__raw[2] = lso_pkt.desc.__raw[2];             \
-    batch_out.pkt##_out##.__raw[3] = lso_pkt.desc.__raw[3]              \
-                                                & 0xFFFF0000;           \
-                                                                        \
-    /* Write packet to CTM */                                           \
-    ctm_ptr = &ctm_pacing_queue[pq_index];                              \
-    addr_hi = ((unsigned long long)ctm_ptr >> 8) & 0xff000000;          \
-    addr_lo = ((unsigned long long)ctm_ptr & 0xffffffff);               \
-    __asm {                                                             \
-        mem[write, batch_out.pkt##_out##, addr_hi, <<8, addr_lo,        \
-                        __ct_const_val(2)], sig_done[*wq_sig##_out]     \
-    }                                                                   \
-} while (0)
-
-
 #define _NOTIFY_PROC                                                         \
 do {                                                                         \
-    /* Read pacing rate + flow id from vlan field */                         \
-    /* Use 12*ns->ticks, results in firmware inserting 4% smaller gaps */    \
-    vlan_field = lm_batch_in.vlan;                                           \
-    idt_ticks = (vlan_field & 0x07FF)*12; /* 250ns -> 20ns ticks */          \
-    flow_id = (vlan_field >> 11) & 0x001F;                                   \
-                                                                             \
-    /* Flow 0 has zeroed IDT, so will always have dep_time = curtime */      \
-    /* In other words, flow 0 is always sent with no delay */                \
+    /* Flow 0 has no flow state, and always has dep_time = curtime */        \
+    /* In other words, flow 0 is always sent with no delay (unless EDT) */   \
                                                                              \
     if (lm_batch_in.eop) {  /* finished packet and no LSO */                 \
                                                                              \
@@ -769,87 +1953,32 @@ do {                                                                         \
         pkt_desc_tmp.is_nfd = lm_batch_in.eop;                               \
         pkt_desc_tmp.offset = lm_batch_in.offset;                            \
                                                                              \
-        /* ======= Enqueue packet ===================================== */   \
-                                                                             \
-        /* Calculate departure time for packet */                            \
-        /* If dep time has elapsed, we send packet as soon as possible */    \
-        curtime = get_current_time();                                        \
-        dep_time = flows_prev_dep_time[flow_id] + idt_ticks;                 \
-        if ( dep_time <= curtime) dep_time = curtime;                        \
-                                                                             \
-        /* -------------- Get index ------------- */                         \
-        delta_slots = 0;                                                     \
-                                                                             \
-        /* Calculate packet slot based on how long in future from head */    \
-        if (dep_time > pq_head_time)                                         \
-            delta_slots = (uint32_t)((dep_time - pq_head_time) >>            \
-                                                    PQ_TICKS_TO_SLOT_SHIFT); \
-                                                                             \
-        /* Ensure packet is not enqueued to far in future */                 \
-        /*    and update last departure time of flow */                      \
-        if (delta_slots > PQ_TRESH_FUTURE_SLOTS) {                           \
-            flows_prev_dep_time[flow_id] =                                   \
-                        dep_time - PQ_DEP_TIME_DIFF_TRESHOLD(delta_slots);   \
-            delta_slots = PQ_TRESH_FUTURE_SLOTS;                             \
-                                                                             \
-        } else {                                                             \
-            __critical_path();                                               \
-            flows_prev_dep_time[flow_id] = dep_time;                         \
-        }                                                                    \
-                                                                             \
-        /* Find desired (CTM) slot to enqueue in relation to head */         \
-        pq_d_index = pq_ctm_head + delta_slots;                              \
-        if (pq_d_index >= PQ_CTM_LENGTH) pq_d_index -= PQ_CTM_LENGTH;        \
-                                                                             \
-        pq_index = pq_find_next_available_slot(pq_d_index);                  \
-                                                                             \
-        /* Update delta_slots to reflect found slot */                       \
-        delta_slots += PQ_CTM_RING_DIFF(pq_index, pq_d_index);               \
+        /* Place desc in pkt_out */                                          \
+        pkt_out.__raw[0] = pkt_desc_tmp.__raw[0];                            \
+        pkt_out.__raw[1] = (lm_batch_in.__raw[1] | notify_reset_state_gpr);  \
+        pkt_out.__raw[2] = lm_batch_in.__raw[2];                             \
+        pkt_out.__raw[3] = lm_batch_in.__raw[3];                             \
                                                                              \
-        /* --------- Place packet in queue -------------- */                 \
+        /* Read flow id + pacing rate from metadata */                       \
+        pace.flow_id = 0;                                                    \
+        pace.edt = 0;                                                        \
+        if (lm_batch_in.offset)                                              \
+            pq_meta_pacing(&pkt_out, &pace);                                 \
                                                                              \
-        /* Reflect that packet is enqueued by updating bitmask */            \
-        bitmasks[pq_index >> INDEX_TO_BITMASK_SHIFT] |=                      \
-                                (1u << (pq_index & INDEX_IN_BITMASK_MASK));  \
-                                                                             \
-        /* Place packet directly in lmem if close departure time */          \
-        if (delta_slots < (PQ_LM_LENGTH)) {                                  \
-            /* convert index to lmem */                                      \
-            pq_index = (pq_lm_head + delta_slots);                           \
-            if (pq_index >= PQ_LM_LENGTH) pq_index -= PQ_LM_LENGTH;          \
-                                                                             \
-            /* Place packet in lm_pq at its dep time. Also zero vlan field */\
-            lm_pacing_queue[pq_index].__raw[0] = pkt_desc_tmp.__raw[0];      \
-            lm_pacing_queue[pq_index].__raw[1] = (lm_batch_in.__raw[1]       \
-                                                | notify_reset_state_gpr);   \
-            lm_pacing_queue[pq_index].__raw[2] = lm_batch_in.__raw[2];       \
-            lm_pacing_queue[pq_index].__raw[3] = lm_batch_in.__raw[3]        \
-                                                    &  0xFFFF0000;           \
+        /* ======= Enqueue packet ===================================== */   \
                                                                              \
-            /* mark lmem slot as occupied to prevent sync from overwriting */\
-            lm_bitmasks[pq_index >> INDEX_TO_BITMASK_SHIFT] |=               \
-                                (1u <<  (pq_index & INDEX_IN_BITMASK_MASK)); \
+        if (PQ_BYPASS_UNPACED && !pace.flow_id && !pace.edt &&               \
+            !pq_shape_rate) {                                                \
+            pq_bypass(&pkt_out);                                             \
         } else {                                                             \
-            /* ------------------ Send packet to CTM ------------------ */   \
-            /* Use next_batch_out to ensure we use all xwrite registers */   \
-            __ctm40 void *ctm_ptr;                                           \
-            unsigned int addr_hi, addr_lo;                                   \
-                                                                             \
-            switch (next_batch_out) {                                        \
-                case 0: _SEND_PACKET_TO_CTM(0); break;                       \
-                case 1: _SEND_PACKET_TO_CTM(1); break;                       \
-                case 2: _SEND_PACKET_TO_CTM(2); break;                       \
-                case 3: _SEND_PACKET_TO_CTM(3); break;                       \
-                case 4: _SEND_PACKET_TO_CTM(4); break;                       \
-                case 5: _SEND_PACKET_TO_CTM(5); break;                       \
-                case 6: _SEND_PACKET_TO_CTM(6); break;                       \
-                case 7: _SEND_PACKET_TO_CTM(7); break;                       \
-            }                                                                \
-            next_batch_out++;                                                \
-            next_batch_out &= 7;                                             \
+            dep_time = pq_departure_time(&pace, 0);                          \
+            PQ_TRACE_FLOW_SET(pkt_out.__raw[0], pace.flow_id);               \
+            if (pq_shape_rate)                                               \
+                pq_shape_queue(pkt_out.data_len - pkt_out.offset);           \
+            pq_enqueue(dep_time, &pkt_out);                                  \
+            pq_cnt_paced++;                                                  \
         }                                                                    \
                                                                              \
-                                                                             \
     } else if (lm_batch_in.lso != NFD_IN_ISSUED_DESC_LSO_NULL) {             \
         /* else LSO packets */                                               \
         __gpr struct nfd_in_lso_desc lso_pkt;                                \
@@ -857,13 +1986,20 @@ do {                                                                         \
         SIGNAL_MASK lso_wait_msk;                                            \
         __shared __gpr unsigned int jumbo_compl_seq;                         \
         int seqn_chk;                                                        \
+        uint32_t lso_first, lso_bypass, lso_segs;                            \
+        uint64_t lso_dep_time;                                               \
                                                                              \
         lso_wait_msk = 1 << __signal_number(&lso_sig_pair.even);             \
+        lso_first = 1;                                                       \
+        lso_segs = 0;                                                        \
+        lso_dep_time = 0;                                                    \
+                                                                             \
+        /* read packet from nfd_in_issued_lso_ring */                        \
+        lso_ring_get(lso_ring_num, lso_ring_addr, lso_xnum,                  \
+                     sizeof(lso_pkt), sig_done, &lso_sig_pair);              \
                                                                              \
         for (;;) {                                                           \
-            /* read packet from nfd_in_issued_lso_ring */                    \
-            lso_ring_get(lso_ring_num, lso_ring_addr, lso_xnum,              \
-                         sizeof(lso_pkt), sig_done, &lso_sig_pair);          \
+            /* Wait for the get issued before */                             \
             wait_sig_mask(lso_wait_msk);                                     \
             __implicit_read(&lso_sig_pair.even);                             \
             while (signal_test(&lso_sig_pair.odd)) {                         \
@@ -874,6 +2010,11 @@ do {                                                                         \
             }                                                                \
             lso_msg_copy(&lso_pkt, lso_xnum);                                \
                                                                              \
+            /* Descriptor is in GPRs, get the next one into the xfers */     \
+            /* while this one is enqueued */                                 \
+            if (lso_pkt.desc.lso != NFD_IN_ISSUED_DESC_LSO_RET)              \
+                lso_ring_get(lso_ring_num, lso_ring_addr, lso_xnum,          \
+                             sizeof(lso_pkt), sig_done, &lso_sig_pair);      \
                                                                              \
             /* Wait for the jumbo compl seq to catch up to the encoded seq */\
             copy_absolute_xfer(&jumbo_compl_seq, jumbo_compl_xnum);          \
@@ -901,97 +2042,192 @@ do {                                                                         \
                 pkt_desc_tmp.is_nfd = lso_pkt.desc.eop;                      \
                 pkt_desc_tmp.offset = lso_pkt.desc.offset;                   \
                                                                              \
-                /* ======= Enqueue packet ============================= */   \
-                                                                             \
-                /* Calculate departure time for packet */                    \
-                /* Note: could be more efficient by not reading prev dep_t */\
-                /*       for each TSO segment, but incr. dep_time directly */\
-                curtime = get_current_time();                                \
-                dep_time = flows_prev_dep_time[flow_id] + idt_ticks;         \
-                if ( dep_time <= curtime) dep_time = curtime;                \
+                /* Place desc in pkt_out */                                  \
+                pkt_out.__raw[0] = pkt_desc_tmp.__raw[0];                    \
+                pkt_out.__raw[1] = (lso_pkt.desc.__raw[1]                    \
+                                            |  notify_reset_state_gpr);      \
+                pkt_out.__raw[2] = lso_pkt.desc.__raw[2];                    \
+                pkt_out.__raw[3] = lso_pkt.desc.__raw[3];                    \
                                                                              \
-                /* -------------- Get index ------------- */                 \
-                delta_slots = 0;                                             \
+                /* Read flow id + pacing rate from metadata */               \
+                /* Each segment carries a copy, which must be stripped */    \
+                pace.flow_id = 0;                                            \
+                pace.edt = 0;                                                \
+                if (lso_pkt.desc.offset)                                     \
+                    pq_meta_pacing(&pkt_out, &pace);                         \
                                                                              \
-                /* Calculate slot based on how long in future from head */   \
-                if (dep_time > pq_head_time)                                 \
-                    delta_slots = (uint32_t)((dep_time - pq_head_time) >>    \
-                                                    PQ_TICKS_TO_SLOT_SHIFT); \
-                                                                             \
-                /* Ensure packet is not enqueued to far in future */         \
-                /*  and update last departure time of flow  */               \
-                if (delta_slots > PQ_TRESH_FUTURE_SLOTS) {                   \
-                    flows_prev_dep_time[flow_id] =                           \
-                        dep_time - PQ_DEP_TIME_DIFF_TRESHOLD(delta_slots);   \
-                    delta_slots = PQ_TRESH_FUTURE_SLOTS;                     \
-                } else {                                                     \
-                    __critical_path();                                       \
-                    flows_prev_dep_time[flow_id] = dep_time;                 \
-                    /* Note: updating prev deptime only at end of TSO batch*/\
-                    /*       causes problems, so update for each TSO desc */ \
-                    /*       (dep_time may not keep up with cur_time)*/      \
-                }                                                            \
+                /* Only first segment departs at EDT, rest follow by IDT */  \
+                /* First segment decides if whole LSO packet bypasses */     \
+                if (lso_first)                                               \
+                    lso_bypass = (PQ_BYPASS_UNPACED && !pace.flow_id         \
+                                  && !pace.edt && !pq_shape_rate);           \
+                else                                                         \
+                    pace.edt = 0;                                            \
                                                                              \
-                /* Find desired (CTM) slot to enqueue in relation to head */ \
-                pq_d_index = pq_ctm_head + delta_slots;                      \
-                if (pq_d_index >= PQ_CTM_LENGTH) pq_d_index -= PQ_CTM_LENGTH;\
-                                                                             \
-                /* -------------- Find next available index ------- */       \
-                pq_index = pq_find_next_available_slot(pq_d_index);          \
-                                                                             \
-                /* Update delta_slots to reflect found slot */               \
-                delta_slots += PQ_CTM_RING_DIFF(pq_index, pq_d_index);       \
-                                                                             \
-                /* --------- Place packet in queue -------------- */         \
-                                                                             \
-                /* Reflect that packet is enqueued by updating bitmask */    \
-                bitmasks[pq_index >> INDEX_TO_BITMASK_SHIFT] |=              \
-                                (1u << (pq_index & INDEX_IN_BITMASK_MASK));  \
-                                                                             \
-                /* Place packet directly in lmem if close departure time */  \
-                if (delta_slots < (PQ_LM_LENGTH)) {                          \
-                    /* convert index to lmem */                              \
-                    pq_index = (pq_lm_head + delta_slots);                   \
-                    if (pq_index >= PQ_LM_LENGTH) pq_index -= PQ_LM_LENGTH;  \
+                /* ======= Enqueue packet ============================= */   \
                                                                              \
-                    /* Place packet in next available slot in pacing queue */  \
-                    lm_pacing_queue[pq_index].__raw[0] = pkt_desc_tmp.__raw[0];\
-                    lm_pacing_queue[pq_index].__raw[1] = (lso_pkt.desc.__raw[1]\
-                                                |  notify_reset_state_gpr);    \
-                    lm_pacing_queue[pq_index].__raw[2] = lso_pkt.desc.__raw[2];\
-                    lm_pacing_queue[pq_index].__raw[3] = lso_pkt.desc.__raw[3] \
-                                                       & 0xFFFF0000;           \
-                                                                               \
-                    /* mark lmem slot as occupied, (prev sync from ovrwrt) */\
-                    lm_bitmasks[pq_index >> INDEX_TO_BITMASK_SHIFT] |=       \
-                                (1u <<  (pq_index & INDEX_IN_BITMASK_MASK)); \
+                /* Later segments add their IDT to the departure time of */  \
+                /* the previous one in GPRs, the flow state is only */       \
+                /* updated once the last segment is enqueued (the next */    \
+                /* packet of the side is not processed before that). */      \
+                /* Segments never depart before the previous one */          \
+                if (lso_bypass) {                                            \
+                    pq_bypass(&pkt_out);                                     \
                 } else {                                                     \
-                    /* -------- Send packet to CTM -------- */               \
-                    __ctm40 void *ctm_ptr;                                   \
-                    unsigned int addr_hi, addr_lo;                           \
-                                                                             \
-                    switch (next_batch_out) {                                \
-                        case 0: _SEND_PACKET_LSO_TO_CTM(0); break;           \
-                        case 1: _SEND_PACKET_LSO_TO_CTM(1); break;           \
-                        case 2: _SEND_PACKET_LSO_TO_CTM(2); break;           \
-                        case 3: _SEND_PACKET_LSO_TO_CTM(3); break;           \
-                        case 4: _SEND_PACKET_LSO_TO_CTM(4); break;           \
-                        case 5: _SEND_PACKET_LSO_TO_CTM(5); break;           \
-                        case 6: _SEND_PACKET_LSO_TO_CTM(6); break;           \
-                        case 7: _SEND_PACKET_LSO_TO_CTM(7); break;           \
-                    }                                                        \
-                    next_batch_out++;                                        \
-                    next_batch_out &= 7;                                     \
+                    if (lso_first)                                           \
+                        dep_time = pq_departure_time(&pace, 0);              \
+                    else                                                     \
+                        dep_time = pq_departure_next(&pace, lso_dep_time);   \
+                    PQ_TRACE_FLOW_SET(pkt_out.__raw[0], pace.flow_id);       \
+                    if (pq_shape_rate)                                       \
+                        pq_shape_queue(pkt_out.data_len - pkt_out.offset);   \
+                    pq_enqueue(dep_time, &pkt_out);                          \
+                    pq_cnt_paced++;                                          \
+                    lso_dep_time = dep_time;                                 \
+                    lso_segs++;                                              \
                 }                                                            \
                                                                              \
+                lso_first = 0;                                               \
             }                                                                \
                                                                              \
             /* if last LSO from ring, break out of LSO loop */               \
             if (lso_pkt.desc.lso == NFD_IN_ISSUED_DESC_LSO_RET) break;       \
         }                                                                    \
+                                                                             \
+        /* The first segment already updated the flow */                     \
+        if (lso_segs > 1 && pace.flow_id)                                    \
+            pq_flow_commit(&pace, lso_dep_time);                             \
     }                                                                        \
 } while (0)
 
+/**
+ * Take count of lateness histogram bucket for adding to EMEM, and add it
+ * to late if the bucket counts as late
+ *
+ */
+__intrinsic uint32_t
+pq_late_hist_take(uint32_t bucket, __gpr uint32_t *late)
+{
+    uint32_t cnt;
+
+    cnt = lm_late_hist[bucket];
+    lm_late_hist[bucket] = 0;
+    if (bucket >= PQ_LATE_BUCKET)
+        *late += cnt;
+
+    return cnt;
+}
+
+/**
+ * Add counts kept in GPRs and LM to pq_counters and pq_late_hist, once a
+ * batch of them added up or the pacing queue is empty
+ *
+ */
+__intrinsic void
+pq_cnt_flush()
+{
+    __xwrite uint32_t cnt_out[6];
+    __gpr uint32_t late;
+    uint32_t paced, collision, horizon, squashed, bucket;
+
+    if (pq_cnt_paced < PQ_CNT_BATCH && pq_cnt_dequeued < PQ_CNT_BATCH &&
+        (pq_occupancy || (pq_cnt_paced | pq_cnt_dequeued | pq_cnt_collision |
+                          pq_cnt_horizon | pq_cnt_squashed) == 0))
+        return;
+
+    /* Each count is cleared as it is taken, before the context swaps */
+    paced = pq_cnt_paced;
+    collision = pq_cnt_collision;
+    horizon = pq_cnt_horizon;
+    squashed = pq_cnt_squashed;
+    pq_cnt_paced = 0;
+    pq_cnt_collision = 0;
+    pq_cnt_horizon = 0;
+    pq_cnt_squashed = 0;
+    pq_cnt_dequeued = 0;
+
+    /* Add histogram 4 buckets at a time */
+    late = 0;
+    for (bucket = 0; bucket < PQ_LATE_HIST_LENGTH; bucket += 4) {
+        cnt_out[0] = pq_late_hist_take(bucket, &late);
+        cnt_out[1] = pq_late_hist_take(bucket + 1, &late);
+        cnt_out[2] = pq_late_hist_take(bucket + 2, &late);
+        cnt_out[3] = pq_late_hist_take(bucket + 3, &late);
+        mem_add32(cnt_out, &pq_late_hist[bucket], 4 * sizeof(uint32_t));
+    }
+
+    /* PQ_CNT_SLOT_COLLISION to PQ_CNT_SQUASHED are adjacent, so one add
+       covers them, PQ_CNT_TRACE_DROP between them is added 0 */
+    cnt_out[0] = collision;
+    cnt_out[1] = 0;
+    cnt_out[2] = paced;
+    cnt_out[3] = late;
+    cnt_out[4] = horizon;
+    cnt_out[5] = squashed;
+    mem_add32(cnt_out, &pq_counters[PQ_CNT_SLOT_COLLISION], sizeof(cnt_out));
+}
+
+/**
+ * Take runtime configuration written by the host, if its gen changed since
+ * it was last read (at most every PQ_CONFIG_POLL_TICKS). Not while the host
+ * writes it (gen odd, or changed by the time it is read again), nor while the
+ * coarse wheel is locked: a cascade checked its slot against the threshold
+ * before it swapped out, and a lower one would send entries back to the
+ * coarse wheel, where pq_cw_enqueue() waits for the lock the cascade holds
+ *
+ */
+__intrinsic void
+pq_config_poll()
+{
+    __xread struct pq_config config_in;
+    __xread uint32_t gen_in;
+    uint32_t now, gen, tresh, high, low, shape;
+
+    now = (uint32_t)get_current_time();
+    if (now - pq_config_polled < PQ_CONFIG_POLL_TICKS) return;
+    pq_config_polled = now;
+
+    mem_read32(&config_in, &pq_config, sizeof(config_in));
+    gen = config_in.gen;
+    if (gen == pq_config_gen || (gen & 1)) return;
+
+    /* Values read with gen are only whole if it did not change since */
+    mem_read32(&gen_in, &pq_config.gen, sizeof(gen_in));
+    if (gen_in != gen) return;
+
+    /* No swap from here on, so no cascade starts before it is taken */
+    if (pq_cw_lock) {
+        pq_config_polled -= PQ_CONFIG_POLL_TICKS;
+        return;
+    }
+    pq_config_gen = gen;
+
+    tresh = config_in.tresh_future_slots;
+    if (tresh == 0) tresh = PQ_TRESH_FUTURE_SLOTS;
+    high = config_in.occupancy_high;
+    if (high == 0) high = PQ_OCCUPANCY_HIGH;
+    low = config_in.occupancy_low;
+    if (low == 0) low = PQ_OCCUPANCY_LOW;
+
+    if (tresh < PQ_TRESH_FUTURE_SLOTS_MIN ||
+        tresh > PQ_TRESH_FUTURE_SLOTS_MAX ||
+        high > PQ_CTM_LENGTH || low >= high)
+        return;
+
+    pq_tresh_future_slots = tresh;
+    pq_occupancy_high = high;
+    pq_occupancy_low = low;
+
+    /* Debt of the old rate does not carry over */
+    shape = config_in.shape_rate;
+    if (shape != pq_shape_rate) {
+        pq_shape_rate = shape;
+        pq_shape_time = 0;
+        pq_shape_frac = 0;
+        pq_shape_backlog = 0;
+    }
+}
+
 __intrinsic void
 sync_dequeue_loop() {
     /* Give other threads chance to run */
@@ -999,6 +2235,10 @@ sync_dequeue_loop() {
 
     sync_ctm_lm();
     dequeue_pacing_queue();
+    pq_cw_cascade();
+    pq_ovf_drain();
+    pq_cnt_flush();
+    pq_config_poll();
 }
 
 /**
@@ -1025,9 +2265,9 @@ _notify(__shared __gpr unsigned int *complete,
     __lmem struct nfd_in_issued_desc lm_batch_in;
 
     /* K_pace: variables we use to enqueue */
-    uint16_t vlan_field;
-    uint32_t flow_id, idt_ticks, pq_index, pq_d_index, delta_slots;
-    uint64_t dep_time, curtime;
+    __gpr struct nfd_in_pkt_desc pkt_out;
+    __gpr struct pq_pace pace;
+    uint64_t dep_time;
 
     unsigned int i;
 
@@ -1046,11 +2286,16 @@ _notify(__shared __gpr unsigned int *complete,
         ctm_ring_get(NOTIFY_RING_ISL, input_ring, &batch_in.pkt4,
                      (sizeof(struct nfd_in_issued_desc) * 4), &msg_sig1);
 
+#ifdef NOTIFY_EMU
+        *served += NFD_IN_MAX_BATCH_SZ;
+        wait_sig_mask(wait_msk);
+#else
         __asm {
             ctx_arb[--], defer[2];
             local_csr_wr[local_csr_active_ctx_wakeup_events, wait_msk];
             alu[*served, *served, +, NFD_IN_MAX_BATCH_SZ];
         }
+#endif
 
         wait_msk = __signals(&msg_sig0, &msg_sig1);
         __implicit_read(&msg_sig0);
@@ -1082,6 +2327,7 @@ _notify(__shared __gpr unsigned int *complete,
         qc_queue = NFD_NATQ2QC(NFD_BMQ2NATQ(batch_in.pkt0.q_num),
                                NFD_IN_TX_QUEUE);
 
+        pq_backpressure();
         wait_for_all(&qc_sig);
         
         __qc_add_to_ptr_ind(PCIE_ISL, qc_queue, QC_RPTR, n_batch,
@@ -1153,6 +2399,7 @@ _notify(__shared __gpr unsigned int *complete,
         lm_batch_in = batch_in.pkt0;
         _NOTIFY_PROC;
 
+        pq_backpressure();
         wait_for_all(&qc_sig);
 
         /* Increment the TX_R pointer for this queue by n_batch */
@@ -0,0 +1,17 @@
+#!/bin/bash
+set -euo pipefail
+
+# Build pq_trace_drain against libnfp of the NFP BSP (headers and library
+# under $NFP_BSP, /opt/netronome by default):
+#   ./build.sh
+#   NFP_BSP=$HOME/nfp-bsp ./build.sh
+
+cd "$(dirname "$0")"
+
+CC="${CC:-gcc}"
+CFLAGS="${CFLAGS:--O2 -g}"
+NFP_BSP="${NFP_BSP:-/opt/netronome}"
+
+$CC -std=gnu11 $CFLAGS -Wall -I"$NFP_BSP/include" \
+    -o pq_trace_drain pq_trace_drain.c \
+    -L"$NFP_BSP/lib" -Wl,-rpath,"$NFP_BSP/lib" -lnfp
@@ -0,0 +1,151 @@
+/*
+ * @file          modified-nfd-firmware/trace/pq_trace.h
+ * @brief         Host side of the trace ring of notify.c (pq_trace), and
+ *                the file pq_trace_drain writes
+ *
+ * notify.c adds a record to the ring for each packet dequeued from the
+ * pacing queue, at index seq % PQ_TRACE_LENGTH, writing each record with
+ * one command. There is no producer index: the reader knows the seq of
+ * the record it wants next, and checks the one at its index:
+ *  - same seq: written, take it
+ *  - older seq: not written yet, poll again later
+ *  - newer seq: the ring wrapped past the reader, which skips to the
+ *    oldest record that can still be there and counts the rest as lost
+ * Seqs are compared as a signed 32 bit difference, so they may wrap.
+ */
+#ifndef _PQ_TRACE_H_
+#define _PQ_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* As in notify.c */
+#define PQ_TRACE_LENGTH         65536
+#define PQ_TRACE_MASK           (PQ_TRACE_LENGTH - 1u)
+#define PQ_TRACE_SYMBOL         "_pq_trace"
+#define PQ_TRACE_TICK_NS        20
+
+/* Record in the ring and in the file (struct pq_trace_rec in notify.c),
+ * times are the low 32 bits of the ME timestamp, in PQ_TRACE_TICK_NS */
+struct pq_trace_rec {
+    uint32_t seq;               /* number of record, from 1 */
+    uint32_t flow_occ;          /* flow ID << 16 | pacing queue occupancy */
+    uint32_t slot_time;         /* time of slot the packet was in */
+    uint32_t deq_time;          /* time of dequeue */
+};
+
+#define PQ_TRACE_FLOW(_rec)     ((_rec)->flow_occ >> 16)
+#define PQ_TRACE_OCC(_rec)      ((_rec)->flow_occ & 0xFFFF)
+
+/* File: this header, then records in seq order (gaps are lost records) */
+#define PQ_TRACE_FILE_MAGIC     0x52545150      /* "PQTR" */
+#define PQ_TRACE_FILE_VERSION   1
+
+struct pq_trace_file_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t tick_ns;
+    uint32_t rec_size;
+};
+
+/* Read len bytes at offset off of the ring, 0 on success */
+typedef int (*pq_trace_read_fn)(void *arg, size_t off, void *buf,
+                                size_t len);
+
+struct pq_trace_reader {
+    pq_trace_read_fn read;
+    void *arg;
+    uint32_t next;              /* seq of next record to take */
+    uint64_t taken;
+    uint64_t lost;
+};
+
+/**
+ * Start reading at the record after the newest one in the ring, or at the
+ * oldest one still there (from_oldest). 0 on success.
+ */
+static inline int
+pq_trace_reader_init(struct pq_trace_reader *r, pq_trace_read_fn read,
+                     void *arg, int from_oldest)
+{
+    static struct pq_trace_rec ring[PQ_TRACE_LENGTH];
+    uint32_t i, newest;
+
+    r->read = read;
+    r->arg = arg;
+    r->taken = 0;
+    r->lost = 0;
+
+    if (read(arg, 0, ring, sizeof(ring)))
+        return -1;
+
+    /* Records are written in seq order, so the newest is the one the
+       next index does not follow (all 0 if nothing was written) */
+    newest = 0;
+    for (i = 0; i < PQ_TRACE_LENGTH; i++) {
+        if (ring[i].seq &&
+            ring[(i + 1) & PQ_TRACE_MASK].seq != ring[i].seq + 1) {
+            newest = ring[i].seq;
+            break;
+        }
+    }
+
+    r->next = newest + 1;
+    if (from_oldest && newest) {
+        r->next = newest + 1 - PQ_TRACE_LENGTH;
+        if ((int32_t)r->next < 1)
+            r->next = 1;
+    }
+    return 0;
+}
+
+/**
+ * Take up to max records written since the last call, in seq order.
+ * Returns how many were put in out, or -1 if the ring could not be read.
+ */
+static inline int
+pq_trace_poll(struct pq_trace_reader *r, struct pq_trace_rec *out,
+              unsigned int max)
+{
+    uint32_t index, first_len;
+    unsigned int i, n = 0;
+    int32_t ahead;
+
+    if (max > PQ_TRACE_LENGTH)
+        max = PQ_TRACE_LENGTH;
+
+    /* Read max records from the index of next, in two parts if it wraps */
+    index = r->next & PQ_TRACE_MASK;
+    first_len = PQ_TRACE_LENGTH - index;
+    if (first_len > max)
+        first_len = max;
+    if (r->read(r->arg, index * sizeof(*out), out,
+                first_len * sizeof(*out)))
+        return -1;
+    if (max > first_len &&
+        r->read(r->arg, 0, out + first_len,
+                (max - first_len) * sizeof(*out)))
+        return -1;
+
+    for (i = 0; i < max; i++) {
+        ahead = (int32_t)(out[i].seq - r->next);
+        if (ahead < 0)
+            break;
+
+        if (ahead > 0) {
+            /* Overwritten, records older than one ring before it are
+               lost, the next one may still be there */
+            r->lost += ahead - PQ_TRACE_LENGTH + 1;
+            r->next = out[i].seq - PQ_TRACE_LENGTH + 1;
+            continue;
+        }
+
+        out[n++] = out[i];
+        r->next++;
+    }
+
+    r->taken += n;
+    return n;
+}
+
+#endif /* !_PQ_TRACE_H_ */
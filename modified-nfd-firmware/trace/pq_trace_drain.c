@@ -0,0 +1,224 @@
+/*
+ * @file          modified-nfd-firmware/trace/pq_trace_drain.c
+ * @brief         Drain the trace ring of notify.c to a file, or print such
+ *                a file
+ *
+ * Polls the _pq_trace symbol of the loaded firmware over the NFP CPP
+ * interface (libnfp of the NFP BSP), and appends the records written since
+ * the last poll to the file (see pq_trace.h), until interrupted or for the
+ * given time. The ring holds 65536 records, so poll well within the time
+ * the NIC takes to send as many packets (6.5 ms at 10 Mpps).
+ *
+ * usage: pq_trace_drain [-n nfp] [-i poll_us] [-t seconds] [-O] -o file
+ *        pq_trace_drain -d file     print file, one record per line
+ *  -O  start with the records already in the ring, not only new ones
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nfp.h>
+#include <nfp_cpp.h>
+#include <nfp_rtsym.h>
+
+#include "pq_trace.h"
+
+#define POLL_RECS       4096
+
+struct ring {
+    struct nfp_cpp *cpp;
+    uint32_t cpp_id;
+    uint64_t addr;
+};
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static int
+ring_read(void *arg, size_t off, void *buf, size_t len)
+{
+    struct ring *ring = arg;
+
+    if (nfp_cpp_read(ring->cpp, ring->cpp_id, ring->addr + off, buf,
+                     len) != (int)len)
+        return -1;
+    return 0;
+}
+
+static double
+now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+drain(unsigned int nfp, const char *path, unsigned int poll_us,
+      double duration, int from_oldest)
+{
+    static struct pq_trace_rec recs[POLL_RECS];
+    struct pq_trace_file_hdr hdr;
+    struct pq_trace_reader reader;
+    const struct nfp_rtsym *sym;
+    struct nfp_device *dev;
+    struct ring ring;
+    double start;
+    FILE *f;
+    int n;
+
+    dev = nfp_device_open(nfp);
+    if (!dev) {
+        fprintf(stderr, "cannot open nfp %u: %s\n", nfp, strerror(errno));
+        return 1;
+    }
+
+    sym = nfp_rtsym_lookup(dev, PQ_TRACE_SYMBOL);
+    if (!sym) {
+        fprintf(stderr, "no %s in firmware (built without PQ_TRACE?)\n",
+                PQ_TRACE_SYMBOL);
+        nfp_device_close(dev);
+        return 1;
+    }
+    if (sym->size != PQ_TRACE_LENGTH * sizeof(struct pq_trace_rec)) {
+        fprintf(stderr, "%s is %llu bytes, expected %zu\n", PQ_TRACE_SYMBOL,
+                (unsigned long long)sym->size,
+                PQ_TRACE_LENGTH * sizeof(struct pq_trace_rec));
+        nfp_device_close(dev);
+        return 1;
+    }
+
+    ring.cpp = nfp_device_cpp(dev);
+    ring.cpp_id = NFP_CPP_ISLAND_ID(sym->target, NFP_CPP_ACTION_RW, 0,
+                                    sym->domain);
+    ring.addr = sym->addr;
+
+    f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        nfp_device_close(dev);
+        return 1;
+    }
+    hdr.magic = PQ_TRACE_FILE_MAGIC;
+    hdr.version = PQ_TRACE_FILE_VERSION;
+    hdr.tick_ns = PQ_TRACE_TICK_NS;
+    hdr.rec_size = sizeof(struct pq_trace_rec);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    if (pq_trace_reader_init(&reader, ring_read, &ring, from_oldest)) {
+        fprintf(stderr, "cannot read %s\n", PQ_TRACE_SYMBOL);
+        fclose(f);
+        nfp_device_close(dev);
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    start = now_s();
+    while (!stop && (duration <= 0 || now_s() - start < duration)) {
+        n = pq_trace_poll(&reader, recs, POLL_RECS);
+        if (n < 0) {
+            fprintf(stderr, "cannot read %s\n", PQ_TRACE_SYMBOL);
+            break;
+        }
+        if (n > 0 && fwrite(recs, sizeof(recs[0]), n, f) != (size_t)n) {
+            fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+            break;
+        }
+
+        /* A full poll means more is waiting */
+        if (n < POLL_RECS)
+            usleep(poll_us);
+    }
+
+    fclose(f);
+    nfp_device_close(dev);
+
+    fprintf(stderr, "%llu records, %llu lost\n",
+            (unsigned long long)reader.taken,
+            (unsigned long long)reader.lost);
+    return 0;
+}
+
+static int
+dump(const char *path)
+{
+    struct pq_trace_file_hdr hdr;
+    struct pq_trace_rec rec;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        hdr.magic != PQ_TRACE_FILE_MAGIC ||
+        hdr.version != PQ_TRACE_FILE_VERSION ||
+        hdr.rec_size != sizeof(rec)) {
+        fprintf(stderr, "%s is not a trace file\n", path);
+        fclose(f);
+        return 1;
+    }
+
+    printf("# seq flow occupancy slot_time deq_time late_ns\n");
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        printf("%u %u %u %u %u %lld\n", rec.seq, PQ_TRACE_FLOW(&rec),
+               PQ_TRACE_OCC(&rec), rec.slot_time, rec.deq_time,
+               (long long)(int32_t)(rec.deq_time - rec.slot_time) *
+                   hdr.tick_ns);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: pq_trace_drain [-n nfp] [-i poll_us] [-t seconds] [-O] "
+            "-o file\n"
+            "       pq_trace_drain -d file\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *out = NULL, *in = NULL;
+    unsigned int nfp = 0, poll_us = 1000;
+    double duration = 0;
+    int opt, from_oldest = 0;
+
+    while ((opt = getopt(argc, argv, "n:i:t:Oo:d:")) != -1) {
+        switch (opt) {
+        case 'n': nfp = atoi(optarg); break;
+        case 'i': poll_us = atoi(optarg); break;
+        case 't': duration = atof(optarg); break;
+        case 'O': from_oldest = 1; break;
+        case 'o': out = optarg; break;
+        case 'd': in = optarg; break;
+        default: usage();
+        }
+    }
+
+    if (in)
+        return dump(in);
+    if (!out)
+        usage();
+    return drain(nfp, out, poll_us, duration, from_oldest);
+}
@@ -0,0 +1,67 @@
+#!/bin/bash
+set -euo pipefail
+
+# Request/response latency of small unpaced packets (flow 0) sent through the NFP
+# Compare bypass vs. pacing queue by building firmware with PQ_BYPASS_UNPACED 1 and 0:
+#   sudo ./run-latency-test.sh bypass
+#   sudo ./run-latency-test.sh wheel
+# (requires netserver running on tester)
+
+if (( EUID != 0 )); then
+  echo "Please run as root (sudo $0 <label>)"
+  exit 1
+fi
+
+LABEL="${1:-}"
+if [ -z "$LABEL" ]; then
+  echo "usage: $0 <label> (e.g. bypass or wheel)"
+  exit 1
+fi
+
+NFP_IF="enp2s0np0"
+# NFP_IF="enp1s0np1"
+IP_TESTER="10.111.0.3"
+# IP_TESTER="192.168.50.2"
+
+USER="kevinnm"
+# USER="kevinm"
+
+DUR=10   # seconds to run each test
+SIZES="64 512 1400"   # request/response sizes
+PERSIST=/var/tmp/latency-test-output
+mkdir -p "$PERSIST"
+OUT="$PERSIST/latency-$LABEL.csv"
+
+echo "Disabling GRO and LRO on $NFP_IF"
+ethtool -K "$NFP_IF" gro off lro off || true
+# set interupts created for each packet after delay of 0 us
+ethtool -C "$NFP_IF" adaptive-rx off rx-usecs 0 rx-frames 1 || true
+
+# set all cores to performance mode (instead of powersave)
+cpufreq-set -g performance
+
+echo "size,min_us,mean_us,p50_us,p90_us,p99_us,max_us,trans_per_s" > "$OUT"
+
+for size in $SIZES; do
+  echo ""
+  echo "Running TCP_RR with $size B request/response (pinned to cpu 1)"
+  # (single transaction in flight, so flow stays below burst threshold -> flow 0)
+  res=$(taskset -c 1 netperf -H "$IP_TESTER" -t TCP_RR -l "$DUR" -P 0 -- \
+          -r "$size,$size" \
+          -o MIN_LATENCY,MEAN_LATENCY,P50_LATENCY,P90_LATENCY,P99_LATENCY,MAX_LATENCY,THROUGHPUT)
+  echo "$size,$res" | tee -a "$OUT"
+done
+
+chown -R $USER:$USER "$PERSIST"
+
+# no need to restore other nic changes, as we only use machine for testing
+cpufreq-set -g powersave
+
+echo ""
+echo "Test finished sucessfully, output in $OUT"
+for other in "$PERSIST"/latency-*.csv; do
+  [ "$other" = "$OUT" ] && continue
+  echo ""
+  echo "Compared to $other:"
+  paste -d'\n' "$other" "$OUT" | column -t -s,
+done